@@ -196,6 +196,12 @@ int main(int argc, char *argv[])
 
     cout << "Starting simulation '" << D->config().Output.title << "'..." << endl << endl;
 
+    if (D->ion_count() == 0 && D->config().Transport.weight_window_pilot
+        && D->getSim()->weightWindow().empty())
+        cout << "Weight window pilot run: " << D->config().Transport.weight_window_pilot
+             << " ion histories." << endl
+             << endl;
+
     info.init(D.get());
     info.print();
 
@@ -203,13 +209,17 @@ int main(int argc, char *argv[])
     g_driver_ptr = D.get();
     signal(SIGINT, sigint_handler);
 
-    D->exec(progress_callback, 200);
+    int ret = D->exec(progress_callback, 200, nullptr, &cerr);
 
     // Guard: run_history is empty only if exec() returned early (n_end <= n_start).
     // For all other exits including SIGINT abort, exec() pushes before returning.
     if (!D->run_history().empty()) {
         const mcdriver::run_data &rd = D->run_history().back();
         cout << endl << endl << "Completed " << rd.total_ion_count << " ion histories." << endl;
+        cout << "Stop reason: " << rd.stop_reason << endl;
+        if (rd.rel_sem >= 0)
+            cout << "Relative SEM of " << D->config().Run.precision_tally << ": " << rd.rel_sem
+                 << endl;
         cout << "Threads: " << rd.nthreads << endl;
         cout << "CPU time (s):  " << rd.cpu_time_s << ",\t" << "Ions/cpu-s:  " << rd.ions_per_cpu_s
              << endl;
@@ -221,10 +231,17 @@ int main(int argc, char *argv[])
     fname += ".h5";
     cout << "Storing results in " << fname << " ...";
     cout.flush();
-    D->save(fname, &cerr);
-    cout << " OK." << endl;
+    if (D->save(fname, &cerr) == 0) {
+        const mcdriver::save_stats_t &st = D->save_stats();
+        cout << " OK." << endl;
+        cout << "Saved " << st.file_bytes / 1.e6 << " MB in " << st.wall_time_s << " s ("
+             << st.mb_per_s() << " MB/s)" << endl;
+    } else {
+        cout << " failed." << endl;
+        return -1;
+    }
 
-    return 0;
+    return ret;
 }
 
 void running_sim_info::init(const mcdriver *d)
@@ -407,6 +407,13 @@ const mccore *McDriverObj::getSim() const
     return driver_ ? driver_->getSim() : nullptr;
 }
 
+int McDriverObj::mapEvents(mccore::stream_id_t id, event_view &v)
+{
+    if (!driver_ || status() != mcIdle || io_op_active_)
+        return -1;
+    return driver_->mapEvents(id, v);
+}
+
 void McDriverObj::reset()
 {
     if (status() == mcRunning) {
@@ -130,6 +130,10 @@ public:
     const tally &getTally() const;
     const mccore *getSim() const;
 
+    // map the events of a stream for viewing
+    // only when the simulation is idle, returns 0 on success
+    int mapEvents(mccore::stream_id_t id, event_view &v);
+
     // get run parameters
     size_t maxIons() const { return max_ions_; }
     int nThreads() const { return nThreads_; }
@@ -5,6 +5,7 @@
 #include "optionsmodel.h"
 #include "mcdriverobj.h"
 #include "tally.h"
+#include "event_stream.h"
 #include "value_with_error.h"
 
 #include <QVBoxLayout>
@@ -562,6 +563,145 @@ public:
     }
 };
 
+class pka_events_table : public data_table
+{
+    constexpr static int drows{ 4 };
+    constexpr static std::array<const char *, drows> rowLabels_{ "PKA events", "PKA energy (eV)",
+                                                                 "Damage energy (eV)",
+                                                                 "Vacancies" };
+    QLabel *note_;
+
+public:
+    pka_events_table() : data_table("PKA Events", drows), note_(nullptr) { }
+    virtual const char *rowLabel(int i) const override { return rowLabels_[i]; }
+    virtual void create() override
+    {
+        data_table::create();
+
+        widget_ = new QWidget;
+        QVBoxLayout *vbox = new QVBoxLayout;
+        widget_->setLayout(vbox);
+        note_ = new QLabel;
+        vbox->addWidget(note_);
+        vbox->addWidget(tblWidget_);
+    }
+    virtual void init(const target &t) override
+    {
+        if (!tblWidget_)
+            return;
+        auto &atoms = t.atoms();
+
+        tblWidget_->setColumnCount(atoms.size()); // atoms - projectile + total
+        QStringList lbls;
+        for (const atom *at : atoms) {
+            if (at->id())
+                lbls << QString("%1 in %2")
+                                .arg(at->symbol().c_str())
+                                .arg(at->mat()->name().c_str());
+        }
+        lbls << "Total";
+        tblWidget_->setHorizontalHeaderLabels(lbls);
+
+        for (int i = 0; i < rows_; ++i) {
+            for (int j = 0; j < atoms.size(); ++j) {
+                tblWidget_->setItem(i, j, new QTableWidgetItem());
+            }
+        }
+
+        // sums of w, w*x, w*x^2 and event counts
+        buff = ArrayNDd(4, rows_, atoms.size());
+    }
+    virtual void clear() override
+    {
+        data_table::clear();
+        if (note_)
+            note_->clear();
+    }
+    // the table is filled from the event records, not the tally totals
+    virtual void update(const ArrayNDd &t, const ArrayNDd &dt) override { }
+
+    // read the PKA events through an event_view. Only when the simulation is idle
+    void updateEvents(McDriverObj *D)
+    {
+        if (!tblWidget_ || buff.isNull())
+            return;
+
+        if (!D->options().Output.store_pka_events) {
+            note_->setText("PKA events are not stored (Output.store_pka_events = false)");
+            return;
+        }
+
+        event_view v;
+        if (D->mapEvents(mccore::PkaStream, v) != 0) {
+            note_->setText(D->options().Output.direct_event_output
+                                   ? "PKA events are written directly to the output file"
+                                   : "PKA events could not be mapped");
+            return;
+        }
+
+        auto pid = v.column<int32_t>("pid");
+        auto E = v.column<float>("E");
+        auto Tdam = v.column<float>("Tdam");
+        auto w = v.column<float>("w");
+        int cols = buff.dim()[2];
+        std::vector<event_column_view<float>> V(cols - 1);
+        bool ok = pid.size() && E.size() && Tdam.size();
+        for (int j = 0; j < cols - 1; ++j) {
+            V[j] = v.column<float>("V" + std::to_string(j + 1));
+            ok = ok && V[j].size() == v.rows();
+        }
+        if (v.rows() && !ok) {
+            note_->setText("Unexpected PKA event layout");
+            return;
+        }
+
+        buff.clear();
+        for (size_t k = 0; k < v.rows(); ++k) {
+            int j = pid[k] - 1;
+            if (j < 0 || j >= cols - 1)
+                continue;
+            double wk = w.size() ? w[k] : 1.;
+            double x[drows];
+            x[0] = 1.;
+            x[1] = E[k];
+            x[2] = Tdam[k];
+            x[3] = 0.;
+            for (int i = 0; i < cols - 1; ++i)
+                x[3] += V[i][k];
+            for (int i = 0; i < rows_; ++i)
+                for (int jj : { j, cols - 1 }) {
+                    buff(0, i, jj) += wk;
+                    buff(1, i, jj) += wk * x[i];
+                    buff(2, i, jj) += wk * x[i] * x[i];
+                    buff(3, i, jj) += 1;
+                }
+        }
+
+        note_->setText(QString("%1 events, mean values per PKA").arg(v.rows()));
+
+        // format and print the weighted means with error
+        for (int j = 0; j < cols; ++j) {
+            tblWidget_->item(0, j)->setText(QString::number(buff(3, 0, j), 'g'));
+            for (int i = 1; i < rows_; ++i) {
+                double sw = buff(0, i, j), n = buff(3, i, j);
+                if (sw <= 0.) {
+                    tblWidget_->item(i, j)->setText(QString());
+                    continue;
+                }
+                double x = buff(1, i, j) / sw;
+                double dx = buff(2, i, j) / sw - x * x;
+                if (n > 1. && dx > 0.) {
+                    dx = std::sqrt(dx / (n - 1.));
+                    tblWidget_->item(i, j)->setText(QString::fromStdString(
+                            value_with_error(x, dx, 1, std::defaultfloat, true).to_string()));
+                } else {
+                    tblWidget_->item(i, j)->setText(QString::number(x, 'g'));
+                }
+            }
+        }
+    }
+};
+
 TabularView::TabularView(MainUI *ui, QWidget *parent) : QWidget{ parent }, mainui_(ui)
 {
     /* Create & Map widgets to OptionsModel */
@@ -590,6 +730,7 @@ TabularView::TabularView(MainUI *ui, QWidget *parent) : QWidget{ parent }, mainu
     tables_[idxDmgEvntsTbl] = new dmg_events_table;
     tables_[idxDmgParTbl] = new dmg_parameters_table;
     tables_[idxIonStatTbl] = new ion_stat_table;
+    tables_[idxPkaEvntsTbl] = new pka_events_table;
     for (int itbl = 0; itbl < idxNTbls; ++itbl) {
         data_table *tbl = tables_[itbl];
         tbl->create();
@@ -624,6 +765,9 @@ TabularView::TabularView(MainUI *ui, QWidget *parent) : QWidget{ parent }, mainu
     connect(mainui_->driverObj(), &McDriverObj::simulationDestroyed, this,
             &TabularView::onSimulationDestroyed);
 
+    connect(mainui_->driverObj(), &McDriverObj::statusChanged, this,
+            &TabularView::onStatusChanged, Qt::QueuedConnection);
+
     for (int i = 0; i < idxNTbls; ++i) {
         if (tables_[i]->unitSelector())
             connect(tables_[i]->unitSelector(), &QButtonGroup::idToggled, this,
@@ -655,6 +799,14 @@ void TabularView::onSimulationCreated()
         tables_[i]->init(D->getSim()->getTarget());
 
     onTallyUpdate();
+    onStatusChanged();
+}
+
+void TabularView::onStatusChanged()
+{
+    McDriverObj *D = mainui_->driverObj();
+    if (D->status() == McDriverObj::mcIdle)
+        static_cast<pka_events_table *>(tables_[idxPkaEvntsTbl])->updateEvents(D);
 }
 
 void TabularView::onSimulationDestroyed()
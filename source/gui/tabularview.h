@@ -25,6 +25,7 @@ public slots:
     void onTallyUpdate();
     void onSimulationCreated();
     void onSimulationDestroyed();
+    void onStatusChanged();
 
 private:
     MainUI *mainui_;
@@ -32,7 +33,7 @@ private:
     QLineEdit *simTitle_;
     QTabWidget *tabWidget_;
 
-    enum { idxDmgEvntsTbl = 0, idxErgTbl, idxDmgParTbl, idxIonStatTbl, idxNTbls };
+    enum { idxDmgEvntsTbl = 0, idxErgTbl, idxDmgParTbl, idxIonStatTbl, idxPkaEvntsTbl, idxNTbls };
     std::array<data_table *, idxNTbls> tables_;
 };
 
@@ -1,16 +1,218 @@
 #ifndef CASCADE_QUEUE_H
 #define CASCADE_QUEUE_H
 
-#include <queue>
-#include <list>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
 #include <iostream>
 #include <cassert>
+#include <memory>
+#include <shared_mutex>
 
 #include "geometry.h"
 #include "target.h"
 #include "ion.h"
 #include "tally.h"
 #include "event_stream.h"
+#include "random_vars.h"
+
+/**
+ * @brief A uniform partition of the simulation volume into hashable cells
+ *
+ * The volume of a \ref grid3D is divided into cells with
+ * size at least equal to a given length h. Thus, all neighbors of a point within
+ * distance h lie in the 3x3x3 block of cells around it.
+ *
+ * Each cell is identified by an integer key, which can be used in a hash map
+ * so that only occupied cells need to be stored.
+ *
+ * Periodic boundary conditions of the \ref grid3D are respected.
+ */
+class cell_hash_grid
+{
+public:
+    // divide the volume of grid g into cells of size >= h
+    void init(const grid3D &g, float h);
+
+    // cell index along an axis
+    int index(int axis, float x) const
+    {
+        int i = std::floor((x - x0_[axis]) / dx_[axis]);
+        return std::max(0, std::min(i, n_[axis] - 1));
+    }
+    // cell index vector of point x
+    void index(const vector3 &x, int *i) const
+    {
+        i[0] = index(0, x.x());
+        i[1] = index(1, x.y());
+        i[2] = index(2, x.z());
+    }
+    size_t key(int i, int j, int k) const { return (size_t(i) * n_[1] + j) * n_[2] + k; }
+    size_t key(const vector3 &x) const
+    {
+        return key(index(0, x.x()), index(1, x.y()), index(2, x.z()));
+    }
+
+    /*
+     * range [imin, imax] of neighbor cell indexes around cell i0 along each axis
+     *
+     * Along a periodic axis the range may extend beyond the grid and
+     * the indexes must be passed through wrap().
+     * A cell is never visited twice, even if there are less than 3 cells.
+     */
+    void neighbor_range(const int *i0, int *imin, int *imax) const;
+
+    // bring a cell index within the grid, along a periodic axis
+    int wrap(int axis, int i) const { return (i + n_[axis]) % n_[axis]; }
+
+private:
+    // grid origin, cell size & # of cells per axis
+    float x0_[3], dx_[3];
+    int n_[3];
+    bool periodic_[3];
+};
+
+/**
+ * @brief A cell list of defects for fast recombination partner search
+ *
+ * The simulation volume is divided by a \ref cell_hash_grid with
+ * cell size equal to the largest recombination radius
+ * in the target. Thus, all possible recombination partners of a defect lie within the
+ * 3x3x3 block of cells around it.
+ *
+ * Only occupied cells are stored, in a hash map keyed on the cell index.
+ *
+ * Each stored defect carries a sequence number, which reflects the order of insertion.
+ * It is used to break ties in partner search and to retrieve the defects in
+ * insertion order.
+ */
+class defect_cell_list
+{
+public:
+    // a stored defect and its sequence number
+    struct entry
+    {
+        defect d;
+        size_t seq;
+    };
+
+    typedef std::vector<entry> bucket_t;
+
+    // divide the volume of grid g into cells of size >= h
+    void init(const grid3D &g, float h);
+
+    // add a defect
+    void insert(const defect &d, size_t seq);
+
+    /*
+     * find the closest defect of the same species as d1 with
+     * distance < d1.myAtom()->Rc()
+     *
+     * Among defects at equal distance the one with the lower seq is returned.
+     * Returns nullptr if there is no such defect.
+     * The returned pointer is valid until the next insert/erase
+     */
+    const entry *find_partner(const defect &d1, const grid3D &g) const;
+
+    // remove a defect returned by find_partner
+    void erase(const entry *e);
+
+    // copy all defects to v, sorted by sequence number, and clear the list
+    void take_all(std::vector<entry> &v);
+
+    bool empty() const { return size_ == 0; }
+    size_t size() const { return size_; }
+
+private:
+    cell_hash_grid grid_;
+
+    // occupied cells
+    std::unordered_map<size_t, bucket_t> cells_;
+    size_t size_{ 0 };
+};
+
+/**
+ * @brief Find clusters of the surviving defects of a cascade
+ *
+ * Two defects of the same type (vacancies or interstitials, irrespective of species)
+ * belong to the same cluster if they are connected by a chain of
+ * defects, each one within a given radius from the next, i.e., clusters are the
+ * connected components of the neighbor graph.
+ *
+ * Neighbors are found with a \ref cell_hash_grid of cell size equal to the cluster radius,
+ * and components are formed with a union-find structure. The cost is thus
+ * linear in the number of defects.
+ *
+ * The cluster centroid is the mean defect position, computed with minimum-image
+ * displacements along periodic axes.
+ */
+class defect_clusters
+{
+public:
+    struct cluster
+    {
+        size_t n; // # of defects
+        vector3 x; // centroid
+    };
+
+    /**
+     * @brief Construct a cluster finder
+     * @param ag the simulation grid, used for calculating defect distance
+     * @param r the cluster radius [nm]
+     */
+    defect_clusters(const grid3D &ag, float r) : g(ag), r_(r) { grid_.init(g, r); }
+
+    /**
+     * @brief Find the clusters in a set of defects
+     *
+     * All defects should be of the same type. Isolated defects
+     * are returned as clusters of size 1.
+     *
+     * Clusters are ordered by their first defect in d.
+     */
+    void analyze(const std::vector<defect> &d);
+
+    /// The clusters found by the last call to analyze()
+    const std::vector<cluster> &clusters() const { return clusters_; }
+
+    /// Number of clusters with 2 or more defects
+    size_t count() const;
+    /// Number of defects in clusters with 2 or more defects
+    size_t clustered() const;
+    /// Size of the largest cluster
+    size_t max_size() const;
+
+private:
+    const grid3D &g;
+    float r_;
+    cell_hash_grid grid_;
+
+    // occupied cells, storing indexes to the defect array
+    std::unordered_map<size_t, std::vector<uint32_t>> cells_;
+    // union-find parent & cluster slot per defect
+    std::vector<uint32_t> parent_;
+    std::vector<int> slot_;
+    std::vector<cluster> clusters_;
+
+    uint32_t find_(uint32_t i)
+    {
+        while (parent_[i] != i) {
+            parent_[i] = parent_[parent_[i]];
+            i = parent_[i];
+        }
+        return i;
+    }
+    void unite_(uint32_t i, uint32_t j)
+    {
+        i = find_(i);
+        j = find_(j);
+        // the root is always the first defect of the cluster
+        if (i < j)
+            parent_[j] = i;
+        else if (j < i)
+            parent_[i] = j;
+    }
+};
 
 // base class of all cascade objects
 // defines public interface of cascade objects
@@ -18,7 +220,16 @@ class abstract_cascade
 {
 protected:
 public:
-    explicit abstract_cascade(const grid3D &ag) : g(ag) { }
+    /**
+     * @brief Construct a cascade object
+     * @param ag the simulation grid, used for calculating defect distance
+     * @param rc_max the largest recombination radius of all atoms in the target
+     */
+    abstract_cascade(const grid3D &ag, float rc_max) : g(ag)
+    {
+        v_.init(g, rc_max);
+        i_.init(g, rc_max);
+    }
     virtual ~abstract_cascade() { }
 
     virtual void intra_cascade_recombination(ion_queue &q) = 0;
@@ -27,7 +238,7 @@ public:
     // s, sc are corresponding buffers to hold counts per atomic id
     void count_riv(float *s, float *sc) const;
 
-    // return all I-V ion buffers to the ion queue
+    // return the ion buffers of recombined interstitials to the ion queue
     void clear(ion_queue &q);
 
 protected:
@@ -37,66 +248,49 @@ protected:
     // frenkel pair type
     // first: interstitial
     // second: vacancy
-    typedef std::pair<ion *, ion *> frenkel_pair_t;
+    typedef std::pair<defect, defect> frenkel_pair_t;
 
     // container of frenkel pairs
     typedef std::vector<frenkel_pair_t> pair_buff_t;
 
-    // defect container
-    // std::list is used for optimized removal of items regardless of their position
-    // within the container
-    typedef std::list<ion *> defect_list_t;
-
-    defect_list_t v_; // not recombined vacancies
-    defect_list_t i_; // not recombined interstitials
+    defect_cell_list v_; // not recombined vacancies
+    defect_cell_list i_; // not recombined interstitials
     pair_buff_t riv_; // recombined pairs
+    size_t seq_{ 0 }; // insertion counter for v_, i_
 
-    // Comparator for pair<iterator, distance> objects
-    // returns true if distance of lhs is greater than rhs
-    template <typename _T>
-    struct defect_distance_cmp
-    {
-        bool operator()(const _T &lhs, _T &rhs) { return lhs.second > rhs.second; }
-    };
-
-    /*
-     * find recombination partner
-     *
-     * d1: a defect (vacancy or interstitial)
-     * adcont: anti-defect container
-     *
-     * returns (an iterator to) the closest anti-defect that can recombine with d1
-     *
-     */
-    defect_list_t::iterator find_rc_partner(const ion *d1, defect_list_t &adcont);
-
-    // recombine a vacancy with the closest vacancy
-    bool recombine_vacancy(ion *d1);
+    // recombine a vacancy with the closest interstitial
+    bool recombine_vacancy(const defect &d1);
 
     // recombine an interstitial with the closest vacancy
-    bool recombine_interstitial(ion *d1);
+    bool recombine_interstitial(const defect &d1);
+
+    // return all non-recombining Is and Vs back to the ion queue
+    void push_back_defects(ion_queue &q);
 };
 
 /**
  * @brief Order defects according to creation time and then recombine
+ *
+ * All cascade defects are copied to a contiguous array which is sorted once
+ * by creation time. Defects with equal time keep their relative order, vacancies
+ * before interstitials.
  */
 class time_ordered_cascade : public abstract_cascade
 {
 public:
-    explicit time_ordered_cascade(const grid3D &g) : abstract_cascade(g) { }
+    time_ordered_cascade(const grid3D &g, float rc_max) : abstract_cascade(g, rc_max) { }
 
     void intra_cascade_recombination(ion_queue &q) override;
 
 protected:
-    // defect time comparison operator
-    // returns true if the time of lhs is greater than rhs
-    struct defect_time_cmp
-    {
-        bool operator()(const ion *lhs, const ion *rhs) { return lhs->t() > rhs->t(); }
-    };
+    // sort key: bit pattern of the (non-negative) defect time & index in timeline_
+    typedef std::pair<uint64_t, uint32_t> time_key_t;
 
-    // time ordered defect queue
-    typedef std::priority_queue<ion *, std::vector<ion *>, defect_time_cmp> defect_queue_t;
+    std::vector<defect> timeline_; // all cascade defects, V first then I
+    std::vector<time_key_t> keys_, keys_tmp_; // radix sort buffers
+
+    // stable LSD radix sort of keys_ by time
+    void sort_keys_();
 };
 
 /**
@@ -105,9 +299,117 @@ protected:
 class unordered_cascade : public abstract_cascade
 {
 public:
-    explicit unordered_cascade(const grid3D &g) : abstract_cascade(g) { }
+    unordered_cascade(const grid3D &g, float rc_max) : abstract_cascade(g, rc_max) { }
 
     void intra_cascade_recombination(ion_queue &q) override;
 };
 
+/**
+ * @brief A library of pre-simulated PKA cascades
+ *
+ * The library stores the footprints of fully simulated cascades, binned by
+ * PKA species, material and log-energy bin. A footprint consists of
+ * - the defects (vacancies & interstitials) before any recombination
+ * - the energy depositions and replacements registered during the cascade
+ *
+ * Only bulk cascades are stored, i.e., cascades where no recoil exited the target.
+ * A footprint is replayed only if it fits in the target at the PKA position.
+ *
+ * All positions and times are relative to the PKA, in a coordinate system
+ * with the z-axis along the PKA direction.
+ *
+ * When a bin is full, i.e., it holds \ref size() footprints, a PKA falling in
+ * this bin is not simulated. Instead, a randomly chosen footprint is replayed,
+ * randomly rotated around the PKA direction and translated to the PKA position
+ * (see mccore::run()).
+ *
+ * The library is filled on the fly during the simulation and is shared by all threads.
+ * It can be saved to and loaded from an HDF5 file, so that it is reused in later runs.
+ *
+ * @ingroup MC
+ */
+class cascade_library
+{
+public:
+    /// Type of a footprint record
+    enum record_t : uint8_t {
+        Vacancy = 0, ///< A vacancy
+        Interstitial, ///< An interstitial, i.e., a stopped recoil
+        Deposit, ///< Energy deposited by a recoil in a cell
+        Replacement, ///< A replacement event
+        Exit ///< A recoil exits the target. Not stored by current versions
+    };
+
+    /// A footprint record
+    struct record
+    {
+        float x[3]; ///< position relative to the PKA [nm]
+        float t; ///< time after the PKA start [ns]
+        float erg, ioniz, phonon; ///< recoil energy & energy lost to ionization, phonons [eV]
+        float path; ///< recoil path [nm]
+        uint32_t ncoll; ///< recoil collisions
+        int32_t duid; ///< recoil uid relative to the PKA uid
+        uint8_t type; ///< record type, one of \ref record_t
+        uint8_t atom; ///< atom id
+        uint8_t gen; ///< recoil generation relative to the PKA
+        uint8_t reserved;
+    };
+
+    /// The footprint of a PKA cascade
+    struct footprint
+    {
+        float E; ///< PKA kinetic energy [eV]
+        std::vector<record> rec;
+    };
+    typedef std::shared_ptr<const footprint> footprint_ptr;
+
+    /**
+     * @brief Create an empty library
+     * @param natoms # of atoms in the target (incl. the projectile)
+     * @param nmat # of materials
+     * @param n footprints per bin
+     * @param bins_per_decade # of energy bins per decade
+     * @param config_hash hash of the simulation options that determine the cascades
+     */
+    cascade_library(int natoms, int nmat, size_t n, int bins_per_decade,
+                    uint64_t config_hash = 0);
+
+    /// Footprints per bin
+    size_t size() const { return n_; }
+    /// Total # of footprints in the library
+    size_t count() const;
+    /// Hash of the simulation options that determine the cascades
+    uint64_t configHash() const { return hash_; }
+
+    /// Return the bin of a PKA of species atomid & energy E in material matid
+    int key(int atomid, int matid, double E) const
+    {
+        int ie = std::floor(std::log10(E) * bpd_);
+        ie = std::max(0, std::min(ie, ne_ - 1));
+        return (atomid * nmat_ + matid) * ne_ + ie;
+    }
+
+    /// Return a random footprint from bin k, or null if the bin is not full yet
+    footprint_ptr pick(int k, random_vars &rng) const;
+    /// Add a footprint to bin k. Ignored if the bin is already full
+    void add(int k, footprint_ptr f);
+
+    /// Save the library to an HDF5 file. Returns 0 on success
+    int save(const std::string &fname, std::ostream *os = nullptr) const;
+    /**
+     * @brief Load the library from an HDF5 file. Returns 0 on success
+     *
+     * The file is rejected if it was created with different atoms, materials,
+     * energy bins or a different \ref configHash()
+     */
+    int load(const std::string &fname, std::ostream *os = nullptr);
+
+private:
+    int natoms_, nmat_, ne_, bpd_;
+    size_t n_;
+    uint64_t hash_;
+    std::vector<std::vector<footprint_ptr>> bins_;
+    mutable std::shared_mutex mtx_;
+};
+
 #endif // CASCADE_QUEUE_H
@@ -0,0 +1,114 @@
+#ifndef EVENT_READER_H
+#define EVENT_READER_H
+
+#include "event_stream.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Random access reader for event data stored in an OpenTRIM HDF5 output file
+ *
+ * The reader opens the dataset /events/<name>/event_data of a file and reads
+ * event records with the layout of the original \ref event_buffer.
+ *
+ * If the file contains the companion index of the event dataset
+ * (/events/<name>/index, written when the events are saved sorted by history id),
+ * the reader uses it for fast access:
+ * - history_rows() finds the events of a history by binary search in the
+ * per-history offset table
+ * - read_box() reads only the dataset blocks that, according to
+ * the coarse spatial bin masks, may contain events in the requested box
+ *
+ * Without an index, both functions fall back to scanning the dataset.
+ *
+ * Uncompressed datasets can also be memory-mapped with map().
+ *
+ * Example:
+ * @code{.cpp}
+ * event_reader rd;
+ * if (rd.open("out.h5", "damage") == 0) {
+ *     std::vector<char> buff;
+ *     size_t n = rd.read_history(42, buff); // all defects of history 42
+ *     ...
+ * }
+ * @endcode
+ *
+ * @ingroup Tallies
+ */
+class event_reader
+{
+public:
+    event_reader();
+    ~event_reader();
+    event_reader(const event_reader &) = delete;
+    event_reader &operator=(const event_reader &) = delete;
+
+    /**
+     * @brief Open an event dataset
+     * @param fname the HDF5 file name
+     * @param name the event stream name, e.g. "pka", "exit", "damage", "cluster"
+     * @param os if not null, error messages are written here
+     * @return 0 on success
+     */
+    int open(const std::string &fname, const std::string &name, std::ostream *os = nullptr);
+    /// Close the file
+    void close();
+    /// Return true if a dataset is open
+    bool is_open() const;
+
+    /// Number of events (rows) in the dataset
+    size_t rows() const;
+    /// Size of an event record in bytes
+    size_t record_size() const;
+    /// Column layout of the event records
+    const std::vector<event_buffer::column_t> &layout() const;
+    /// Return the index of the column with the given name or -1 if not found
+    int column(const std::string &name) const;
+
+    /// Return true if the dataset has a history id index
+    bool hasHistoryIndex() const;
+    /// Return true if the dataset has a spatial index
+    bool hasSpatialIndex() const;
+
+    /**
+     * @brief Memory-map the event data
+     *
+     * Only possible if the dataset is stored contiguous & uncompressed,
+     * i.e., the file was saved with Output.event_deflate_level = 0.
+     *
+     * @param v the view to map the data into
+     * @return 0 on success
+     */
+    int map(event_view &v) const;
+
+    /// Read n records starting at row first into buff. Returns the # of records read
+    size_t read(size_t first, size_t n, char *buff) const;
+
+    /// Return the row range [first, last) of the events of history hid
+    std::pair<size_t, size_t> history_rows(uint64_t hid) const;
+    /// Read all events of history hid into out. Returns the # of events
+    size_t read_history(uint64_t hid, std::vector<char> &out) const;
+    /// Read all events with position in the box [lo, hi] into out. Returns the # of events
+    size_t read_box(const vector3 &lo, const vector3 &hi, std::vector<char> &out) const;
+
+private:
+    struct impl;
+    std::unique_ptr<impl> d_;
+};
+
+/**
+ * @brief Mutex serializing calls to the HDF5 library
+ *
+ * The HDF5 library may not be thread-safe. Code that reads or writes HDF5 files
+ * from several threads, e.g. event sinks, checkpoint writers or phase-space readers,
+ * must hold this mutex during each call.
+ *
+ * @ingroup Tallies
+ */
+std::mutex &h5_mutex();
+
+#endif // EVENT_READER_H
@@ -2,13 +2,23 @@
 #define EVENT_STREAM_H
 
 #include "geometry.h"
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <cstring>
 #include <string>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <type_traits>
 
 class event_stream;
 class ion;
+struct defect;
+struct defect_info;
 class tally;
 class material;
 class abstract_cascade;
@@ -16,52 +26,307 @@ class abstract_cascade;
 /**
  * @brief The event_buffer class stores data for a given Monte-Carlo event_buffer.
  *
- * The data is a vector of 32-bit float numbers.
+ * The data is a binary record with typed columns. The 1st column is always
+ * the 64-bit unsigned history id. Other columns are 32-bit integers (e.g. species,
+ * cell or recoil ids) or 32/64-bit floating point numbers.
  *
- * The vector size and the meaning of each element depends on the event_buffer type.
+ * The record layout and the meaning of each column depends on the event_buffer type.
  * E.g., for PKA events we may have the energy, position and direction of the PKA recoil
  * and other data.
  *
- * columnNames() and columnDescriptions() give information on the
- * of the event_buffer data.
+ * Each column is naturally aligned within the record. The same layout is used in
+ * the temporary stream buffers and as an HDF5 compound type in the output file.
+ *
+ * layout(), columnNames() and columnDescriptions() give information on the
+ * columns of the event_buffer data.
  *
  * @ingroup Tallies
  *
  */
 class event_buffer
 {
+public:
+    /// Data type of an event column
+    enum column_type_t { Uint64 = 0, Int32, Float32, Float64 };
+
+    /// Physical quantity of an event column, used by \ref event_codec
+    enum column_quantity_t { Value = 0, Position, Direction };
+
+    /// Description of an event column
+    struct column_t
+    {
+        std::string name;
+        std::string description;
+        column_type_t type;
+        size_t offset; ///< byte offset in the record
+        column_quantity_t quantity;
+    };
+
+    /// Size in bytes of a column type
+    static size_t type_size(column_type_t t) { return (t == Int32 || t == Float32) ? 4 : 8; }
+
+    /// Return the history id of an event record
+    static uint64_t history_id(const char *record)
+    {
+        uint64_t id;
+        std::memcpy(&id, record, sizeof(id));
+        return id;
+    }
+
 protected:
     uint32_t mask_{ 0 };
-    std::vector<float> buff_;
-    std::vector<std::string> columnNames_;
-    std::vector<std::string> columnDescriptions_;
+    std::vector<column_t> columns_;
+    size_t record_size_{ 0 };
+    std::vector<uint64_t> buff_; // record storage, 8-byte aligned
+    size_t ofW_{ 0 }; // offset of the weight column, 0 = no weight column
+
+    /// Append a column to the record and return its byte offset
+    size_t add_column(const std::string &name, const std::string &desc, column_type_t t,
+                      column_quantity_t q = Value);
+    /// Remove all columns
+    void clear_columns();
+    /// Add the history id column
+    size_t add_hid_column() { return add_column("hid", "history id", Uint64); }
+
+    template <class T>
+    T &at_(size_t offset)
+    {
+        return *reinterpret_cast<T *>(reinterpret_cast<char *>(buff_.data()) + offset);
+    }
+    template <class T>
+    const T &at_(size_t offset) const
+    {
+        return *reinterpret_cast<const T *>(reinterpret_cast<const char *>(buff_.data())
+                                            + offset);
+    }
 
 public:
     /// @brief Create empty event_buffer
     explicit event_buffer(uint32_t m = 0) : mask_(m) { }
-    /// @brief Create an event_buffer of size n with given column names and descriptions
-    event_buffer(uint32_t m, size_t n, const std::vector<std::string> &names,
-                 const std::vector<std::string> &descs)
-        : mask_(m), buff_(n), columnNames_(names), columnDescriptions_(descs)
-    {
-    }
     virtual ~event_buffer() { }
     /// zero-out event_buffer data
-    void reset()
-    {
-        if (!buff_.empty())
-            std::memset(buff_.data(), 0, buff_.size() * sizeof(float));
-    }
+    void reset() { std::fill(buff_.begin(), buff_.end(), 0); }
     /// A bit mask for the accepted event types
     uint32_t mask() const { return mask_; }
-    /// Return the event_buffer size (# of float values)
-    size_t size() const { return buff_.size(); }
-    /// Return a pointer to the event_buffer data
-    const float *data() const { return buff_.data(); }
+    /// Return the size of the event record in bytes
+    size_t size() const { return record_size_; }
+    /// Return the number of columns
+    size_t columns() const { return columns_.size(); }
+    /// Return a pointer to the event record
+    const char *data() const { return reinterpret_cast<const char *>(buff_.data()); }
+    /// Return the column layout of the record
+    const std::vector<column_t> &layout() const { return columns_; }
+    /**
+     * @brief Append a statistical weight column "w", if not already present
+     *
+     * The weight column is added to all event records when variance reduction
+     * is used and ion histories carry non-unit weights.
+     */
+    void addWeightColumn()
+    {
+        if (!ofW_)
+            ofW_ = add_column("w", "statistical weight", Float32);
+    }
+    /// Return true if the record has a weight column
+    bool weighted() const { return ofW_ != 0; }
+    /// Set the weight column, if present
+    void setWeight(double w)
+    {
+        if (ofW_)
+            at_<float>(ofW_) = w;
+    }
+    /// Return the value of the weight column or 1 if there is no weight column
+    float weight() const { return ofW_ ? at_<float>(ofW_) : 1.f; }
     /// Return the names of the individual event_buffer columns
-    const std::vector<std::string> &columnNames() const { return columnNames_; }
+    std::vector<std::string> columnNames() const;
     /// Return the descriptions of the individual event_buffer columns
-    const std::vector<std::string> &columnDescriptions() const { return columnDescriptions_; }
+    std::vector<std::string> columnDescriptions() const;
+};
+
+/**
+ * @brief Compact lossy encoding of event records
+ *
+ * Position columns are quantized to a resolution \f$ \delta x = 2^k \f$ nm,
+ * i.e., the given resolution rounded down to a power of 2,
+ * and direction columns to \f$ 2^{-16} \f$.
+ * Since the quantization step is a power of 2, quantized floats
+ * are exactly representable and have zero trailing mantissa bits.
+ *
+ * encode() writes a block of records as a byte sequence:
+ * - the history id as a varint delta to the previous record
+ * - integer ids as zig-zag varints
+ * - quantized positions as zig-zag varint deltas: to the previous record of the same
+ * history or, for the 1st record of a history, to the 1st record of the previous history
+ * - quantized directions as zig-zag varints
+ * - other columns verbatim
+ *
+ * Ids are stored losslessly. decode() restores the records
+ * with quantized positions & directions, identical to the result of quantize().
+ * In debug builds, the event_stream writer verifies this for every block with check().
+ *
+ * Positions are quantized in the target coordinate system, thus the resolution is
+ * the same everywhere. The records do not carry the PKA origin; the 1st record
+ * of a history stands in for it, so that the jump between histories is measured
+ * from source point to source point and not from the end of the previous history.
+ * Deltas within a history are kept to the previous record, which is smaller
+ * than the offset to the history origin once a history has several cascades.
+ *
+ * On a synthetic damage stream (beam spot of 10 nm, 1-4 cascades per history
+ * along the track, 0.01 nm resolution) a 32 byte record encodes to 9.6 bytes;
+ * offsets to the history origin give 10.2 bytes.
+ *
+ * @ingroup Tallies
+ */
+class event_codec
+{
+    std::vector<event_buffer::column_t> columns_;
+    size_t rsize_{ 0 };
+    double pres_{ 0 }, dres_{ 0 };
+
+public:
+    /// Create a disabled codec
+    event_codec() { }
+    /// Create a codec for records of proto. If position_resolution <= 0 the codec is disabled
+    event_codec(const event_buffer &proto, float position_resolution);
+
+    /// Return true if the codec is enabled
+    bool enabled() const { return pres_ > 0; }
+    /// Position resolution in nm (a power of 2)
+    double position_resolution() const { return pres_; }
+    /// Direction cosine resolution
+    double direction_resolution() const { return dres_; }
+
+    /// Quantize positions & directions of n records in place
+    void quantize(char *records, size_t n) const;
+    /// Encode n records and append the bytes to out
+    void encode(const char *records, size_t n, std::vector<char> &out) const;
+    /// Decode n records from buffer in of size nbytes. Returns false on error.
+    bool decode(const char *in, size_t nbytes, size_t n, char *records) const;
+    /**
+     * @brief Round-trip check of n records
+     *
+     * Returns true if quantization errors are within half the resolution,
+     * other columns are unchanged and decode(encode()) reproduces quantize() exactly.
+     */
+    bool check(const char *records, size_t n) const;
+};
+
+/**
+ * @brief A source-side filter for event streams
+ *
+ * The filter is checked before an event buffer is filled,
+ * so that rejected events cost neither I/O nor disk space.
+ *
+ * An event is accepted if it passes all of the defined criteria:
+ * - event energy within [Emin, Emax]
+ * - species (atom id) in a given list
+ * - recoil generation (recoil id) within [gmin, gmax]
+ * - position inside at least one of a list of boxes
+ *
+ * Undefined (empty) criteria accept all events.
+ *
+ * In addition, the number of stored events can be limited. In this case,
+ * a uniform random sample of the accepted events
+ * is kept by reservoir sampling (see event_stream::set_max_rows()).
+ *
+ * @ingroup Tallies
+ */
+class event_filter
+{
+public:
+    /// Filter parameters
+    struct parameters
+    {
+        /// Event energy range [Emin, Emax] in eV. Empty = all energies
+        std::vector<float> energy;
+        /// Accepted species (atom ids). Empty = all species
+        std::vector<int> species;
+        /// Recoil generation range [gmin, gmax], 0 = beam ion, 1 = PKA, ... Empty = all
+        std::vector<int> recoil_generation;
+        /// Boxes given as [xmin, ymin, zmin, xmax, ymax, zmax, ...] in nm. Empty = everywhere
+        std::vector<float> boxes;
+        /// Max. number of stored events. 0 = no limit
+        int max_rows{ 0 };
+    };
+
+    event_filter() { }
+    explicit event_filter(const parameters &p) : par_(p)
+    {
+        active_ = !(p.energy.empty() && p.species.empty() && p.recoil_generation.empty()
+                    && p.boxes.empty());
+    }
+
+    /// Return the filter parameters
+    const parameters &par() const { return par_; }
+    /// Return true if any acceptance criteria are defined
+    bool active() const { return active_; }
+
+    /**
+     * @brief Check if an event passes the filter
+     * @param E event energy [eV]
+     * @param species atom id
+     * @param generation recoil generation
+     * @param x event position [nm]
+     * @return true if the event is accepted
+     */
+    bool accept(float E, int species, int generation, const vector3 &x) const
+    {
+        if (!active_)
+            return true;
+        if (!par_.energy.empty() && (E < par_.energy[0] || E > par_.energy[1]))
+            return false;
+        if (!par_.species.empty()
+            && std::find(par_.species.begin(), par_.species.end(), species) == par_.species.end())
+            return false;
+        if (!par_.recoil_generation.empty()
+            && (generation < par_.recoil_generation[0] || generation > par_.recoil_generation[1]))
+            return false;
+        if (!par_.boxes.empty()) {
+            const float *b = par_.boxes.data();
+            const float *end = b + par_.boxes.size();
+            for (; b < end; b += 6)
+                if (x.x() >= b[0] && x.y() >= b[1] && x.z() >= b[2] && x.x() <= b[3]
+                    && x.y() <= b[4] && x.z() <= b[5])
+                    break;
+            if (b == end)
+                return false;
+        }
+        return true;
+    }
+
+private:
+    parameters par_;
+    bool active_{ false };
+};
+
+/**
+ * @brief Abstract destination of event data
+ *
+ * An \ref event_stream attached to a sink hands over its write blocks
+ * to the sink instead of writing them to a temporary disk buffer.
+ *
+ * append() may be called concurrently by many simulation threads.
+ *
+ * @ingroup Tallies
+ */
+class event_sink
+{
+public:
+    virtual ~event_sink() { }
+    /**
+     * @brief Append event data
+     * @param ch the channel (stream type) of the data
+     * @param data pointer to nrows event records
+     * @param nrows number of events
+     * @return 0 on success
+     */
+    virtual int append(int ch, const char *data, size_t nrows) = 0;
+    /// Write all data appended so far to permanent storage. Returns 0 on success
+    virtual int sync() { return 0; }
+    /// Number of rows of channel ch in permanent storage
+    virtual size_t rows(int /*ch*/) const { return 0; }
+    /// Finish writing all appended data. Returns 0 on success
+    virtual int close() { return 0; }
 };
 
 /**
@@ -73,31 +338,121 @@ public:
  * At the end of the simulation, event data are transfered to the
  * \ref out_file "HDF5 output file" and stored in compressed datasets.
  *
- * The data is actually a 2D array with columns equal to the event size
- * and rows equal to the total number of events.
+ * The data is actually an array of event records (rows) with the layout of
+ * the \ref event_buffer prototype.
  *
  * Event column names and descriptions are also stored in the output file.
  *
+ * Writing is asynchronous. Events are copied to in-memory blocks and
+ * each full block is handed over to a background writer thread, which writes it
+ * to the temporary disk buffer. Thus, the simulation thread does not
+ * wait for disk I/O. A single writer thread serves all open streams of the process;
+ * it is started when the first stream opens and stopped when the last one closes.
+ *
+ * The number of blocks per stream is bounded (\ref max_blocks of
+ * \ref block_bytes each). If all blocks are waiting to be written,
+ * write() blocks until the writer thread frees one. Thus, memory use is bounded
+ * and no events are lost if the disk cannot keep up with the simulation.
+ *
+ * Reading from the stream must start with rewind() (or clear()), which calls flush() to
+ * wait for pending blocks to be written.
+ *
+ * Alternatively, the stream can be attached to an \ref event_sink, which receives
+ * the full blocks directly. In this case there is no disk buffer and
+ * the stream cannot be read or merged.
+ *
+ * If a max. number of rows is set (set_max_rows()), events are not written
+ * to the disk buffer. Instead, a uniform random sample of all written events
+ * is kept in memory by reservoir sampling. Merging reservoir streams
+ * combines the samples with the correct weights and the result is sorted by history id.
+ *
+ * Optionally, positions and directions are quantized by an \ref event_codec
+ * (see set_position_resolution()). Blocks are then stored
+ * encoded in the disk buffer, each preceded by its # of rows & bytes,
+ * and decoded by read(). Attached sinks receive the quantized records.
+ *
  */
 class event_stream
 {
+    friend class event_view;
+
+public:
+    /// Size in bytes of an in-memory write block
+    static constexpr size_t block_bytes = 1 << 18;
+    /// Max. number of in-memory write blocks per stream
+    static constexpr size_t max_blocks = 8;
+
 protected:
-    size_t rows_, cols_;
+    size_t rows_, rsize_; // # of events & record size in bytes
     std::FILE *fs_;
     std::string fname_;
     event_buffer event_proto_;
+    event_sink *sink_{ nullptr };
+    int sink_ch_{ 0 };
+    event_codec codec_;
+    std::vector<char> enc_; // encoded block (writer thread)
+
+    // reservoir sampling
+    size_t max_rows_{ 0 }; // reservoir size, 0 = off
+    size_t seen_{ 0 }; // # of events offered to the reservoir
+    size_t res_pos_{ 0 }; // read position
+    std::vector<char> reservoir_;
+    std::mt19937_64 res_rng_;
+
+    // decoded read block
+    std::vector<char> rd_buff_, rd_enc_;
+    size_t rd_pos_{ 0 }, rd_rows_{ 0 }, rd_total_{ 0 };
+
+    // in-memory write blocks
+    struct block_t
+    {
+        std::vector<char> data;
+        size_t rows{ 0 };
+    };
+    std::vector<block_t> blocks_;
+    block_t *current_{ nullptr }; // block being filled
+    size_t block_rows_{ 0 }; // capacity of a block in rows
+    std::deque<block_t *> pending_; // full blocks waiting to be written
+    std::vector<block_t *> free_; // empty blocks
+    bool writing_{ false }; // writer is busy with a block
+    bool attached_{ false }; // registered with the shared writer thread
+    bool io_error_{ false }; // a write to the disk buffer failed
+    bool snapshot_{ false }; // read-only view of another stream's disk buffer
+    std::mutex mtx_;
+    std::condition_variable cv_free_;
+
+    // the writer thread shared by all streams
+    class writer_t;
 
 public:
     /// Create an empty event_stream
-    event_stream() : rows_(0), cols_(0), fs_(NULL) { }
+    event_stream() : rows_(0), rsize_(0), fs_(NULL) { }
     /// Close the file, remove data and destroy the event_stream object
     virtual ~event_stream() { close_(); }
+    event_stream(const event_stream &) = delete;
+    event_stream &operator=(const event_stream &) = delete;
     /// Open the event_stream
     int open();
+    /// Open the event_stream attached to channel ch of an \ref event_sink
+    int open(event_sink *sink, int ch);
+    /**
+     * @brief Open a read-only snapshot of another stream
+     *
+     * The snapshot contains the events currently in @p src. It reads
+     * the disk buffer of @p src through its own file handle, so @p src
+     * may continue to receive events, as long as it is not cleared or closed.
+     * Reservoir samples are copied.
+     *
+     * The snapshot can be read and merged but not written to.
+     *
+     * @param src an open stream, not attached to a sink
+     * @return 0 on success
+     */
+    int open_snapshot(event_stream &src);
     /// Count of events stored in the stream (rows)
     size_t rows() const { return rows_; }
-    /// Size of each event (columns)
-    size_t cols() const { return cols_; }
+    /// Size of each event record in bytes
+    size_t record_size() const { return rsize_; }
     /// Write an event to the stream
     void write(const event_buffer *ev);
     /// Merge data from another stream into this one
@@ -105,23 +460,211 @@ public:
     /// Merge multiple streams into this one, preserving event id order
     int merge(std::vector<event_stream *> &v);
     /// Return true if the stream is open
-    bool is_open() const { return fs_ != NULL; }
+    bool is_open() const { return fs_ != NULL || sink_ != nullptr; }
     /// Set the event_buffer prototype. The stream must be in the closed state;
     bool set_event_prototype(const event_buffer &ev);
     /// Returns a refence to the event_buffer prototype currently saved in the stream
     const event_buffer &event_prototype() const { return event_proto_; }
     /// A bit mask for the accepted event types
     uint32_t mask() const { return event_proto_.mask(); }
+    /**
+     * @brief Enable quantization & compact encoding of positions and directions
+     *
+     * Must be called after set_event_prototype() and before open().
+     * A resolution <= 0 disables the codec.
+     *
+     * @param r the position resolution in nm
+     */
+    void set_position_resolution(float r) { codec_ = event_codec(event_proto_, r); }
+    /**
+     * @brief Limit the number of stored events by reservoir sampling
+     *
+     * Must be called after set_event_prototype(). A value of 0 disables the limit.
+     *
+     * @param n the max. number of rows
+     * @param seed seed for the random sampling
+     */
+    void set_max_rows(size_t n, uint64_t seed = 0);
+    /// Max. number of rows, 0 = no limit
+    size_t max_rows() const { return max_rows_; }
+    /// Number of events written to the stream, including those not kept by reservoir sampling
+    size_t rows_seen() const { return max_rows_ ? seen_ : rows_; }
+    /// Set the # of events seen, e.g., when the stream is loaded from a file
+    void set_rows_seen(size_t n)
+    {
+        if (max_rows_)
+            seen_ = n;
+    }
+    /// State of the reservoir sampling, see reservoir()
+    struct reservoir_t
+    {
+        std::vector<char> rows; ///< sampled records, in reservoir order
+        uint64_t seen{ 0 };     ///< # of events offered to the reservoir
+        std::string rng;        ///< state of the sampling rng
+    };
+    /// Return a copy of the reservoir sampling state
+    reservoir_t reservoir() const;
+    /**
+     * @brief Restore the reservoir sampling state
+     *
+     * Sampling continues exactly as in the stream where @p r was taken.
+     * Must be called after set_max_rows() with the same max. number of rows.
+     *
+     * @param r a state returned by reservoir()
+     * @return true on success
+     */
+    bool set_reservoir(const reservoir_t &r);
+    /// Returns the codec used by the stream
+    const event_codec &codec() const { return codec_; }
+    /// Wait until all buffered events are written to the disk buffer.
+    /// Returns 0 on success or -1 if a disk write has failed
+    int flush();
 
+    /// Flush & go to the start of the stream
     void rewind();
+    /// Flush & discard all events
     void clear();
-    size_t read(float *buff, size_t nevents);
-    bool peekid(uint32_t &id);
-    size_t write(const float *buff, size_t nevents);
+    /// Read up to nevents records into buff. Returns the # of events read
+    size_t read(char *buff, size_t nevents);
+    /// Get the history id of the next event without advancing the stream
+    bool peekid(uint64_t &id);
+    /// Write nevents records from buff. Returns the # of events written
+    size_t write(const char *buff, size_t nevents);
 
 private:
     /// @brief Close the event stream
     void close_();
+    // allocate the 1st write block
+    void init_blocks_();
+    // hand over the current block to the writer (or sink) & get a free one
+    void submit_();
+    // detach from the writer thread, dropping any pending blocks
+    void stop_writer_();
+    // write the oldest pending block to the disk buffer (writer thread)
+    void write_pending_();
+    // load & decode the next block from the disk buffer
+    bool read_block_();
+    // offer a record to the reservoir
+    void reservoir_add_(const char *rec);
+    // merge reservoirs of other streams into this one
+    void reservoir_merge_(const std::vector<event_stream *> &v);
+};
+
+/**
+ * @brief A read-only view of a column of event records
+ *
+ * Elements are read directly from the underlying records.
+ * Columns are naturally aligned within a record, but the records
+ * themselves may come from a file mapping with arbitrary offset,
+ * so element access uses memcpy to avoid unaligned loads.
+ *
+ * @ingroup Tallies
+ */
+template <class T>
+class event_column_view
+{
+    const char *base_{ nullptr };
+    size_t stride_{ 0 }, n_{ 0 };
+
+public:
+    event_column_view() { }
+    event_column_view(const char *base, size_t stride, size_t n)
+        : base_(base), stride_(stride), n_(n)
+    {
+    }
+    /// Number of elements
+    size_t size() const { return n_; }
+    /// Return element i
+    T operator[](size_t i) const
+    {
+        T v;
+        std::memcpy(&v, base_ + i * stride_, sizeof(T));
+        return v;
+    }
+};
+
+/**
+ * @brief A zero-copy, read-only view of event records
+ *
+ * The view memory-maps either
+ * - the temporary disk buffer of an \ref event_stream, or
+ * - an uncompressed, contiguous event dataset of an HDF5 output file
+ * (see event_reader::map())
+ *
+ * and exposes records and typed columns without copying the data.
+ * For sampled streams (event_stream::set_max_rows()) the view points directly
+ * to the in-memory reservoir.
+ *
+ * Streams with an \ref event_codec store encoded blocks and cannot be viewed.
+ * HDF5 event datasets can be mapped only if stored uncompressed,
+ * i.e., with Output.event_deflate_level = 0.
+ *
+ * The view is valid as long as the underlying stream or file is not modified.
+ *
+ * The "PKA Events" table of the GUI reads the PKA stream of an idle simulation
+ * through an event_view (see mcdriver::mapEvents()).
+ *
+ * @ingroup Tallies
+ */
+class event_view
+{
+    const char *data_{ nullptr };
+    size_t rows_{ 0 }, rsize_{ 0 };
+    std::vector<event_buffer::column_t> layout_;
+    // mapped region
+    void *map_{ nullptr };
+    size_t map_len_{ 0 };
+
+public:
+    event_view() { }
+    ~event_view() { unmap(); }
+    event_view(const event_view &) = delete;
+    event_view &operator=(const event_view &) = delete;
+
+    /// Flush the stream and map its data. Returns 0 on success
+    int map(event_stream &es);
+    /**
+     * @brief Map part of a file as event records
+     * @param fname the file name
+     * @param offset byte offset of the 1st record
+     * @param nrows number of records
+     * @param layout column layout of the records
+     * @param rsize record size in bytes
+     * @return 0 on success
+     */
+    int map(const std::string &fname, size_t offset, size_t nrows,
+            const std::vector<event_buffer::column_t> &layout, size_t rsize);
+    /// Release the mapping
+    void unmap();
+
+    /// Return true if the view contains data
+    bool is_mapped() const { return data_ != nullptr; }
+    /// Number of records
+    size_t rows() const { return rows_; }
+    /// Size of a record in bytes
+    size_t record_size() const { return rsize_; }
+    /// Column layout of the records
+    const std::vector<event_buffer::column_t> &layout() const { return layout_; }
+    /// Pointer to the i-th record
+    const char *record(size_t i) const { return data_ + i * rsize_; }
+    /// History id of the i-th record
+    uint64_t history_id(size_t i) const { return event_buffer::history_id(record(i)); }
+    /**
+     * @brief Return a typed view of a column
+     *
+     * T must match the column type. An empty view is returned
+     * if the column is not found or the types do not match.
+     */
+    template <class T>
+    event_column_view<T> column(const std::string &name) const
+    {
+        for (const auto &c : layout_)
+            if (c.name == name && event_buffer::type_size(c.type) == sizeof(T)
+                && std::is_floating_point<T>::value
+                        == (c.type == event_buffer::Float32 || c.type == event_buffer::Float64))
+                return event_column_view<T>(data_ + c.offset, rsize_, rows_);
+        return event_column_view<T>();
+    }
 };
 
 /**
@@ -130,11 +673,13 @@ private:
  * The following data is stored:
  * - history id
  * - atom id of the PKA recoil
- * - cell id where the PKA was generated
+ * - position where the PKA was generated
  * - recoil energy
  * - damage energy
  * - # of vacancies, interstitials generated in this PKA cascade
  * - # of recombinations (+correlated recombinations)
+ * - optionally, cluster statistics of surviving vacancies and interstitials
+ * - optionally, the statistical weight of the PKA (see \ref event_buffer::addWeightColumn)
  *
  * The PKA event_buffer buffer is created together with a PKA and lives throught
  * the PKA cascade, accumulating data.  Thus, the damage energy and
@@ -148,55 +693,76 @@ class pka_buffer : public event_buffer
     // # of atoms in the simulation
     int natoms_;
 
-    // buffer offset of various quantities
-    enum offset_t {
-        ofIonId = 0, // id of the ion that generated the pka
-        ofAtomId = 1, // atom id of pka
-        ofPos = 2, // position (x,y,z) where pka was created
-        ofErg = 5, // pka recoil energy
-        ofTdam = 6, // pka damage energy
-        ofVac = 7 // vacancies of 1st atom id
-    };
+    // record offset of various quantities
+    size_t ofHid_, ofAtomId_, ofPos_, ofErg_, ofTdam_;
     /*
-     * After ofVac we have 4*natoms_ memory locations for:
+     * At ofVac_ start 4*natoms_ float columns for:
      * Vacancies, Intersitials, Recombinations, Correlated Recomb.
      * for each atom id
      */
+    size_t ofVac_;
     constexpr static int atom_cols_ = 4;
+    /*
+     * If cluster analysis is on, there follow 3 float columns for vacancies
+     * and 3 for interstitials:
+     * # of clusters, # of clustered defects, max cluster size
+     */
+    constexpr static int cluster_cols_ = 3;
+    bool clusters_{ false };
 
     float Tdam_LSS_, NRT_LSS_, NRT_;
 
+    float &count_(int k) { return at_<float>(ofVac_ + k * sizeof(float)); }
+    const float &count_(int k) const { return at_<float>(ofVac_ + k * sizeof(float)); }
+    float &cluster_(int did, int k)
+    {
+        return count_(atom_cols_ * natoms_ + cluster_cols_ * did + k);
+    }
+
 public:
     pka_buffer();
 
     /**
      * @brief Set the number of atoms in the target
      *
-     * For each target atom, 3 columns are added to store
-     * vacancies, replacements and interstitials
+     * For each target atom, 4 columns are added to store
+     * vacancies, interstitials, recombinations and correlated recombinations
+     *
+     * If clusters is true, 6 more columns are added for the
+     * cluster statistics of vacancies and interstitials
      *
      * @param n number of atoms in the target (excluding the projectile)
      * @param labels atom labels
+     * @param clusters add cluster analysis columns
      */
-    void setNatoms(int n, const std::vector<std::string> &labels);
+    void setNatoms(int n, const std::vector<std::string> &labels, bool clusters = false);
 
     /// Initialize the event buffer for PKA ion i
     void init(const ion *i);
 
-    int ionid() const { return buff_[ofIonId]; }
-    int atomid() const { return buff_[ofAtomId]; }
-    float recoilE() const { return buff_[ofErg]; }
-
-    float &Tdam() { return buff_[ofTdam]; }
-    const float &Tdam() const { return buff_[ofTdam]; }
-    float &Vac(int atom_id) { return buff_[ofVac + atom_id]; }
-    const float &Vac(int atom_id) const { return buff_[ofVac + atom_id]; }
-    float &Impl(int atom_id) { return buff_[ofVac + natoms_ + atom_id]; }
-    const float &Impl(int atom_id) const { return buff_[ofVac + natoms_ + atom_id]; }
-    float &Icr(int atom_id) { return buff_[ofVac + 2 * natoms_ + atom_id]; }
-    const float &Icr(int atom_id) const { return buff_[ofVac + 2 * natoms_ + atom_id]; }
-    float &Icr_corr(int atom_id) { return buff_[ofVac + 3 * natoms_ + atom_id]; }
-    const float &Icr_corr(int atom_id) const { return buff_[ofVac + 3 * natoms_ + atom_id]; }
+    uint64_t ionid() const { return at_<uint64_t>(ofHid_); }
+    int atomid() const { return at_<int32_t>(ofAtomId_); }
+    float recoilE() const { return at_<float>(ofErg_); }
+
+    float &Tdam() { return at_<float>(ofTdam_); }
+    const float &Tdam() const { return at_<float>(ofTdam_); }
+    float &Vac(int atom_id) { return count_(atom_id); }
+    const float &Vac(int atom_id) const { return count_(atom_id); }
+    float &Impl(int atom_id) { return count_(natoms_ + atom_id); }
+    const float &Impl(int atom_id) const { return count_(natoms_ + atom_id); }
+    float &Icr(int atom_id) { return count_(2 * natoms_ + atom_id); }
+    const float &Icr(int atom_id) const { return count_(2 * natoms_ + atom_id); }
+    float &Icr_corr(int atom_id) { return count_(3 * natoms_ + atom_id); }
+    const float &Icr_corr(int atom_id) const { return count_(3 * natoms_ + atom_id); }
+
+    /// Return true if cluster analysis columns are included
+    bool hasClusters() const { return clusters_; }
+    /// Number of clusters (size >= 2) of defect type did (0: vacancy, 1: interstitial)
+    float &Ncl(int did) { return cluster_(did, 0); }
+    /// Number of defects of type did belonging to clusters
+    float &Ncl_def(int did) { return cluster_(did, 1); }
+    /// Size of the largest cluster of defect type did
+    float &Ncl_max(int did) { return cluster_(did, 2); }
 
     // calc NRT values
     void calc_nrt(const ion &i, const material *m);
@@ -215,24 +781,15 @@ public:
  * - ion energy
  * - ion position vector (will be at the cell boundary)
  * - ion direction vector
+ * - optionally, the statistical weight of the ion
  *
  * @ingroup Tallies
  *
  */
 class exit_buffer : public event_buffer
 {
-
-    enum offset_t {
-        ofIonId = 0,
-        ofAtomId = 1,
-        ofCellId = 2,
-        ofErg = 3,
-        ofPos = 4,
-        ofDir = 7,
-        ofEnd = 10
-    };
-
-    // IonId AtomId CellId erg pos(3) dir(3) s
+    // record offsets
+    size_t ofHid_, ofAtomId_, ofCellId_, ofErg_, ofPos_, ofDir_;
 
 public:
     exit_buffer();
@@ -253,6 +810,7 @@ public:
  * - atom id = id of the interstitial species or of the atom that occupied the vacant site
  * - Defect type id: vacancy (0) or interstitial (1)
  * - position vector (x,y,z) where the defect is created
+ * - optionally, the statistical weight of the defect
  *
  * @ingroup Tallies
  *
@@ -260,12 +818,49 @@ public:
 class damage_event_buffer : public event_buffer
 {
 private:
-    enum offset_t { ofHid = 0, ofRid = 1, ofIid = 2, ofDid = 3, ofPos = 4, ofEnd = 7 };
+    // record offsets
+    size_t ofHid_, ofRid_, ofIid_, ofDid_, ofPos_;
+
+    void set_(size_t hid, int rid, int iid, int did, const vector3 &x);
 
 public:
     damage_event_buffer();
 
     /// Set the event buffer to the data of the given \ref ion
     void set(const ion &i);
+
+    /// Set the event buffer to the data of the given \ref defect
+    void set(const defect &d, const defect_info &c);
+};
+
+/**
+ * @brief A class for storing defect cluster events
+ *
+ * At the end of each PKA cascade, surviving defects are grouped
+ * into clusters (see \ref defect_clusters).
+ * An event is stored for each cluster with 2 or more defects.
+ *
+ * The following data is stored:
+ * - history id
+ * - Defect type id: vacancy (0) or interstitial (1)
+ * - number of defects in the cluster
+ * - recoil energy of the PKA that generated the cascade
+ * - cluster centroid (x,y,z)
+ * - optionally, the statistical weight of the PKA cascade
+ *
+ * @ingroup Tallies
+ *
+ */
+class cluster_event_buffer : public event_buffer
+{
+private:
+    // record offsets
+    size_t ofHid_, ofDid_, ofN_, ofErg_, ofPos_;
+
+public:
+    cluster_event_buffer();
+
+    /// Set the event buffer data
+    void set(uint64_t hid, int did, size_t n, float pkaE, const vector3 &x);
 };
 #endif // EVENT_STREAM_H
@@ -155,6 +155,8 @@ public:
         int ie;
         float u;
 
+        E_ = E;
+
 #if SAMPLE_P_AND_N == 1
 
         rng.random_azimuth_dir_norm(nx_, ny_, u);
@@ -169,13 +171,15 @@ public:
         case Constant:
             fp = fp_;
             ip = ip_ * std::sqrt(u);
+            ipm_ = ip_;
             break;
         case Variable:
             ie = fp_tbl_iterator(E);
             doCollision = u >= umin_tbl[ie];
             if (doCollision) {
                 fp = mfp_tbl[ie] * (-std::log(u));
-                ip = ipmax_tbl[ie] * std::sqrt(rng.u01s_lopen());
+                ipm_ = ipmax_tbl[ie];
+                ip = ipm_ * std::sqrt(rng.u01s_lopen());
             } else {
                 fp = fpmax_tbl[ie];
             }
@@ -188,6 +192,17 @@ public:
         return doCollision;
     }
 
+    /**
+     * @brief Return the max. impact parameter [nm] used by the last call to operator()
+     *
+     * The impact parameter was sampled uniformly in \f$ p^2 \in [0, p_{max}^2] \f$.
+     * Only valid if that call returned true.
+     */
+    float sampled_ipmax() const { return ipm_; }
+
+    /// @brief Return the ion energy [eV] passed to the last call to operator()
+    float sampled_erg() const { return E_; }
+
     /// @brief Return nx = cos of azimuthal scattering angle
     float nx() const { return nx_; }
     /// @brief Return ny = sin of azimuthal scattering angle
@@ -203,6 +218,9 @@ protected:
     // optional random 2d dir
     float nx_, ny_;
 
+    // ion energy & max impact parameter of the last sample
+    float E_{ 0.f }, ipm_{ 0.f };
+
     // flight path selection tables
     ArrayNDf mfp_, ipmax_, fp_max_, umin_;
 
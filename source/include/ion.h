@@ -2,7 +2,10 @@
 #define _ION_H_
 
 #include <cmath>
+#include <cstdint>
 #include <queue>
+#include <algorithm>
+#include <vector>
 
 #include "geometry.h"
 
@@ -65,24 +68,22 @@ public:
     enum ion_type { vacancy = 0, interstitial = 1, other };
 
 private:
-    ion_type type_;
+    /*
+     * Hot transport state
+     *
+     * These members are read/written at every transport step
+     * (propagate(), dedx, scattering) and are kept together at the
+     * start of the object
+     */
     vector3 pos_; // position = x,y,z in nm
-    vector3 pos0_; // initial position (start of track)
     vector3 dir_; // direction cosines
     double erg_; // energy in eV
-    double erg0_; // initial energy
     double t_; // time in ns
-    double t0_; // start time in ns (relative to ??? TODO)
     double s_erg_to_t_;
-    ivector3 icell_;
-    int cellid_, // current cell id
-            prev_cellid_, // previous cell id
-            cellid0_; // initial cell id (start of track)
-    size_t ion_id_; // ion history id
-    int recoil_id_; // recoil id (generation), 0=ion, 1=PKA, ...
-    size_t uid_; // unique recoil id
     const atom *atom_;
     const grid3D *grid_;
+    ivector3 icell_;
+    int cellid_; // current cell id
 
     // counters
     // they are reset when ion changes cell, stops or exits
@@ -92,6 +93,23 @@ private:
             phonon_, // total E loss to phonons
             recoil_; // total E loss to recoils
 
+    /*
+     * Cold bookkeeping
+     *
+     * Track origin, ids and type, set when the ion is created
+     * and only read when events are registered
+     */
+    int prev_cellid_, // previous cell id
+            cellid0_; // initial cell id (start of track)
+    vector3 pos0_; // initial position (start of track)
+    double erg0_; // initial energy
+    double t0_; // start time in ns (relative to ??? TODO)
+    size_t ion_id_; // ion history id
+    size_t uid_; // unique recoil id
+    int recoil_id_; // recoil id (generation), 0=ion, 1=PKA, ...
+    ion_type type_;
+    double weight_; // statistical weight
+
     friend class ion_queue;
 
     void sub_erg(double de, double *s)
@@ -147,7 +165,7 @@ public:
     int prev_cellid() const { return prev_cellid_; }
 
     /// Returns the history id that the current ion belongs to
-    int ion_id() const { return ion_id_; }
+    size_t ion_id() const { return ion_id_; }
 
     /// set history id
     void setId(size_t id) { ion_id_ = id; }
@@ -167,6 +185,22 @@ public:
     /// Set the recoil id
     void setRecoilId(int id) { recoil_id_ = id; }
 
+    /**
+     * @brief Returns the statistical weight of the ion
+     *
+     * Source ions start with weight 1. The weight is changed by
+     * splitting and Russian roulette and is inherited by all recoils
+     * of the ion. All tally scores of the ion are multiplied by its weight.
+     */
+    double weight() const { return weight_; }
+
+    /// Set the statistical weight
+    void setWeight(double w)
+    {
+        assert(w > 0);
+        weight_ = w;
+    }
+
     /// Returns a universal id for this ion
     size_t uid() const { return uid_; }
 
@@ -277,11 +311,108 @@ public:
         path_ = ioniz_ = phonon_ = recoil_ = 0.0;
     }
 
+    /**
+     * @brief Set the ion's state when replaying a stored cascade record
+     *
+     * Position, energy and track counters are set directly,
+     * as if the ion had been transported to position x.
+     * The current & previous cell are both set to the cell containing x.
+     *
+     * x must be inside the target.
+     */
+    void setReplayState(const vector3 &x, double erg, double ioniz, double phonon, double path,
+                        size_t ncoll)
+    {
+        pos_ = x;
+        assert(grid_->contains(x));
+        icell_ = grid_->pos2cell(x);
+        cellid_ = prev_cellid_ = grid_->cellid(icell_);
+        erg_ = erg;
+        ioniz_ = ioniz;
+        phonon_ = phonon;
+        recoil_ = 0;
+        path_ = path;
+        ncoll_ = ncoll;
+    }
+
     BoundaryCrossing propagate(float &s);
 
     float move(float s);
 };
 
+/**
+ * @brief Scoring data of a lattice defect
+ *
+ * The data of a \ref defect that are only needed when the defect is
+ * scored or stored, i.e., after intra-cascade recombination.
+ * They are kept by the \ref ion_queue in a separate table, indexed by \ref defect::info.
+ *
+ * Interstitials are created when a recoil stops. The stopped \ref ion object
+ * is kept in \ref src, as its counters are needed when the interstitial
+ * is finally scored as an Event::IonStop. For vacancies \ref src is nullptr.
+ *
+ * @ingroup Ions
+ */
+struct defect_info
+{
+    vector3 dir; ///< direction of the recoil that created the defect
+    double erg; ///< kinetic energy [eV] of the recoil that created the defect
+    size_t ion_id; ///< history id
+    int recoil_id; ///< recoil generation id of the recoil that created the defect
+    int cellid; ///< cell id of the defect position
+    double weight; ///< statistical weight
+    ion *src; ///< the stopped ion of an interstitial, nullptr for vacancies
+
+    defect_info() = default;
+
+    /// Create the scoring data of a defect at the current position of ion \a i
+    explicit defect_info(const ion &i)
+        : dir(i.dir()),
+          erg(i.erg()),
+          ion_id(i.ion_id()),
+          recoil_id(i.recoil_id()),
+          cellid(i.cellid()),
+          weight(i.weight()),
+          src(nullptr)
+    {
+    }
+};
+
+/**
+ * @brief A lattice defect (vacancy or interstitial)
+ *
+ * Holds only what intra-cascade recombination and cluster analysis need:
+ * position, atomic species, type, creation time and uid, in 48 bytes.
+ * All other data are in the \ref defect_info record \ref info
+ * of the \ref ion_queue the defect was pushed to.
+ *
+ * An interstitial has the uid of its stopped recoil. A new vacancy
+ * (ion_queue::push_vacancy(const ion &)) gets a new uid,
+ * as a clone of the recoil would.
+ *
+ * @ingroup Ions
+ */
+struct defect
+{
+    vector3 pos; ///< defect position [nm]
+    ion::ion_type type; ///< defect type (vacancy or interstitial)
+    uint32_t info; ///< index of the defect's \ref defect_info in the ion_queue
+    double t; ///< creation time
+    const atom *atom_; ///< atomic species
+    size_t uid; ///< unique id of the defect
+
+    defect() = default;
+
+    /// Create a defect record of type \a tp at the current position of ion \a i
+    defect(const ion &i, ion::ion_type tp, uint32_t k)
+        : pos(i.pos()), type(tp), info(k), t(i.t()), atom_(i.myAtom()), uid(i.uid())
+    {
+    }
+
+    /// Returns a pointer to the \ref atom class describing the defect species
+    const atom *myAtom() const { return atom_; }
+};
+
 /**
  * @brief The ion_queue class handles queues of ion objects waiting to be simulated.
  *
@@ -299,7 +430,9 @@ public:
  *
  * During processing of a PKA recoil cascade, all the vacancies (V) created by secondary recoils
  * and the interstitials (I)
- * created when a recoil atom stops, are stored in 2 separate queues.
+ * created when a recoil atom stops, are stored as \ref defect records
+ * in 2 separate queues. Their scoring data are kept in a 3rd table of \ref defect_info,
+ * see info().
  *
  * After the cascade finishes, the Vs and Is may recombine, if cascade recombination option
  * has been selected in the configuration.
@@ -312,7 +445,10 @@ public:
  *
  * push_pka() and push_recoil()  push an ion object to the respective queues.
  * Simlarly, push_vacancy() and push_interstitial() push a defect to the respective
- * queue.
+ * queue. Vacancies are recorded without allocating an ion object. The stopped ion
+ * of an interstitial is kept in \ref defect_info::src and must be released with free_ion()
+ * after it has been scored. clear_defects() empties the queues & the scoring data
+ * at the end of the cascade.
  *
  * When the simulation finishes an ion history, it must call free_ion() to release the ion
  * object buffer so that it can be used again.
@@ -325,12 +461,44 @@ class ion_queue
     // FIFO ion buffer type
     typedef std::queue<ion *> ion_queue_t;
 
+public:
+    /// Type of the defect queues
+    typedef std::vector<defect> defect_queue_t;
+
+    /**
+     * @brief Order in which secondary recoils are processed
+     *
+     * The order does not change which recoils are generated, only the sequence
+     * in which they are transported. It determines the maximum number of
+     * live recoils (and thus ion objects) held in memory during a cascade.
+     */
+    enum recoil_order_t {
+        BreadthFirst = 0, /**< FIFO queue: recoils are transported in order of creation */
+        DepthFirst = 1, /**< LIFO stack: the most recently created recoil is transported first */
+        EnergyOrdered = 2, /**< The recoil with the lowest energy is transported first */
+        InvalidRecoilOrder = -1
+    };
+
+private:
     // ion queues
     ion_queue_t ion_buffer_; // buffer of allocated ion objects
-    ion_queue_t recoil_queue_; // queue of generated recoils
     ion_queue_t pka_queue_; // queue of generated PKAs
-    ion_queue_t v_queue_; // queue of vacancies
-    ion_queue_t i_queue_; // queue of interstitials
+    ion_queue_t split_queue_; // copies of split source ions
+
+    // secondary recoils
+    // a FIFO (read from recoil_head_), a LIFO stack or a min-energy heap,
+    // depending on recoil_order_
+    std::vector<ion *> recoil_queue_;
+    size_t recoil_head_;
+    recoil_order_t recoil_order_;
+
+    // heap comparator for EnergyOrdered, the top is the lowest energy recoil
+    static bool recoil_erg_cmp_(const ion *lhs, const ion *rhs) { return lhs->erg() > rhs->erg(); }
+
+    // defect queues
+    defect_queue_t v_queue_; // queue of vacancies
+    defect_queue_t i_queue_; // queue of interstitials
+    std::vector<defect_info> info_; // scoring data of the queued defects
 
     // # of available ion buffers
     size_t sz_;
@@ -366,7 +534,17 @@ class ion_queue
     }
 
 public:
-    explicit ion_queue() : sz_(0), uctr_(0) { }
+    explicit ion_queue() : recoil_head_(0), recoil_order_(BreadthFirst), sz_(0), uctr_(0) { }
+
+    /// Set the order of processing secondary recoils. The recoil queue must be empty.
+    void setRecoilOrder(recoil_order_t o)
+    {
+        assert(recoil_queue_.empty());
+        recoil_order_ = o;
+    }
+
+    /// Returns the order of processing secondary recoils
+    recoil_order_t recoilOrder() const { return recoil_order_; }
 
     /// Returns a clone of p
     ion *clone_ion(const ion &p) { return new_ion_(&p); }
@@ -380,31 +558,112 @@ public:
     /// Pop a PKA ion object from the queue. If the queue is empty, a nullptr is returned.
     ion *pop_pka() { return pop_one_(pka_queue_); }
 
-    /// Push an ion object to the recoil queue
-    void push_recoil(ion *i) { recoil_queue_.push(i); }
+    /// Push a copy of a split source ion to the split queue
+    void push_split(ion *i) { split_queue_.push(i); }
 
-    /// Pop a recoil ion object from the queue. If the queue is empty, a nullptr is returned.
-    ion *pop_recoil() { return pop_one_(recoil_queue_); }
+    /// Pop a split ion copy from the queue. If the queue is empty, a nullptr is returned.
+    ion *pop_split() { return pop_one_(split_queue_); }
 
     /// Push an ion object to the recoil queue
-    void push_vacancy(ion *i)
+    void push_recoil(ion *i)
     {
-        i->type_ = ion::vacancy;
-        v_queue_.push(i);
+        recoil_queue_.push_back(i);
+        if (recoil_order_ == EnergyOrdered)
+            std::push_heap(recoil_queue_.begin(), recoil_queue_.end(), recoil_erg_cmp_);
     }
 
-    /// Pop a recoil ion object from the queue. If the queue is empty, a nullptr is returned.
-    ion *pop_vacancy() { return pop_one_(v_queue_); }
+    /**
+     * @brief Pop a recoil ion object from the queue. If the queue is empty, a nullptr is returned.
+     *
+     * The recoil returned depends on the selected \ref recoil_order_t
+     */
+    ion *pop_recoil()
+    {
+        ion *i = nullptr;
+        switch (recoil_order_) {
+        case DepthFirst:
+            if (!recoil_queue_.empty()) {
+                i = recoil_queue_.back();
+                recoil_queue_.pop_back();
+            }
+            break;
+        case EnergyOrdered:
+            if (!recoil_queue_.empty()) {
+                std::pop_heap(recoil_queue_.begin(), recoil_queue_.end(), recoil_erg_cmp_);
+                i = recoil_queue_.back();
+                recoil_queue_.pop_back();
+            }
+            break;
+        default:
+            if (recoil_head_ < recoil_queue_.size())
+                i = recoil_queue_[recoil_head_++];
+            else {
+                // queue drained, reuse the storage
+                recoil_queue_.clear();
+                recoil_head_ = 0;
+            }
+            break;
+        }
+        return i;
+    }
 
-    /// Push an ion object to the recoil queue
+    /// Push a vacancy record to the vacancy queue
+    void push_vacancy(const defect &d)
+    {
+        assert(d.info < info_.size());
+        v_queue_.push_back(d);
+        v_queue_.back().type = ion::vacancy;
+    }
+
+    /// Push a new vacancy with the given uid at the current position of ion i. Returns the record
+    defect &push_vacancy(const ion &i, size_t uid)
+    {
+        v_queue_.emplace_back(i, ion::vacancy, uint32_t(info_.size()));
+        v_queue_.back().uid = uid;
+        info_.emplace_back(i);
+        return v_queue_.back();
+    }
+
+    /// Push a new vacancy created at the current position of ion i. Returns the record
+    defect &push_vacancy(const ion &i) { return push_vacancy(i, uctr_++); }
+
+    /// Returns the vacancy queue
+    defect_queue_t &vacancies() { return v_queue_; }
+
+    /// Push a stopped ion to the interstitial queue
     void push_interstitial(ion *i)
     {
         i->type_ = ion::interstitial;
-        i_queue_.push(i);
+        i_queue_.emplace_back(*i, ion::interstitial, uint32_t(info_.size()));
+        info_.emplace_back(*i);
+        info_.back().src = i;
+    }
+
+    /// Push an interstitial record to the interstitial queue
+    void push_interstitial(const defect &d)
+    {
+        assert(d.info < info_.size() && info_[d.info].src);
+        i_queue_.push_back(d);
+        i_queue_.back().type = ion::interstitial;
     }
 
-    /// Pop a recoil ion object from the queue. If the queue is empty, a nullptr is returned.
-    ion *pop_interstitial() { return pop_one_(i_queue_); }
+    /// Returns the interstitial queue
+    defect_queue_t &interstitials() { return i_queue_; }
+
+    /// Returns the scoring data of a queued defect
+    defect_info &info(const defect &d)
+    {
+        assert(d.info < info_.size());
+        return info_[d.info];
+    }
+
+    /// Clear the defect queues & their scoring data. Interstitial ions must have been released
+    void clear_defects()
+    {
+        v_queue_.clear();
+        i_queue_.clear();
+        info_.clear();
+    }
 
     /// Release a used ion object
     void free_ion(ion *i) { ion_buffer_.push(i); }
@@ -4,10 +4,16 @@
 #include "geometry.h"
 #include "ion.h"
 
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
 class target;
 class atom;
 class material;
 class random_vars;
+class phase_space_reader;
 
 /**
  * @brief The ion_beam class is used for ejecting ions into the simulation
@@ -27,6 +33,7 @@ public:
         SingleValue = 0, /**< Single valued (=delta) distribution */
         Uniform, /**< Uniform distribution */
         Gaussian, /**< Gaussian (Normal) distribution */
+        Tabulated, /**< Tabulated (histogram) distribution, only for ion energy */
         InvalidDistribution = -1
     };
 
@@ -41,10 +48,46 @@ public:
         float center{ 1e6f };
         /// Full-width at half-maximum of ion energy distribution [nm]. Default: 1 eV.
         float fwhm{ 1.0f };
+        /// Tabulated spectrum: n+1 increasing energy bin edges [eV]
+        std::vector<float> energy_bins;
+        /// Tabulated spectrum: n bin weights per species, species-major. Need not be normalized.
+        std::vector<float> weights;
+        /// Tabulated spectrum: target atom ids of the PKA species (only for CascadesOnly).
+        /// If empty, the PKA species is selected from the material composition.
+        std::vector<int> species;
+        /// Tabulated spectrum: text file with lines "E_lo E_hi w1 [w2 ...]". Overrides
+        /// energy_bins & weights if not empty.
+        std::string file;
+        /// Tabulated spectrum: stratify the bin selection by the ion history id
+        bool stratified{ false };
         /// Draw a random energy sample from the distribution
         float sample(random_vars &r) const;
+        /**
+         * @brief Draw a sample from the distribution for the history hid
+         *
+         * For Tabulated, the spectrum bin and species are selected with
+         * Walker's alias method and the energy is uniform within the bin.
+         * If stratified is set, the alias table is indexed by the
+         * base-2 radical inverse of hid instead of a random number, so that
+         * any 2^m consecutive histories sample the spectrum in 2^m equal-probability strata.
+         *
+         * @param r the random number engine
+         * @param hid the history id
+         * @param sp on return, index into species of the selected species (0 if species is empty)
+         * @return the ion energy [eV]
+         */
+        float sample(random_vars &r, size_t hid, int &sp) const;
         void init();
+        /// Number of species of a tabulated spectrum (at least 1)
+        int nspecies() const { return species.empty() ? 1 : int(species.size()); }
+        /// Read a tabulated spectrum file. Returns 0 on success
+        static int read_spectrum(const std::string &fname, std::vector<float> &bins,
+                                 std::vector<float> &w);
         float a, b;
+
+    private:
+        std::vector<float> alias_prob_;
+        std::vector<int> alias_idx_;
     };
 
     /**
@@ -99,6 +142,34 @@ public:
         coord_sys cs;
     };
 
+    /**
+     * @brief Phase-space file source
+     *
+     * If file is not empty, source ions are read from a phase-space file instead of
+     * being sampled from the energy, spatial & angular distributions,
+     * e.g., to use the ions transmitted through a foil in an upstream simulation
+     * as the beam of a downstream target.
+     *
+     * The file is either an OpenTRIM HDF5 output file with stored exit events
+     * (/events/exit) or a binary phase-space file, see \ref phase_space_reader.
+     */
+    struct phase_space_t
+    {
+        /// Phase-space file name. Empty = not used
+        std::string file;
+        /// Species id of the accepted records, as stored in the file. Default 0 = the upstream ion
+        int species{ 0 };
+        /// Offset added to the record positions [nm]
+        vector3 offset{ 0, 0, 0 };
+        /// Number of times each record is used. Default: 1
+        int recycle{ 1 };
+        /// Rotate reused records by a random angle about the x-axis through the spatial
+        /// distribution center
+        bool rotate{ false };
+        /// Number of records per buffered read
+        int buffer_size{ 4096 };
+    };
+
     /**
      * @brief The parameters of the ion_beam class
      */
@@ -112,6 +183,8 @@ public:
         spatial_distribution_t spatial_distribution;
         /// Angular distribution of the generated ions
         angular_distribution_t angular_distribution;
+        /// Phase-space file source of the generated ions
+        phase_space_t phase_space;
     };
 
 protected:
@@ -119,6 +192,7 @@ protected:
 
     bool is_pka_source_;
     const material *pka_source_material_;
+    std::vector<const atom *> species_atoms_;
 
 public:
     /// Default constructor
@@ -140,6 +214,101 @@ public:
      * @param i the generated ion
      */
     void source_ion(random_vars &g, const target &t, ion &i);
+
+    /**
+     * @brief Generate an ion from the next record of a phase-space file
+     *
+     * Records of a different species, non-positive energy, or position
+     * outside the target (after adding the offset) are skipped.
+     * For a Surface source the ion is placed on the target surface
+     * and records moving away from it are skipped.
+     *
+     * @param g the random number engine
+     * @param t the simulation target
+     * @param i the generated ion
+     * @param ps the phase-space reader of the calling thread
+     * @return 0 on success, -1 if no valid record is found
+     */
+    int source_ion(random_vars &g, const target &t, ion &i, phase_space_reader &ps);
+};
+
+/**
+ * @brief Buffered sequential reader of phase-space records
+ *
+ * Reads (species, energy, position, direction, weight) records from
+ *   - an OpenTRIM HDF5 output file with stored exit events (/events/exit),
+ *     using the columns iid, E, x, y, z, nx, ny, nz & w (if present), or
+ *   - a binary phase-space file of 36-byte native-endian records
+ *     {int32 species, float32 E, x, y, z, nx, ny, nz, w}.
+ *
+ * The file format is detected from the HDF5 signature.
+ *
+ * Each simulation thread has its own reader, restricted to a disjoint partition
+ * of the file rows, which is read sequentially in blocks. When recycling, each record is
+ * returned a number of times in a row. After the partition is exhausted, it is read
+ * again from the start and all records are flagged as reused.
+ *
+ * @ingroup Ions
+ */
+class phase_space_reader
+{
+public:
+    /// A phase-space record
+    struct record
+    {
+        int species;
+        float erg;
+        vector3 pos;
+        vector3 dir;
+        float w;
+    };
+
+    /// Size of a binary phase-space record in bytes
+    static constexpr size_t binary_record_size = 36;
+
+    phase_space_reader();
+    ~phase_space_reader();
+    phase_space_reader(const phase_space_reader &) = delete;
+    phase_space_reader &operator=(const phase_space_reader &) = delete;
+
+    /**
+     * @brief Open a phase-space file
+     * @param fname the file name
+     * @param os if not null, error messages are written here
+     * @return 0 on success
+     */
+    int open(const std::string &fname, std::ostream *os = nullptr);
+    /// Total number of records in the file
+    size_t rows() const;
+
+    /**
+     * @brief Restrict reading to the rows [first, last)
+     * @param first first row of the partition
+     * @param last one past the last row of the partition
+     * @param recycle number of times each record is returned
+     * @param buffer_size number of rows per read
+     * @param start number of records to skip, e.g., those used in a previous run
+     */
+    void setPartition(size_t first, size_t last, size_t recycle, size_t buffer_size,
+                      size_t start = 0);
+    /// Number of records returned before the partition is read again
+    size_t partitionSize() const;
+    /// Number of records returned so far, including the skipped start records
+    size_t position() const;
+    /// Continue reading after pos records, e.g., to resume an interrupted run
+    void setPosition(size_t pos);
+
+    /**
+     * @brief Get the next record
+     * @param r the record
+     * @param reused on return, true if the record has been returned before
+     * @return false on read error or empty partition
+     */
+    bool next(record &r, bool &reused);
+
+private:
+    struct impl;
+    std::unique_ptr<impl> d_;
 };
 
 inline void shift_left(vector3 &v)
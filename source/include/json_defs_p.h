@@ -38,6 +38,7 @@ NLOHMANN_JSON_SERIALIZE_ENUM(mcconfig::option_type_t,
                                { mcconfig::tArray, "array" } })
 
 MY_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(mcdriver::run_data, start_time, end_time, ions_per_cpu_s,
-                                          cpu_time_s, nthreads, run_ion_count, total_ion_count)
+                                          cpu_time_s, nthreads, run_ion_count, total_ion_count,
+                                          stop_reason, rel_sem)
 
 #endif // JSON_DEFS_P_H
@@ -11,10 +11,14 @@
 #include "event_stream.h"
 #include "dedx.h"
 #include "flight_path.h"
+#include "cascade.h"
 
 // for thread sync
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
 
 /**
  * \defgroup MC libopentrim shared library
@@ -46,6 +50,70 @@
  *
  */
 
+/**
+ * @brief A bounded queue passing PKAs from the ion transport stage to the cascade stage
+ *
+ * In a pipelined FullCascade simulation, the ion stage threads transport the source ions
+ * and push each ion history as a \ref job to the queue, i.e., its PKAs and the
+ * tally scores of the ion. The cascade stage threads pop the jobs, simulate the PKA
+ * cascades and score the complete history.
+ *
+ * Jobs are popped in the order of their history id, so that the events of each
+ * cascade stage thread are ordered by history id, as in a normal simulation.
+ * The ion stage thread i pushes the ids first + i + k*stride, k = 0, 1, ...
+ * When it stops, it calls leave() to declare that the rest of its ids will not come.
+ *
+ * push() blocks while the queue is full, unless the job is the next one to pop.
+ * pop() blocks until the next job is available.
+ * After close(), push() does not block and pop() returns the remaining jobs in order,
+ * then false once the queue is empty.
+ *
+ * @ingroup MC
+ */
+class pka_pipeline
+{
+public:
+    /// An ion history passed to the cascade stage
+    struct job
+    {
+        size_t hid{ 0 }; ///< the history id
+        std::vector<ion> pkas; ///< PKAs generated by the ion
+        tally tion; ///< tally scores of the ion
+        std::vector<user_tally> ution; ///< user tally scores of the ion
+    };
+
+    /**
+     * @brief Create a pipeline
+     * @param capacity max # of jobs waiting in the queue
+     * @param first the 1st history id
+     * @param stride history id stride of each ion stage thread, i.e., the # of threads
+     */
+    pka_pipeline(size_t capacity, size_t first, size_t stride);
+
+    /// Push an ion history
+    void push(job &&j);
+    /// Pop the next ion history. Returns false if the queue is closed & empty
+    bool pop(job &j);
+    /// An ion stage thread stops, ids next_id, next_id+stride, ... will not be pushed
+    void leave(size_t next_id);
+    /// Close the queue, no more jobs will be pushed
+    void close();
+    /// Returns true if the queue has not been closed
+    bool is_open() const;
+
+private:
+    void advance_();
+
+    std::map<size_t, job> q_; // waiting jobs by history id
+    size_t capacity_;
+    size_t next_; // history id to pop next
+    size_t stride_;
+    std::vector<size_t> stop_; // 1st id not pushed, per id % stride
+    bool closed_{ false };
+    mutable std::mutex mtx_;
+    std::condition_variable not_full_, not_empty_;
+};
+
 /**
  * @brief The mccore class defines the core Monte-Carlo ion transport simulation algorithms.
  *
@@ -108,6 +176,12 @@ public:
         nrt_calculation_t nrt_calculation{ NRT_element };
         /// Allow intra cascade Frenkel pair recombination
         bool intra_cascade_recombination{ false };
+        /// Order of processing secondary recoils within a cascade
+        ion_queue::recoil_order_t recoil_order{ ion_queue::BreadthFirst };
+        /// Find clusters of surviving defects at the end of each cascade
+        bool cluster_analysis{ false };
+        /// Max. distance between neighboring defects of a cluster [nm]
+        float cluster_radius{ 0.5f };
         /****  Experimental stuff ****/
         bool time_ordered_cascades{ true };
         // Allow same Frenkel pair recombination
@@ -116,6 +190,21 @@ public:
         bool move_recoil{ false };
         // Subtract Ed from the recoil atom
         bool recoil_sub_ed{ false };
+        /// Cascades per library bin, 0 = no cascade library
+        size_t cascade_library_size{ 0 };
+        /// Energy bins per decade of the cascade library
+        int cascade_library_bins{ 10 };
+        /// File where the cascade library is loaded from & saved to. Empty = no file
+        std::string cascade_library_file;
+    };
+
+    /**
+     * @brief Pilot run tally used to generate a weight window
+     */
+    enum weight_window_quantity_t {
+        WWIonFlux = 0, /**< Track length density of the beam ions */
+        WWDamage = 1, /**< NRT vacancy density */
+        InvalidWWQuantity = -1
     };
 
     /**
@@ -137,6 +226,24 @@ public:
         float max_rel_eloss{ 0.05f };
         /// Mean free path range
         std::array<float, 2> mfp_range{ 1.0f, 1e30f };
+        /// Depth planes x1 < x2 < ... [nm] dividing the target into importance zones
+        std::vector<float> importance_planes;
+        /// Importance of each depth zone [I0, I1, ..., In] for n planes. Empty = all 1
+        std::vector<float> importance_values;
+        /// Importance of each target region, in the order of Target.regions. Empty = all 1
+        std::vector<float> importance_regions;
+        /// Max. number of copies when splitting an ion
+        int max_split{ 100 };
+        /// Weight window lower bound of each cell, in cell id order. Empty = no weight window
+        std::vector<float> weight_window;
+        /// Ratio of the upper to the lower weight window bound
+        float weight_window_ratio{ 5.f };
+        /// Number of pilot run histories for generating the weight window. 0 = no pilot run
+        size_t weight_window_pilot{ 0 };
+        /// Pilot run tally used to generate the weight window
+        weight_window_quantity_t weight_window_quantity{ WWIonFlux };
+        /// Recoil energy threshold [eV] for forced PKA production by beam ions. 0 = off
+        float forced_pka_energy{ 0.f };
     };
 
 protected:
@@ -156,13 +263,19 @@ protected:
     tally tally_, dtally_, tion_;
     std::vector<user_tally *> utally_, dutally_, ution_;
     uint32_t utallyMask_{ 0 };
+    // per-history total of the precision quantity: # of histories, sum, sum of squares
+    ArrayNDd prec_;
+    // precision quantity: standard tally id (> 0) or user tally index (>= 0), bin (-1 = all)
+    int prec_tid_{ 0 }, prec_ut_{ -1 }, prec_bin_{ -1 };
 
     // events
-    event_stream pka_stream_, exit_stream_, damage_stream_;
+    event_stream pka_stream_, exit_stream_, damage_stream_, cluster_stream_;
     pka_buffer pka;
     exit_buffer exit_ev;
     damage_event_buffer damage_ev;
-    uint32_t pka_stream_mask_, exit_stream_mask_, damage_stream_mask_;
+    cluster_event_buffer cluster_ev;
+    uint32_t pka_stream_mask_{ 0 }, exit_stream_mask_{ 0 }, damage_stream_mask_{ 0 };
+    event_filter pka_filter_, exit_filter_, damage_filter_;
 
     // ref counter
     std::shared_ptr<int> ref_count_;
@@ -186,22 +299,118 @@ protected:
     // shared mutex for tally data
     std::shared_ptr<std::mutex> tally_mutex_;
 
+    // shared barrier for pausing the threads at an ion history boundary
+    struct pause_ctrl_t
+    {
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::atomic_bool requested{ false };
+        int active{ 0 }; // threads in run()
+        int paused{ 0 }; // threads waiting at the barrier
+    };
+    std::shared_ptr<pause_ctrl_t> pause_;
+
+    void enter_run_();
+    void leave_run_();
+    void wait_if_paused_();
+
     // electronic dedx & straggling calculator
     dedx_calc dedx_calc_;
 
     // flight path calculator
     flight_path_calc flight_path_calc_;
 
+    // importance of each cell for splitting & Russian roulette
+    // empty = no variance reduction
+    std::vector<float> importance_;
+
+    // weight window lower bound of each cell, empty = no weight window
+    std::vector<float> ww_lower_;
+
+    // split ion i into n ions of equal weight
+    void split_(ion *i, int n);
+
+    // forced PKA production: impact parameter [nm] below which a beam ion
+    // produces recoils with T >= forced_pka_energy, [natoms x energy grid]
+    // null = forced PKA production is off
+    ArrayNDf forced_ip_;
+
     // Scattering cross-section array for all
     // projectile/target combinations
     ArrayND<abstract_scattering_calc *> scattering_matrix_;
 
+    // PKA queue of a pipelined simulation & stage of this object
+    std::shared_ptr<pka_pipeline> pipeline_;
+    bool cascade_stage_{ false };
+    int run_cascades_();
+
+    // hash of the target & options that determine the cascades of the library
+    uint64_t cascade_config_hash_() const;
+
+    // helpers of run()
+    abstract_cascade *new_cascade_() const;
+    void process_pkas_(abstract_cascade *cscd, defect_clusters *clusters);
+    void score_history_();
+    // all tally arrays, sums & sums of squares, in a fixed order
+    std::vector<ArrayNDd> tally_arrays_() const;
+
+    // cascade library, shared by all threads
+    std::shared_ptr<cascade_library> library_;
+    // footprint of the cascade being recorded for the library
+    struct footprint_recorder;
+    std::unique_ptr<footprint_recorder> recorder_;
+    void record_event_(Event ev, const ion &i);
+    // positions of the footprint being replayed
+    std::vector<vector3> replay_pos_;
+
+    // phase-space reader of this thread, null = ions are sampled by the source
+    std::unique_ptr<phase_space_reader> phase_space_;
+
 public:
     mccore();
     mccore(const parameters &p, const transport_options &t);
     mccore(const mccore &S);
     ~mccore();
 
+    /**
+     * @brief Attach this object to a PKA pipeline
+     *
+     * An object of the ion stage transports source ions and pushes their PKAs to
+     * the pipeline, as long as it is open. When the pipeline is closed, the PKAs are
+     * processed in the same thread, as in a normal simulation.
+     *
+     * An object of the cascade stage runs the PKA cascades of the jobs popped from the
+     * pipeline, until it is closed & empty.
+     *
+     * The ion stage passes the tally scores of each ion along with its PKAs.
+     * The cascade stage adds them to the cascade scores and scores the complete history,
+     * thus the per-history variances are the same as in a normal simulation.
+     *
+     * @param p the pipeline, null to detach
+     * @param cascade_stage true for the cascade stage
+     */
+    void setPipeline(std::shared_ptr<pka_pipeline> p, bool cascade_stage)
+    {
+        pipeline_ = p;
+        cascade_stage_ = cascade_stage;
+    }
+
+    /**
+     * @brief Set the phase-space reader of this object
+     *
+     * If set, source ions are generated from the records of the reader,
+     * see \ref ion_beam::source_ion(random_vars &, const target &, ion &, phase_space_reader &).
+     * If no valid record can be read, the simulation is aborted.
+     *
+     * @param ps the reader, null to sample ions from the source distributions
+     */
+    void setPhaseSpace(std::unique_ptr<phase_space_reader> ps) { phase_space_ = std::move(ps); }
+    /// Number of records used by the phase-space reader of this object, 0 if there is none
+    size_t phaseSpacePosition() const { return phase_space_ ? phase_space_->position() : 0; }
+
+    /// Returns the cascade library or null if it is not used
+    cascade_library *cascadeLibrary() const { return library_.get(); }
+
     // Number of simulated ion histories
     // This number refers to all threads
     size_t ion_count() const { return *ion_counter_; }
@@ -238,19 +447,74 @@ public:
     void copyTallyTableVar(int i, ArrayNDd &dA) const;
 
     void addUserTally(const user_tally::parameters &p);
+
+    /**
+     * @brief Set the quantity checked for the target precision
+     *
+     * The total of the quantity over the selected bins is accumulated per ion history,
+     * thus the SEM of the total is obtained exactly, including the covariance of the bins
+     * (see precisionSums()).
+     *
+     * @param tid a standard tally id or 0
+     * @param ut a user tally index, used if tid is 0
+     * @param bin the atom id for a standard tally or the flat bin index for a user tally,
+     * -1 = all bins
+     */
+    void setPrecisionQuantity(int tid, int ut, int bin);
+    /// Per-history sums of the precision quantity: # of histories, sum, sum of squares
+    const ArrayNDd &precisionSums() const { return prec_; }
     const std::vector<user_tally *> &getUserTally() const { return utally_; }
     const std::vector<user_tally *> &getUserTallyVar() const { return dutally_; }
     std::vector<user_tally *> &getUserTally() { return utally_; }
     std::vector<user_tally *> &getUserTallyVar() { return dutally_; }
 
-    /// Initialize the event streams
-    int init_streams(uint32_t event_mask);
+    /// Identifiers of the event streams, used as \ref event_sink channels
+    enum stream_id_t { PkaStream = 0, ExitStream, DamageStream, ClusterStream, NStreams };
+
+    /**
+     * @brief Initialize the event streams
+     * @param event_mask bit mask of events to store
+     * @param cluster_events store defect cluster events (requires cluster_analysis)
+     * @param sink if not null, the streams are attached to this event sink
+     * instead of temporary files
+     * @param position_resolution if > 0, positions & directions of exit and damage
+     * events are quantized and compactly encoded (see \ref event_codec)
+     * @return 0 on success
+     */
+    int init_streams(uint32_t event_mask, bool cluster_events = false, event_sink *sink = nullptr,
+                     float position_resolution = 0.f);
+    /**
+     * @brief Set the filter of an event stream
+     *
+     * Must be called after init_streams(). If a max. number of rows
+     * is defined, the stream keeps a random sample of the accepted events.
+     *
+     * The event energy checked by the filter is the exiting ion energy
+     * for the exit stream and the recoil energy for the PKA stream.
+     *
+     * @param id the stream (PkaStream, ExitStream or DamageStream)
+     * @param p the filter parameters
+     */
+    void set_event_filter(stream_id_t id, const event_filter::parameters &p);
+    /// Write all buffered events of the streams. Returns 0 on success
+    int flushEvents();
+    /// Return the event buffer prototype of a stream
+    const event_buffer &event_prototype(stream_id_t id) const;
+    /// Return a reference to a stream
+    event_stream &stream(stream_id_t id);
+    /// Return a const reference to a stream
+    const event_stream &stream(stream_id_t id) const
+    {
+        return const_cast<mccore *>(this)->stream(id);
+    }
     /// Return reference to the pka stream
     event_stream &pka_stream() { return pka_stream_; }
     /// Return reference to the exit stream
     event_stream &exit_stream() { return exit_stream_; }
-    /// Return reference to the exit stream
+    /// Return reference to the damage stream
     event_stream &damage_stream() { return damage_stream_; }
+    /// Return reference to the cluster stream
+    event_stream &cluster_stream() { return cluster_stream_; }
 
     // scattering matrix (atoms x materials)
     ArrayND<abstract_scattering_calc *> scattering_matrix() const { return scattering_matrix_; }
@@ -261,6 +525,47 @@ public:
     /// Return a reference to the flight path calculator object
     const flight_path_calc &get_fp_calc() const { return flight_path_calc_; }
 
+    /// Return the importance of each cell, empty if splitting & roulette are off
+    const std::vector<float> &importance() const { return importance_; }
+
+    /// Return the weight window lower bound of each cell, empty if there is no weight window
+    const std::vector<float> &weightWindow() const { return ww_lower_; }
+
+    /**
+     * @brief Set the weight window lower bounds
+     *
+     * Must be called after init() and before the event streams are opened.
+     *
+     * @param wl lower bound for each cell in cell id order
+     */
+    void setWeightWindow(const std::vector<float> &wl);
+
+    /**
+     * @brief Generate a weight window from the tally of this (pilot) simulation
+     *
+     * The lower bound in each cell is proportional to the density \f$ \phi \f$
+     * of the selected tally quantity,
+     * \f[
+     * w_L = \frac{2}{1+R} \frac{\phi}{\phi_{max}}
+     * \f]
+     * where \f$ R \f$ is the window ratio. Thus, the weight of source ions
+     * lies inside the window at the maximum density and ions are
+     * split as they move towards regions of low density, keeping the
+     * number of simulated tracks approximately uniform.
+     * Cells with zero score get the lowest non-zero bound.
+     *
+     * @param q the tally quantity
+     * @return the lower bounds for each cell or an empty vector if the tally has no scores
+     */
+    std::vector<float> generateWeightWindow(weight_window_quantity_t q) const;
+
+    /// Return true if ion histories may carry non-unit statistical weights
+    bool weighted() const
+    {
+        return !importance_.empty() || !ww_lower_.empty() || !forced_ip_.isNull()
+                || !source_->getParameters().phase_space.file.empty();
+    }
+
     /**
      * @brief Initialize internal variables of the mccore object
      *
@@ -287,6 +592,82 @@ public:
     random_vars::state_type rngState() const { return rng.state(); }
     void setRngState(const random_vars::state_type &s) { return rng.state(s); }
 
+    /**
+     * @brief State of a simulation thread at an ion history boundary
+     *
+     * Together with the unsampled event rows of the thread,
+     * it fully determines the continuation of a run.
+     */
+    struct thread_state
+    {
+        random_vars::state_type rng; ///< rng state
+        size_t next_id;              ///< id of the next ion
+        size_t id_stride;            ///< id allocation stride
+        size_t ions_left;            ///< remaining ions to simulate
+        size_t phase_space_pos{ 0 }; ///< records used by the phase-space reader
+        std::vector<double> tallies; ///< partial tally sums of the thread, see tallySums()
+        /// reservoir samples of the event streams with a max. number of rows
+        event_stream::reservoir_t reservoir[NStreams];
+    };
+
+    /// Return the thread state. Valid only when the object is not running
+    thread_state threadState() const;
+
+    /**
+     * @brief Continue from the given thread state
+     *
+     * Sets the rng state, the partial tallies & the reservoir samples and arms the object.
+     * Must be called after the event streams are initialized.
+     */
+    void setThreadState(const thread_state &st);
+
+    /**
+     * @brief Return the raw tally sums as a flat vector
+     *
+     * The vector holds the sums & sums of squares of all standard and user tallies,
+     * not normalized, so that partial tallies can be stored and restored exactly.
+     */
+    std::vector<double> tallySums() const;
+
+    /// Set the tallies from a vector returned by tallySums(). Returns false on a size mismatch
+    bool setTallySums(const std::vector<double> &v);
+
+    /**
+     * @brief Set the tallies to a sum of partial tallies
+     *
+     * The tallies are set to @p base (see tallySums()) plus the tallies of
+     * each object in @p parts, added in order. The objects in @p parts are not changed.
+     *
+     * Thus, the result does not depend on how often the function is called while
+     * the objects in @p parts are running, as is the case with mergeTallies().
+     *
+     * @param base raw tally sums
+     * @param parts simulation objects with partial tallies
+     */
+    void sumTallies(const std::vector<double> &base, const std::vector<mccore *> &parts);
+
+    /**
+     * @brief Pause all threads running this object or its clones
+     *
+     * Each thread stops after completing its current ion history.
+     * The function blocks until all running threads have stopped.
+     * Then, the tallies, event streams and thread states of all clones
+     * are consistent and can be copied, until resume() is called.
+     */
+    void pause();
+
+    /// Resume threads stopped by pause()
+    void resume();
+
+    /**
+     * @brief Create a detached snapshot of this object
+     *
+     * The snapshot shares the target, source and physics tables with this object
+     * but has its own ion counter and copies of the tallies and rng state.
+     * Event streams are not copied.
+     */
+    mccore *snapshot() const;
+
     /**
      * @brief Merge the results from another simulation object
      *
@@ -396,6 +777,119 @@ protected:
      */
     int transport(ion *i);
 
+    /**
+     * @brief Find clusters of the surviving defects in the ion queue
+     *
+     * Cluster statistics are written to the pka buffer and
+     * clusters with 2 or more defects are sent to the cluster stream (if open).
+     *
+     * @param c the cluster finder object
+     */
+    void analyze_clusters(defect_clusters &c);
+
+    /**
+     * @brief Simulate the cascade of a PKA, using the cascade library if available
+     *
+     * If the library bin of the PKA is full, a randomly chosen library cascade
+     * is replayed by replay_cascade_(), if it fits in the target.
+     * Otherwise, the cascade is simulated by transporting
+     * the PKA & all secondary recoils and, if the library bin is not full and
+     * no recoil exited the target, its footprint is added to the library.
+     *
+     * In both cases, the cascade defects are left on the vacancy & interstitial queues.
+     *
+     * @param j the PKA
+     */
+    void cascade_(ion *j);
+
+    /**
+     * @brief Replay a library cascade at the position of PKA j
+     *
+     * The footprint is rotated around the PKA direction by a random angle,
+     * translated to the PKA position and its energies are scaled by the ratio of the
+     * PKA energy to the library PKA energy.
+     *
+     * Vacancies & interstitials are put on the defect queues.
+     * Energy depositions and replacements are registered as
+     * Event::BoundaryCrossing and Event::Replacement, respectively.
+     *
+     * If any record falls outside the target or the footprint contains exits
+     * (e.g. from an older library file), nothing is replayed: the cascade
+     * would be affected by the surface and the PKA must be simulated.
+     *
+     * @param j the PKA, it is released by the function if the cascade is replayed
+     * @param f the library cascade footprint
+     * @return true if the cascade was replayed
+     */
+    bool replay_cascade_(ion *j, const cascade_library::footprint &f);
+
+    /**
+     * @brief Apply splitting or Russian roulette to a source ion after a boundary crossing
+     *
+     * With an importance map, the importance ratio \f$ r = I_{new}/I_{old} \f$ of the new and
+     * previous cell of ion \a i is computed.
+     * If \f$ r > 1 \f$ the ion is split into \f$ n \f$ ions,
+     * where \f$ n \f$ is \f$ r \f$ rounded stochastically to an integer.
+     * If \f$ r < 1 \f$ the ion survives with probability \f$ r \f$ and weight \f$ w/r \f$.
+     *
+     * With a weight window \f$ [w_L, R\,w_L] \f$ in the new cell,
+     * an ion with \f$ w > R\,w_L \f$ is split into \f$ \lceil w/(R\,w_L) \rceil \f$ ions and
+     * an ion with \f$ w < w_L \f$ survives with probability \f$ w/w_S \f$ and weight \f$ w_S \f$,
+     * where \f$ w_S = (1+R)\,w_L/2 \f$ is the window center.
+     *
+     * Split ions get weight \f$ w/n \f$, their number is limited by
+     * \ref transport_options::max_split, and the \f$ n-1 \f$ copies are put on the split queue.
+     * All operations preserve the expected weight, thus all tallies are unbiased.
+     *
+     * @param i the ion
+     * @return false if the ion was killed by Russian roulette
+     */
+    bool split_or_roulette(ion *i);
+
+    /**
+     * @brief Forced PKA production at a collision of a beam ion
+     *
+     * Collisions with impact parameter \f$ p < p_f(E) \f$ produce recoils with
+     * energy \f$ T \geq T_f \f$, where \f$ T_f \f$ is
+     * \ref transport_options::forced_pka_energy.
+     * For light ions, the probability \f$ q = p_f^2/p_{max}^2 \f$ of such a collision
+     * is very small.
+     *
+     * At each collision, a forced recoil is sampled from the part of the cross-section
+     * with \f$ p < p_f \f$ and is created with weight \f$ q\,w \f$,
+     * without changing the ion's energy or direction.
+     * To avoid double counting, the recoil of the analog collision is suppressed
+     * if its impact parameter is \f$ < p_f \f$.
+     * The expected number and energy spectrum of recoils are thus preserved,
+     * while a PKA above the threshold is produced at every collision.
+     *
+     * @param i the beam ion, before the analog collision
+     * @param z2 the target atom of the collision
+     * @param xs the scattering calculator for the ion/target atom combination
+     * @param ip the impact parameter of the analog collision
+     * @return true if the recoil of the analog collision must be suppressed
+     */
+    bool force_pka(ion *i, const atom *z2, const abstract_scattering_calc *xs, float ip);
+
+    // apply the Frenkel pair energy & optional displacement to a new recoil j
+    void displace_recoil_(ion *j, const atom *z2, float T)
+    {
+        // subtract El from the recoil kinetic energy,
+        // this accounts for the FP creation
+        j->de_other(z2->El());
+
+        // move recoil to the edge of recomb. area
+        // checking also for boundary crossing
+        if (par_.move_recoil) {
+            j->move(z2->Rc() * 1.001f);
+            dedx_calc_(*j, z2->Rc());
+            if (par_.recoil_sub_ed) {
+                double de = j->erg() + z2->Ed() - T;
+                j->de_phonon(de);
+            }
+        }
+    }
+
     /**
      * @brief Generate a new recoil ion
      *
@@ -454,6 +948,10 @@ protected:
         if (static_cast<uint32_t>(ev) & tion_.eventMask())
             tion_(ev, i, pv);
 
+        // record for the cascade library
+        if (recorder_)
+            record_event_(ev, i);
+
         // send to all user_tally objects
         if (static_cast<uint32_t>(ev) & utallyMask_) {
             for (int k = 0; k < ution_.size(); ++k)
@@ -461,18 +959,52 @@ protected:
         }
 
         // send to the event streams
-        if (static_cast<uint32_t>(ev) & damage_stream_mask_) {
+        // filters are checked before filling the buffers
+        if ((static_cast<uint32_t>(ev) & damage_stream_mask_)
+            && damage_filter_.accept(i.erg(), i.myAtom()->id(), i.recoil_id(), i.pos())) {
             damage_ev.set(i);
             damage_stream_.write(&damage_ev);
         }
-        if (static_cast<uint32_t>(ev) & exit_stream_mask_) {
+        if ((static_cast<uint32_t>(ev) & exit_stream_mask_)
+            && exit_filter_.accept(i.erg(), i.myAtom()->id(), i.recoil_id(), i.pos())) {
             exit_ev.set(&i);
             exit_stream_.write(&exit_ev);
         }
-        if (static_cast<uint32_t>(ev) & pka_stream_mask_) {
+        if ((static_cast<uint32_t>(ev) & pka_stream_mask_)
+            && pka_filter_.accept(pka.recoilE(), pka.atomid(), i.recoil_id(), i.pos0())) {
             pka_stream_.write(&pka);
         }
     }
+
+    /**
+     * @brief Handle simulation events generated by a \ref defect
+     *
+     * Same as handle_event(Event, const ion &, const void *) for events
+     * that refer to a defect record, i.e., Event::Vacancy.
+     *
+     * @param ev The type of event
+     * @param d The defect
+     * @param c The defect's scoring data
+     */
+    void handle_event(Event ev, const defect &d, const defect_info &c)
+    {
+        // send to tally for scoring
+        if (static_cast<uint32_t>(ev) & tion_.eventMask())
+            tion_(ev, d, c);
+
+        // send to all user_tally objects
+        if (static_cast<uint32_t>(ev) & utallyMask_) {
+            for (int k = 0; k < ution_.size(); ++k)
+                (*(ution_[k]))(ev, d, c);
+        }
+
+        // send to the damage event stream
+        if ((static_cast<uint32_t>(ev) & damage_stream_mask_)
+            && damage_filter_.accept(0.f, d.myAtom()->id(), c.recoil_id, d.pos)) {
+            damage_ev.set(d, c);
+            damage_stream_.write(&damage_ev);
+        }
+    }
 };
 
 #endif // SIMULATION_H
@@ -5,6 +5,7 @@
 
 #include <ctime>
 #include <thread>
+#include <atomic>
 #include "user_tally.h"
 
 /**
@@ -65,6 +66,20 @@ struct mcconfig
         int threads{ 1 };
         /// Seed for the random number generator
         unsigned int seed{ 123456789 };
+        /// Threads of the cascade stage of a pipelined FullCascade simulation. 0 = no pipeline
+        int cascade_threads{ 0 };
+        /// Max. number of ion histories waiting in the pipeline for the cascade stage
+        size_t pipeline_capacity{ 1024 };
+        /// Stop the run when the relative SEM of the precision quantity is below this value.
+        /// 0 = no precision target
+        float target_rel_sem{ 0.f };
+        /// Precision quantity: a standard tally name (e.g. "Vacancies") or a user tally id
+        std::string precision_tally{ "Vacancies" };
+        /// Precision quantity bin: atom id for a standard tally, flat bin index for a
+        /// user tally. -1 = total
+        int precision_bin{ -1 };
+        /// Minimum number of histories before the precision is checked
+        size_t precision_min_ions{ 1000 };
     };
 
     /// output parameters
@@ -74,7 +89,7 @@ struct mcconfig
         std::string title{ "Ion Simulation" };
         /// Base name for the output file
         std::string outfilename{ "out" };
-        /// Interval in ms to backup simulation data @TODO
+        /// Interval in ms between checkpoints of a running simulation. 0 = no checkpoints
         int storage_interval{ 60000 };
         /// Store ion exit events
         bool store_exit_events{ false };
@@ -82,6 +97,26 @@ struct mcconfig
         bool store_pka_events{ false };
         /// Store the damage events
         bool store_damage_events{ false };
+        /// Store the defect cluster events
+        bool store_cluster_events{ false };
+        /// Write events directly to the HDF5 output file during the run
+        bool direct_event_output{ false };
+        /// Resolution in nm of exit & damage event positions. 0 = full precision
+        float event_position_resolution{ 0.f };
+        /// Deflate compression level (0-9) of saved event datasets. 0 = contiguous, uncompressed
+        int event_deflate_level{ 6 };
+        /// Apply the byte shuffle filter to event datasets (always on for quantized data)
+        bool event_shuffle{ false };
+        /// Chunk size of event datasets in KiB
+        int event_chunk_kb{ 1024 };
+        /// Number of threads compressing event data on save. 0 = all available cores
+        int compression_threads{ 0 };
+        /// Filter for ion exit events
+        event_filter::parameters exit_filter;
+        /// Filter for PKA events
+        event_filter::parameters pka_filter;
+        /// Filter for damage events
+        event_filter::parameters damage_filter;
         /// Store electronic energy loss data
         bool store_dedx{ true };
     };
@@ -260,6 +295,25 @@ public:
         int nthreads;
         size_t run_ion_count;
         size_t total_ion_count;
+        /// Why the run stopped: "max_no_ions", "target_precision", "max_cpu_time" or "aborted"
+        std::string stop_reason;
+        /// Relative SEM of the precision quantity at the end of the run, -1 if not available
+        double rel_sem{ -1 };
+    };
+
+    /// Statistics of the last call to save()
+    struct save_stats_t
+    {
+        /// Size of the output file in bytes
+        size_t file_bytes{ 0 };
+        /// Uncompressed size of the saved event data in bytes
+        size_t event_bytes{ 0 };
+        /// Stored (compressed) size of the saved event data in bytes
+        size_t event_stored_bytes{ 0 };
+        /// Wall time of the save operation (s)
+        double wall_time_s{ 0 };
+        /// Write throughput in MB/s
+        double mb_per_s() const { return wall_time_s > 0 ? file_bytes / wall_time_s / 1.e6 : 0; }
     };
 
     struct version_info_t
@@ -279,6 +333,8 @@ protected:
 
     std::vector<run_data> run_history_;
 
+    save_stats_t save_stats_;
+
     // config
     mcconfig config_;
 
@@ -292,10 +348,77 @@ protected:
     // 2. simulation execution clones
     std::vector<mccore *> sim_clones_;
 
+    // sink for direct event output to the HDF5 file
+    std::shared_ptr<event_sink> event_sink_;
+    // file where the events of the simulation are currently stored (direct output)
+    std::string event_file_;
+    // open the event sink on the output file & prepare the event datasets
+    int open_event_sink_(std::ostream *os);
+    // finish writing events & close the event sink
+    int close_event_sink_(std::ostream *os);
+    // open the event streams of s with the output options
+    void init_streams_(mccore *s, event_sink *sink);
+
+    // results of the main simulation object at the start of a run:
+    // ion count, raw tally sums & reservoir samples of the event streams.
+    // The final results are these plus the partial results of each clone, added in order
+    struct run_base_t
+    {
+        size_t ion_count{ 0 };
+        std::vector<double> tallies;
+        event_stream::reservoir_t reservoir[mccore::NStreams];
+    };
+
+    // a consistent snapshot of a running simulation, written to disk by a background thread
+    struct checkpoint_t
+    {
+        // detached copy of the driver with the merged tallies
+        std::shared_ptr<mcdriver> snap;
+        // state of each simulation thread & target ion count of the run
+        std::vector<mccore::thread_state> threads;
+        size_t target_ion_count{ 0 };
+        // results at the start of the run
+        run_base_t base;
+        // read-only snapshots of the event streams to merge, per stream id
+        std::vector<std::unique_ptr<event_stream>> streams[mccore::NStreams];
+        // direct event output: the event file & its # of rows per stream id
+        std::string event_file;
+        std::vector<size_t> event_rows;
+        // checkpoint file name
+        std::string fname;
+    };
+    std::thread ckpt_thread_;
+    std::atomic_bool ckpt_busy_{ false };
+    // take a checkpoint of the running simulation & start writing it
+    void checkpoint_(size_t n_end, const run_base_t &base, const run_data &rd);
+    // relative SEM of the Run.precision_tally quantity, -1 if not available
+    double precision_() const;
+    // write a checkpoint to a temp file & rename it. Runs in ckpt_thread_
+    void write_checkpoint_(std::shared_ptr<checkpoint_t> c);
+    // append the checkpoint data to a saved file
+    static int write_checkpoint_info(const std::string &fname, const checkpoint_t &c);
+
+    // continuation of a run loaded from a checkpoint
+    std::vector<mccore::thread_state> resume_threads_;
+    size_t resume_target_{ 0 };
+    run_base_t resume_base_;
+    // move the events of the resumed threads from the main streams to the clone streams
+    int resume_events_(const run_base_t &base);
+    // records used by each thread's phase-space reader up to now
+    std::vector<size_t> phase_space_pos_;
+    // direct event output: rows of the event datasets consistent with the checkpoint
+    std::vector<size_t> resume_event_rows_;
+
+    // weight window pilot run, while it is running
+    std::atomic<mcdriver *> pilot_{ nullptr };
+    int run_pilot_();
+
     // No default constructor
     mcdriver() = delete;
     // Protected constructor. use either create() or load()
     mcdriver(const mcconfig &cfg);
+    // Snapshot constructor, takes ownership of s
+    mcdriver(const mcconfig &cfg, mccore *s);
 
 public:
     /**
@@ -326,6 +449,25 @@ public:
     /// Returns a const pointer to the mccore simulation object
     const mccore *getSim() const { return s_.get(); }
 
+    /**
+     * @brief Map the stored events of a stream into an event_view
+     *
+     * The event records are viewed in place, without copying.
+     *
+     * This is not possible if the events are written directly to the output file
+     * (Output.direct_event_output) or if the stream is encoded with an \ref event_codec
+     * (exit & damage events with Output.event_position_resolution > 0).
+     * Events in a saved HDF5 file can be mapped with event_reader::map(),
+     * provided the file was saved with Output.event_deflate_level = 0.
+     *
+     * The simulation must not be running.
+     *
+     * @param id the stream id
+     * @param v the view to map the events into
+     * @return 0 on success
+     */
+    int mapEvents(mccore::stream_id_t id, event_view &v);
+
     /// Returns the current number of simulated ions
     size_t ion_count() const { return s_->ion_count(); }
 
@@ -409,12 +551,31 @@ public:
     void wait();
     /// Returns a reference to the run history
     const std::vector<run_data> &run_history() const { return run_history_; }
+    /// Returns statistics of the last save() operation
+    const save_stats_t &save_stats() const { return save_stats_; }
+    /**
+     * @brief Name of the checkpoint file
+     *
+     * If Output.storage_interval > 0, exec() periodically writes a
+     * complete snapshot of the running simulation to this file.
+     * It can be loaded with load() to continue an interrupted run.
+     * Run with the same number of threads, the continued run gives the same
+     * tallies & events as an uninterrupted one.
+     *
+     * @return the output file base name + ".ckpt.h5"
+     */
+    std::string checkpointFileName() const { return config_.Output.outfilename + ".ckpt.h5"; }
 
     /**
      * @brief Saves all data and results in a HDF5 file
      *
      * For details on the structure of the output file see \ref out_file.
      *
+     * With direct event output, if \p h5filename is the file receiving the events,
+     * the events are kept and all other objects are rewritten in place.
+     * Freed file space is reused by the next save. Saving to another file copies
+     * the complete /events group with H5Ocopy, which may take a while for large event data.
+     *
      * @param h5filename the output file name
      * @param os optional stream pointer to write any error messages
      * @return 0 if succesful
@@ -454,10 +615,11 @@ public:
      * @param cb Pointer to user-supplied callback function (optional)
      * @param msInterval Period in ms between calls to callback
      * @param callback_user_data Pointer to user data to pass to the callback function (optional)
+     * @param os optional stream pointer to write any error messages
      * @return 0 on success, non-zero otherwise
      */
     int exec(progress_callback cb = nullptr, size_t msInterval = 1000,
-             void *callback_user_data = 0);
+             void *callback_user_data = 0, std::ostream *os = nullptr);
 };
 
 #endif // MCDRIVER_H
@@ -288,6 +288,25 @@ inline constexpr double toDouble(const std::uint64_t i) noexcept
     return (i >> 11) * 0x1.0p-53;
 }
 
+/**
+ * @brief Base-2 radical inverse (van der Corput sequence) of i in [0,1)
+ *
+ * The bits of i are mirrored about the binary point. Any 2^m consecutive
+ * values of i (aligned at a multiple of 2^m) fall one in each of the intervals [k/2^m, (k+1)/2^m).
+ *
+ * @ingroup RNG
+ */
+inline double radical_inverse2(std::uint64_t i) noexcept
+{
+    i = (i << 32) | (i >> 32);
+    i = ((i & 0x0000FFFF0000FFFFULL) << 16) | ((i >> 16) & 0x0000FFFF0000FFFFULL);
+    i = ((i & 0x00FF00FF00FF00FFULL) << 8) | ((i >> 8) & 0x00FF00FF00FF00FFULL);
+    i = ((i & 0x0F0F0F0F0F0F0F0FULL) << 4) | ((i >> 4) & 0x0F0F0F0F0F0F0F0FULL);
+    i = ((i & 0x3333333333333333ULL) << 2) | ((i >> 2) & 0x3333333333333333ULL);
+    i = ((i & 0x5555555555555555ULL) << 1) | ((i >> 1) & 0x5555555555555555ULL);
+    return toDouble(i);
+}
+
 /**
  * @brief The random_vars class is used for generating random quantities needed in the simulation
  *
@@ -238,6 +238,12 @@ public:
     /// @param pv pointer to additional data, if available
     void operator()(Event ev, const ion &i, const void *pv = 0);
 
+    /// @brief Score an event caused by a defect
+    /// @param ev the event type
+    /// @param d the defect record
+    /// @param c the defect's scoring data
+    void operator()(Event ev, const defect &d, const defect_info &c);
+
     void resetIonizationCounter() { ionizationCounter_ = 0.0; }
     double ionizationCounter() { return ionizationCounter_; }
 
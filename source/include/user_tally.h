@@ -145,7 +145,17 @@ public:
     void operator()(Event ev, const ion &i, const void *pv = 0)
     {
         if (ev == par_.event && get_bin(i, pv))
-            data_(idx)++;
+            data_(idx) += i.weight();
+    }
+
+    /// @brief Score an event caused by a defect
+    /// @param ev the event type
+    /// @param d the defect record
+    /// @param c the defect's scoring data
+    void operator()(Event ev, const defect &d, const defect_info &c)
+    {
+        if (ev == par_.event && get_bin(d, c))
+            data_(idx) += c.weight;
     }
 
     const char *bin_name(int i) const;
@@ -179,6 +189,9 @@ private:
     std::vector<size_t> vac_id; // will be same size as bin_sizes
 
     bool get_bin(const ion &i, const void *pv = 0); // const;
+    bool get_bin(const defect &d, const defect_info &c);
+    bool get_bin(const vector3 &x, const vector3 &n, double erg, int atom_id, int recoil_id,
+                 const void *pv);
     bool push_bins(bin_variable_code c, const bin_vector_t &edges, size_t natoms = 0);
 };
 
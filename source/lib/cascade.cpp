@@ -1,10 +1,11 @@
 #include "cascade.h"
 
-inline std::ostream &operator<<(std::ostream &os, const ion *d)
+#include <cstring>
+
+inline std::ostream &operator<<(std::ostream &os, const defect &d)
 {
-    os << d->t() << '\t' << d->myAtom()->id() << '\t'
-       << ((d->type() == ion::interstitial) ? 'I' : 'V') << '\t' << d->pos().x() << '\t'
-       << d->pos().y() << '\t' << d->pos().z() << '\t' << d->cellid() << '\t' << d->uid();
+    os << d.t << '\t' << d.myAtom()->id() << '\t' << ((d.type == ion::interstitial) ? 'I' : 'V')
+       << '\t' << d.pos.x() << '\t' << d.pos.y() << '\t' << d.pos.z() << '\t' << d.uid;
     return os;
 }
 
@@ -13,9 +14,9 @@ void abstract_cascade::count_riv(float *s, float *sc) const
     for (auto &p : riv_) {
         auto &d1 = p.first; // interstitial
         auto &d2 = p.second; // vacancy
-        int i = d1->myAtom()->id() - 1; // atom id
+        int i = d1.myAtom()->id() - 1; // atom id
         s[i]++;
-        if (d1->uid() == d2->uid())
+        if (d1.uid == d2.uid)
             sc[i]++;
     }
 }
@@ -30,104 +31,254 @@ void abstract_cascade::clear(ion_queue &q)
     //     q.free_ion(d);
     // v_.clear();
 
-    for (auto i = riv_.begin(); i != riv_.end(); ++i) {
-        q.free_ion(i->first);
-        q.free_ion(i->second);
-    }
+    // vacancies do not hold an ion buffer
+    for (auto i = riv_.begin(); i != riv_.end(); ++i)
+        q.free_ion(q.info(i->first).src);
     riv_.clear();
 }
 
-bool abstract_cascade::recombine_vacancy(ion *d1)
+void cell_hash_grid::init(const grid3D &g, float h)
+{
+    const grid1D *ax[3] = { &g.x(), &g.y(), &g.z() };
+    for (int k = 0; k < 3; ++k) {
+        const grid1D &x = *ax[k];
+        x0_[k] = x.front();
+        periodic_[k] = x.periodic();
+        // # of cells with size >= h
+        // limited to 2^20 per axis so that the cell key does not overflow
+        float n = h > 0.f ? std::floor(x.w() / h) : 1.f;
+        n_[k] = int(std::max(1.f, std::min(n, float(1 << 20))));
+        dx_[k] = x.w() / n_[k];
+    }
+}
+
+void cell_hash_grid::neighbor_range(const int *i0, int *imin, int *imax) const
+{
+    for (int k = 0; k < 3; ++k) {
+        if (periodic_[k] && n_[k] < 3) {
+            imin[k] = 0;
+            imax[k] = n_[k] - 1;
+        } else if (periodic_[k]) {
+            imin[k] = i0[k] - 1;
+            imax[k] = i0[k] + 1;
+        } else {
+            imin[k] = std::max(i0[k] - 1, 0);
+            imax[k] = std::min(i0[k] + 1, n_[k] - 1);
+        }
+    }
+}
+
+void defect_cell_list::init(const grid3D &g, float h)
+{
+    grid_.init(g, h);
+    cells_.clear();
+    size_ = 0;
+}
+
+void defect_cell_list::insert(const defect &d, size_t seq)
+{
+    cells_[grid_.key(d.pos)].push_back({ d, seq });
+    size_++;
+}
+
+const defect_cell_list::entry *defect_cell_list::find_partner(const defect &d1,
+                                                              const grid3D &g) const
+{
+    if (size_ == 0)
+        return nullptr;
+
+    float rc = d1.myAtom()->Rc(); // recombination radius
+
+    // cell index of d1 and range of neighbor cells along each axis
+    int i0[3], imin[3], imax[3];
+    grid_.index(d1.pos, i0);
+    grid_.neighbor_range(i0, imin, imax);
+
+    const entry *best = nullptr;
+    float dbest = 0.f;
+
+    for (int i = imin[0]; i <= imax[0]; ++i) {
+        int ii = grid_.wrap(0, i);
+        for (int j = imin[1]; j <= imax[1]; ++j) {
+            int jj = grid_.wrap(1, j);
+            for (int k = imin[2]; k <= imax[2]; ++k) {
+                int kk = grid_.wrap(2, k);
+                auto it = cells_.find(grid_.key(ii, jj, kk));
+                if (it == cells_.end())
+                    continue;
+                for (const entry &e : it->second) {
+                    if (d1.myAtom() != e.d.myAtom())
+                        continue;
+                    float d = g.distance(d1.pos, e.d.pos);
+                    if (d < rc
+                        && (!best || d < dbest || (d == dbest && e.seq < best->seq))) {
+                        best = &e;
+                        dbest = d;
+                    }
+                }
+            }
+        }
+    }
+
+    return best;
+}
+
+void defect_cell_list::erase(const entry *e)
+{
+    auto it = cells_.find(grid_.key(e->d.pos));
+    assert(it != cells_.end());
+    bucket_t &b = it->second;
+    size_t k = e - b.data();
+    assert(k < b.size());
+    // order within a cell does not matter
+    if (k + 1 < b.size())
+        b[k] = b.back();
+    b.pop_back();
+    if (b.empty())
+        cells_.erase(it);
+    size_--;
+}
+
+void defect_cell_list::take_all(std::vector<entry> &v)
+{
+    v.clear();
+    for (auto &c : cells_)
+        v.insert(v.end(), c.second.begin(), c.second.end());
+    std::sort(v.begin(), v.end(),
+              [](const entry &lhs, const entry &rhs) { return lhs.seq < rhs.seq; });
+    cells_.clear();
+    size_ = 0;
+}
+
+bool abstract_cascade::recombine_vacancy(const defect &d1)
 {
-    auto it = find_rc_partner(d1, i_);
+    auto e = i_.find_partner(d1, g);
 
-    if (it == i_.end()) {
+    if (!e) {
         // defect does not recombine, put it on the list
-        v_.push_back(d1);
+        v_.insert(d1, seq_++);
         return false;
     } else {
         // defect recombines with the closest anti-defect
-        riv_.emplace_back(*it, d1);
-        i_.erase(it);
+        riv_.emplace_back(e->d, d1);
+        i_.erase(e);
         return true;
     }
 }
 
-bool abstract_cascade::recombine_interstitial(ion *d1)
+bool abstract_cascade::recombine_interstitial(const defect &d1)
 {
-    auto it = find_rc_partner(d1, v_);
+    auto e = v_.find_partner(d1, g);
 
-    if (it == v_.end()) {
+    if (!e) {
         // defect does not recombine, put it on the list
-        i_.push_back(d1);
+        i_.insert(d1, seq_++);
         return false;
     } else {
         // defect recombines with the closest anti-defect
-        riv_.emplace_back(d1, *it);
-        v_.erase(it);
+        riv_.emplace_back(d1, e->d);
+        v_.erase(e);
         return true;
     }
 }
 
-abstract_cascade::defect_list_t::iterator abstract_cascade::find_rc_partner(const ion *d1,
-                                                                            defect_list_t &adcont)
+void abstract_cascade::push_back_defects(ion_queue &q)
 {
-    float rc = d1->myAtom()->Rc(); // recombination radius
+    // return defects in the order they were stored
+    std::vector<defect_cell_list::entry> buff;
+    i_.take_all(buff);
+    for (auto &e : buff)
+        q.push_interstitial(e.d);
+    v_.take_all(buff);
+    for (auto &e : buff)
+        q.push_vacancy(e.d);
+    seq_ = 0;
+}
 
-    // define a distance-ordered defect queue
-    typedef std::pair<defect_list_t::iterator, float> _T;
-    std::priority_queue<_T, std::vector<_T>, defect_distance_cmp<_T>> fpq;
+// #define CASCADE_DEBUG_PRINT
 
-    // go through all vacancies
-    auto i = adcont.begin();
-    for (; i != adcont.end(); ++i) {
-        auto d2 = *i;
-        if (d1->myAtom() == d2->myAtom()) {
-            float d = g.distance(d1->pos(), d2->pos());
-            if (d < rc)
-                fpq.push(_T(i, d));
+void time_ordered_cascade::sort_keys_()
+{
+    /*
+     * LSD radix sort, 8 bits per pass
+     *
+     * Defect times are non-negative, thus the IEEE754 bit pattern of the
+     * double has the same order as the value.
+     * Passes where all keys have the same digit are skipped.
+     */
+    const int nbits = 8;
+    const int nbuckets = 1 << nbits;
+    size_t n = keys_.size();
+    keys_tmp_.resize(n);
+
+    uint64_t all_or = 0, all_and = ~uint64_t(0);
+    for (const auto &k : keys_) {
+        all_or |= k.first;
+        all_and &= k.first;
+    }
+    uint64_t differ = all_or ^ all_and; // bits that are not the same in all keys
+
+    size_t count[nbuckets];
+    for (int shift = 0; shift < 64; shift += nbits) {
+        if (((differ >> shift) & (nbuckets - 1)) == 0)
+            continue;
+        std::fill(count, count + nbuckets, 0);
+        for (const auto &k : keys_)
+            count[(k.first >> shift) & (nbuckets - 1)]++;
+        size_t sum = 0;
+        for (int b = 0; b < nbuckets; ++b) {
+            size_t c = count[b];
+            count[b] = sum;
+            sum += c;
         }
+        for (const auto &k : keys_)
+            keys_tmp_[count[(k.first >> shift) & (nbuckets - 1)]++] = k;
+        keys_.swap(keys_tmp_);
     }
-
-    return fpq.empty() ? adcont.end() : fpq.top().first;
 }
 
-// #define CASCADE_DEBUG_PRINT
-
 void time_ordered_cascade::intra_cascade_recombination(ion_queue &q)
 {
     assert(i_.empty());
     assert(v_.empty());
     assert(riv_.empty());
+    assert(seq_ == 0);
+
+    // get all cascade defects into a mixed I-V array
+    timeline_.clear();
+    timeline_.insert(timeline_.end(), q.vacancies().begin(), q.vacancies().end());
+    timeline_.insert(timeline_.end(), q.interstitials().begin(), q.interstitials().end());
+    q.vacancies().clear();
+    q.interstitials().clear();
+
+    // sort by time
+    keys_.resize(timeline_.size());
+    for (size_t k = 0; k < timeline_.size(); ++k) {
+        assert(timeline_[k].t >= 0.0);
+        uint64_t u;
+        std::memcpy(&u, &timeline_[k].t, sizeof(u));
+        keys_[k] = time_key_t(u, k);
+    }
+    sort_keys_();
 
 #ifdef CASCADE_DEBUG_PRINT
 
-    bool dbg = defect_queue.size() > 10;
-    if (dbg) {
-        std::cout << "PKA E=" << pka.erg() << std::endl;
-        std::cout << "R=" << pka.pos() << std::endl;
-        std::cout << "defect_queue (N=" << defect_queue.size() << "):" << std::endl;
-    }
+    bool dbg = timeline_.size() > 10;
+    if (dbg)
+        std::cout << "defect timeline (N=" << timeline_.size() << "):" << std::endl;
 
 #endif
 
-    // get all cascade defects into a mixed I-V time-ordered queue
-    defect_queue_t defect_queue;
-    while (ion *d = q.pop_vacancy())
-        defect_queue.push(d);
-    while (ion *d = q.pop_interstitial())
-        defect_queue.push(d);
-
     // process defects in time-ordered way
-    for (; !defect_queue.empty(); defect_queue.pop()) {
-        ion *d = defect_queue.top();
+    for (const auto &k : keys_) {
+        const defect &d = timeline_[k.second];
 
 #ifdef CASCADE_DEBUG_PRINT
         if (dbg)
-            print(std::cout, *d);
+            std::cout << d << std::endl;
 #endif
 
-        if (d->type() == ion::interstitial)
+        if (d.type == ion::interstitial)
             recombine_interstitial(d);
         else
             recombine_vacancy(d);
@@ -135,22 +286,17 @@ void time_ordered_cascade::intra_cascade_recombination(ion_queue &q)
 
 #ifdef CASCADE_DEBUG_PRINT
     if (dbg) {
-        std::cout << "END defect_queue\n\n";
+        std::cout << "END defect timeline\n\n";
         std::cout << "Recombinations (" << riv_.size() << "):\n";
         for (auto &p : riv_) {
-            print(std::cout, *p.first);
-            print(std::cout, *p.second);
+            std::cout << p.first << std::endl;
+            std::cout << p.second << std::endl;
         }
     }
 #endif
 
     // return all non-recombining Is and Vs back to the ion queue
-    for (auto &d : i_)
-        q.push_interstitial(d);
-    i_.clear();
-    for (auto &d : v_)
-        q.push_vacancy(d);
-    v_.clear();
+    push_back_defects(q);
 }
 
 void unordered_cascade::intra_cascade_recombination(ion_queue &q)
@@ -158,22 +304,116 @@ void unordered_cascade::intra_cascade_recombination(ion_queue &q)
     assert(i_.empty());
     assert(v_.empty());
     assert(riv_.empty());
+    assert(seq_ == 0);
 
     // get all cascade interstitials
-    while (ion *d = q.pop_interstitial())
-        i_.push_back(d);
+    for (const defect &d : q.interstitials())
+        i_.insert(d, seq_++);
+    q.interstitials().clear();
 
     // loop over vacancies and find recombination pairs
-    while (ion *d = q.pop_vacancy())
+    for (const defect &d : q.vacancies())
         recombine_vacancy(d);
+    q.vacancies().clear();
 
     // return all non-recombining Is and Vs back to the ion queue
-    for (auto &d : i_)
-        q.push_interstitial(d);
-    i_.clear();
-    for (auto &d : v_)
-        q.push_vacancy(d);
-    v_.clear();
+    push_back_defects(q);
+}
+
+void defect_clusters::analyze(const std::vector<defect> &d)
+{
+    size_t n = d.size();
+    clusters_.clear();
+    if (n == 0)
+        return;
+
+    // hash defects into cells
+    cells_.clear();
+    for (uint32_t k = 0; k < n; ++k)
+        cells_[grid_.key(d[k].pos)].push_back(k);
+
+    parent_.resize(n);
+    for (uint32_t k = 0; k < n; ++k)
+        parent_[k] = k;
+
+    // join each defect with its neighbors within r_
+    int i0[3], imin[3], imax[3];
+    for (uint32_t k = 0; k < n; ++k) {
+        grid_.index(d[k].pos, i0);
+        grid_.neighbor_range(i0, imin, imax);
+        for (int i = imin[0]; i <= imax[0]; ++i) {
+            int ii = grid_.wrap(0, i);
+            for (int j = imin[1]; j <= imax[1]; ++j) {
+                int jj = grid_.wrap(1, j);
+                for (int l = imin[2]; l <= imax[2]; ++l) {
+                    int ll = grid_.wrap(2, l);
+                    auto it = cells_.find(grid_.key(ii, jj, ll));
+                    if (it == cells_.end())
+                        continue;
+                    for (uint32_t m : it->second) {
+                        // each pair is checked once
+                        if (m > k && g.distance(d[k].pos, d[m].pos) < r_)
+                            unite_(k, m);
+                    }
+                }
+            }
+        }
+    }
+
+    // accumulate cluster size & displacement from the 1st defect (the root)
+    const grid1D *ax[3] = { &g.x(), &g.y(), &g.z() };
+    slot_.assign(n, -1);
+    for (uint32_t k = 0; k < n; ++k) {
+        uint32_t r = find_(k);
+        if (slot_[r] < 0) {
+            slot_[r] = clusters_.size();
+            clusters_.push_back({ 0, vector3(0.f, 0.f, 0.f) });
+        }
+        cluster &c = clusters_[slot_[r]];
+        c.n++;
+        for (int a = 0; a < 3; ++a) {
+            float dx = d[k].pos[a] - d[r].pos[a];
+            if (ax[a]->periodic())
+                dx -= ax[a]->w() * std::round(dx / ax[a]->w());
+            c.x[a] += dx;
+        }
+    }
+
+    // centroid = root position + mean displacement
+    for (uint32_t k = 0; k < n; ++k) {
+        if (slot_[k] < 0)
+            continue;
+        cluster &c = clusters_[slot_[k]];
+        c.x /= float(c.n);
+        c.x += d[k].pos;
+        for (int a = 0; a < 3; ++a)
+            ax[a]->apply_bc(c.x[a]);
+    }
+}
+
+size_t defect_clusters::count() const
+{
+    size_t m = 0;
+    for (const cluster &c : clusters_)
+        m += (c.n > 1);
+    return m;
+}
+
+size_t defect_clusters::clustered() const
+{
+    size_t m = 0;
+    for (const cluster &c : clusters_)
+        if (c.n > 1)
+            m += c.n;
+    return m;
+}
+
+size_t defect_clusters::max_size() const
+{
+    size_t m = 0;
+    for (const cluster &c : clusters_)
+        m = std::max(m, c.n);
+    return m;
 }
 
 // update tally scores due to I-V recombinations
@@ -224,3 +464,41 @@ void unordered_cascade::intra_cascade_recombination(ion_queue &q)
 //         t.write(&ev);
 //     }
 // }
+
+cascade_library::cascade_library(int natoms, int nmat, size_t n, int bins_per_decade,
+                                 uint64_t config_hash)
+    : natoms_(natoms),
+      nmat_(nmat),
+      ne_(9 * bins_per_decade + 1), // up to 1 GeV
+      bpd_(bins_per_decade),
+      n_(n),
+      hash_(config_hash),
+      bins_(size_t(natoms) * nmat * ne_)
+{
+}
+
+size_t cascade_library::count() const
+{
+    std::shared_lock lock(mtx_);
+    size_t c = 0;
+    for (const auto &b : bins_)
+        c += b.size();
+    return c;
+}
+
+cascade_library::footprint_ptr cascade_library::pick(int k, random_vars &rng) const
+{
+    std::shared_lock lock(mtx_);
+    const auto &b = bins_[k];
+    if (b.size() < n_)
+        return nullptr;
+    return b[std::min(size_t(rng.u01d() * n_), n_ - 1)];
+}
+
+void cascade_library::add(int k, footprint_ptr f)
+{
+    std::unique_lock lock(mtx_);
+    auto &b = bins_[k];
+    if (b.size() < n_)
+        b.push_back(f);
+}
@@ -4,14 +4,262 @@
 #include "target.h"
 #include "tally.h"
 
+#include <algorithm>
+#include <functional>
 #include <filesystem>
+#include <cmath>
 #include <cstdio>
+#include <sstream>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 namespace fs = std::filesystem;
 
+size_t event_buffer::add_column(const std::string &name, const std::string &desc,
+                                column_type_t t, column_quantity_t q)
+{
+    // natural alignment of the column
+    size_t sz = type_size(t);
+    size_t offset = (record_size_ + sz - 1) / sz * sz;
+    columns_.push_back({ name, desc, t, offset, q });
+    record_size_ = offset + sz;
+    buff_.resize((record_size_ + sizeof(uint64_t) - 1) / sizeof(uint64_t), 0);
+    return offset;
+}
+
+void event_buffer::clear_columns()
+{
+    columns_.clear();
+    record_size_ = 0;
+    buff_.clear();
+    ofW_ = 0;
+}
+
+std::vector<std::string> event_buffer::columnNames() const
+{
+    std::vector<std::string> v;
+    for (const column_t &c : columns_)
+        v.push_back(c.name);
+    return v;
+}
+
+std::vector<std::string> event_buffer::columnDescriptions() const
+{
+    std::vector<std::string> v;
+    for (const column_t &c : columns_)
+        v.push_back(c.description);
+    return v;
+}
+
+/*
+ * varint & zig-zag helpers of event_codec
+ */
+namespace {
+
+inline uint64_t zigzag(int64_t v)
+{
+    return (uint64_t(v) << 1) ^ uint64_t(v >> 63);
+}
+inline int64_t unzigzag(uint64_t u)
+{
+    return int64_t(u >> 1) ^ -int64_t(u & 1);
+}
+
+inline void put_varint(uint64_t u, std::vector<char> &out)
+{
+    while (u >= 0x80) {
+        out.push_back(char(u | 0x80));
+        u >>= 7;
+    }
+    out.push_back(char(u));
+}
+inline bool get_varint(const char *&p, const char *end, uint64_t &u)
+{
+    u = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        u |= uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// access a floating point column as double
+inline double get_real(const char *p, event_buffer::column_type_t t)
+{
+    if (t == event_buffer::Float64) {
+        double v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    float v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+inline void set_real(char *p, event_buffer::column_type_t t, double v)
+{
+    if (t == event_buffer::Float64)
+        std::memcpy(p, &v, sizeof(v));
+    else {
+        float f = v;
+        std::memcpy(p, &f, sizeof(f));
+    }
+}
+
+} // namespace
+
+event_codec::event_codec(const event_buffer &proto, float position_resolution)
+{
+    if (!(position_resolution > 0))
+        return;
+    columns_ = proto.layout();
+    rsize_ = proto.size();
+    // round down to a power of 2
+    pres_ = std::ldexp(1., std::ilogb(position_resolution));
+    dres_ = std::ldexp(1., -16);
+}
+
+void event_codec::quantize(char *records, size_t n) const
+{
+    for (size_t i = 0; i < n; ++i, records += rsize_) {
+        for (const auto &c : columns_) {
+            if (c.quantity == event_buffer::Value)
+                continue;
+            char *p = records + c.offset;
+            double r = c.quantity == event_buffer::Position ? pres_ : dres_;
+            set_real(p, c.type, std::llround(get_real(p, c.type) / r) * r);
+        }
+    }
+}
+
+void event_codec::encode(const char *records, size_t n, std::vector<char> &out) const
+{
+    // previous quantized value of each column &
+    // quantized position of the 1st record of the current history
+    std::vector<int64_t> prev(columns_.size(), 0), origin(columns_.size(), 0);
+    bool new_history = true;
+    for (size_t i = 0; i < n; ++i, records += rsize_) {
+        for (size_t j = 0; j < columns_.size(); ++j) {
+            const auto &c = columns_[j];
+            const char *p = records + c.offset;
+            switch (c.type) {
+            case event_buffer::Uint64: {
+                uint64_t v;
+                std::memcpy(&v, p, sizeof(v));
+                if (j == 0) { // history id
+                    new_history = i == 0 || int64_t(v) != prev[0];
+                    put_varint(zigzag(int64_t(v - prev[0])), out);
+                    prev[0] = v;
+                } else
+                    put_varint(v, out);
+            } break;
+            case event_buffer::Int32: {
+                int32_t v;
+                std::memcpy(&v, p, sizeof(v));
+                put_varint(zigzag(v), out);
+            } break;
+            default:
+                if (c.quantity == event_buffer::Position) {
+                    int64_t q = std::llround(get_real(p, c.type) / pres_);
+                    put_varint(zigzag(q - (new_history ? origin[j] : prev[j])), out);
+                    if (new_history)
+                        origin[j] = q;
+                    prev[j] = q;
+                } else if (c.quantity == event_buffer::Direction) {
+                    put_varint(zigzag(std::llround(get_real(p, c.type) / dres_)), out);
+                } else
+                    out.insert(out.end(), p, p + event_buffer::type_size(c.type));
+            }
+        }
+    }
+}
+
+bool event_codec::check(const char *records, size_t n) const
+{
+    if (!enabled() || n == 0)
+        return true;
+    size_t nb = n * rsize_;
+    std::vector<char> q(records, records + nb), d(nb), enc;
+    quantize(q.data(), n);
+    encode(records, n, enc);
+    if (!decode(enc.data(), enc.size(), n, d.data()))
+        return false;
+    for (size_t i = 0; i < nb; i += rsize_) {
+        for (const auto &c : columns_) {
+            const char *x = records + i + c.offset, *y = q.data() + i + c.offset,
+                       *z = d.data() + i + c.offset;
+            size_t sz = event_buffer::type_size(c.type);
+            if (std::memcmp(y, z, sz) != 0)
+                return false;
+            if (c.quantity == event_buffer::Value) {
+                if (std::memcmp(x, y, sz) != 0)
+                    return false;
+                continue;
+            }
+            double r = c.quantity == event_buffer::Position ? pres_ : dres_;
+            if (!(std::abs(get_real(y, c.type) - get_real(x, c.type)) <= 0.5 * r))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool event_codec::decode(const char *in, size_t nbytes, size_t n, char *records) const
+{
+    const char *end = in + nbytes;
+    std::vector<int64_t> prev(columns_.size(), 0), origin(columns_.size(), 0);
+    bool new_history = true;
+    uint64_t u;
+    for (size_t i = 0; i < n; ++i, records += rsize_) {
+        std::memset(records, 0, rsize_);
+        for (size_t j = 0; j < columns_.size(); ++j) {
+            const auto &c = columns_[j];
+            char *p = records + c.offset;
+            if (c.quantity == event_buffer::Value
+                && (c.type == event_buffer::Float32 || c.type == event_buffer::Float64)) {
+                size_t sz = event_buffer::type_size(c.type);
+                if (in + sz > end)
+                    return false;
+                std::memcpy(p, in, sz);
+                in += sz;
+                continue;
+            }
+            if (!get_varint(in, end, u))
+                return false;
+            switch (c.type) {
+            case event_buffer::Uint64: {
+                uint64_t v = u;
+                if (j == 0) {
+                    new_history = i == 0 || unzigzag(u) != 0;
+                    prev[0] += unzigzag(u);
+                    v = prev[0];
+                }
+                std::memcpy(p, &v, sizeof(v));
+            } break;
+            case event_buffer::Int32: {
+                int32_t v = unzigzag(u);
+                std::memcpy(p, &v, sizeof(v));
+            } break;
+            default:
+                if (c.quantity == event_buffer::Position) {
+                    prev[j] = (new_history ? origin[j] : prev[j]) + unzigzag(u);
+                    if (new_history)
+                        origin[j] = prev[j];
+                    set_real(p, c.type, prev[j] * pres_);
+                } else
+                    set_real(p, c.type, unzigzag(u) * dres_);
+            }
+        }
+    }
+    return in == end;
+}
+
 pka_buffer::pka_buffer() : event_buffer(static_cast<uint32_t>(Event::CascadeComplete)), natoms_(0)
 {
+    setNatoms(0, {});
 }
 
 void pka_buffer::calc_nrt(const ion &i, const material *m)
@@ -33,69 +281,147 @@ void pka_buffer::calc_nrt(const ion &i, const material *m)
     }
 }
 
-void pka_buffer::setNatoms(int n, const std::vector<std::string> &labels)
+void pka_buffer::setNatoms(int n, const std::vector<std::string> &labels, bool clusters)
 {
     natoms_ = n;
-    buff_.resize(ofVac + atom_cols_ * n);
-    columnNames_.resize(buff_.size());
-    columnDescriptions_.resize(buff_.size());
-    int k = ofIonId;
-    columnNames_[k] = "hid";
-    columnDescriptions_[k] = "history id";
-    k = ofAtomId;
-    columnNames_[k] = "pid";
-    columnDescriptions_[k] = "PKA species id";
-    k = ofPos;
-    columnNames_[k] = "x";
-    columnDescriptions_[k] = "PKA x position [nm]";
-    k = ofPos + 1;
-    columnNames_[k] = "y";
-    columnDescriptions_[k] = "PKA y position [nm]";
-    k = ofPos + 2;
-    columnNames_[k] = "z";
-    columnDescriptions_[k] = "PKA z position [nm]";
-    k = ofErg;
-    columnNames_[k] = "E";
-    columnDescriptions_[k] = "PKA energy [eV]";
-    k = ofTdam;
-    columnNames_[k] = "Tdam";
-    columnDescriptions_[k] = "Damage energy[eV]";
-
-    for (int i = 0; i < n; i++) {
-        int k = ofVac + i;
-        columnNames_[k] = "V";
-        columnNames_[k] += std::to_string(i + 1);
-        columnDescriptions_[k] = "Vacancies of ";
-        columnDescriptions_[k] += labels[i];
-        k += n;
-        columnNames_[k] = "I";
-        columnNames_[k] += std::to_string(i + 1);
-        columnDescriptions_[k] = "Interstitials of ";
-        columnDescriptions_[k] += labels[i];
-        k += n;
-        columnNames_[k] = "ICR";
-        columnNames_[k] += std::to_string(i + 1);
-        columnDescriptions_[k] = "Intra-cascade recombinations of ";
-        columnDescriptions_[k] += labels[i];
-        k += n;
-        columnNames_[k] = "Corr. ICR";
-        columnNames_[k] += std::to_string(i + 1);
-        columnDescriptions_[k] = "Corr. Intra-cascade recombinations of ";
-        columnDescriptions_[k] += labels[i];
+    clusters_ = clusters;
+
+    clear_columns();
+    ofHid_ = add_hid_column();
+    ofAtomId_ = add_column("pid", "PKA species id", Int32);
+    ofPos_ = add_column("x", "PKA x position [nm]", Float32, Position);
+    add_column("y", "PKA y position [nm]", Float32, Position);
+    add_column("z", "PKA z position [nm]", Float32, Position);
+    ofErg_ = add_column("E", "PKA energy [eV]", Float32);
+    ofTdam_ = add_column("Tdam", "Damage energy[eV]", Float32);
+
+    // float columns are contiguous
+    ofVac_ = record_size_;
+    const char *cname[] = { "V", "I", "ICR", "Corr. ICR" };
+    const char *cdesc[] = { "Vacancies of ", "Interstitials of ",
+                            "Intra-cascade recombinations of ",
+                            "Corr. Intra-cascade recombinations of " };
+    for (int k = 0; k < atom_cols_; k++)
+        for (int i = 0; i < n; i++)
+            add_column(cname[k] + std::to_string(i + 1), cdesc[k] + labels[i], Float32);
+
+    if (clusters) {
+        const char *dname[] = { "V", "I" };
+        const char *ddesc[] = { "vacancy", "interstitial" };
+        for (int did = 0; did < 2; did++) {
+            add_column(std::string(dname[did]) + "cl",
+                       std::string("# of ") + ddesc[did] + " clusters (size>=2)", Float32);
+            add_column(std::string(dname[did]) + "cl_n",
+                       std::string("# of clustered ") + ddesc[did] + "s", Float32);
+            add_column(std::string(dname[did]) + "cl_max",
+                       std::string("Largest ") + ddesc[did] + " cluster size", Float32);
+        }
     }
 }
 
 void pka_buffer::init(const ion *i)
 {
     reset();
-    buff_[ofIonId] = i->ion_id();
-    buff_[ofAtomId] = i->myAtom()->id();
-    buff_[ofPos] = i->pos0().x();
-    buff_[ofPos + 1] = i->pos0().y();
-    buff_[ofPos + 2] = i->pos0().z();
-    buff_[ofErg] = i->erg0();
+    at_<uint64_t>(ofHid_) = i->ion_id();
+    at_<int32_t>(ofAtomId_) = i->myAtom()->id();
+    at_<float>(ofPos_) = i->pos0().x();
+    at_<float>(ofPos_ + 4) = i->pos0().y();
+    at_<float>(ofPos_ + 8) = i->pos0().z();
+    at_<float>(ofErg_) = i->erg0();
+    setWeight(i->weight());
 }
 
+/*
+ * The writer thread shared by all open streams
+ *
+ * Streams submit each full block by queuing a pointer to themselves.
+ * The thread serves the queue in order, writing one block per entry.
+ */
+class event_stream::writer_t
+{
+public:
+    static writer_t &instance()
+    {
+        static writer_t w;
+        return w;
+    }
+
+    ~writer_t()
+    {
+        if (thread_.joinable())
+            stop_thread_();
+    }
+
+    // a stream opens, start the thread if it is the 1st one
+    void attach()
+    {
+        std::lock_guard<std::mutex> life(life_mtx_);
+        if (users_++ == 0) {
+            stop_ = false;
+            thread_ = std::thread(&writer_t::loop_, this);
+        }
+    }
+
+    // a stream closes, drop its queued blocks & wait if it is being served
+    // stop the thread if it was the last stream
+    void detach(event_stream *s)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            q_.erase(std::remove(q_.begin(), q_.end(), s), q_.end());
+            cv_idle_.wait(lock, [this, s] { return busy_ != s; });
+        }
+        std::lock_guard<std::mutex> life(life_mtx_);
+        if (--users_ == 0)
+            stop_thread_();
+    }
+
+    // a block of s is pending
+    void submit(event_stream *s)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        q_.push_back(s);
+        cv_work_.notify_one();
+    }
+
+private:
+    void stop_thread_()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stop_ = true;
+        }
+        cv_work_.notify_one();
+        thread_.join();
+    }
+
+    void loop_()
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        for (;;) {
+            cv_work_.wait(lock, [this] { return stop_ || !q_.empty(); });
+            if (stop_)
+                break;
+            event_stream *s = q_.front();
+            q_.pop_front();
+            busy_ = s;
+            lock.unlock();
+            s->write_pending_();
+            lock.lock();
+            busy_ = nullptr;
+            cv_idle_.notify_all();
+        }
+    }
+
+    std::deque<event_stream *> q_; // one entry per pending block
+    event_stream *busy_{ nullptr }; // stream being served
+    size_t users_{ 0 }; // # of attached streams
+    bool stop_{ false };
+    std::thread thread_;
+    std::mutex mtx_, life_mtx_;
+    std::condition_variable cv_work_, cv_idle_;
+};
+
 int event_stream::open()
 {
     close_();
@@ -115,31 +441,225 @@ int event_stream::open()
         return -1;
     }
 
+    init_blocks_();
+
+    // register with the writer
+    writing_ = false;
+    io_error_ = false;
+    writer_t::instance().attach();
+    attached_ = true;
+
     return 0;
 }
 
+int event_stream::open(event_sink *sink, int ch)
+{
+    close_();
+    if (!sink)
+        return -1;
+    sink_ = sink;
+    sink_ch_ = ch;
+    io_error_ = false;
+    init_blocks_();
+    return 0;
+}
+
+int event_stream::open_snapshot(event_stream &src)
+{
+    close_();
+    if (!src.fs_ || &src == this)
+        return -1;
+    // all events of src must be in its disk buffer
+    if (src.flush() != 0 || std::fflush(src.fs_) != 0)
+        return -1;
+
+    fs_ = std::fopen(src.fname_.c_str(), "rb");
+    if (fs_ == NULL)
+        return -1;
+    fname_ = src.fname_;
+    snapshot_ = true;
+
+    rsize_ = src.rsize_;
+    event_proto_ = event_buffer(src.event_proto_);
+    codec_ = src.codec_;
+    rows_ = src.rows_;
+    max_rows_ = src.max_rows_;
+    seen_ = src.seen_;
+    reservoir_ = src.reservoir_;
+    res_pos_ = 0;
+    rd_pos_ = rd_rows_ = rd_total_ = 0;
+
+    // no writer thread. The write block is needed by flush()
+    init_blocks_();
+    io_error_ = false;
+    return 0;
+}
+
+void event_stream::init_blocks_()
+{
+    // prepare the 1st write block
+    // more are allocated on demand up to max_blocks
+    block_rows_ = std::max(size_t(1), block_bytes / std::max(rsize_, size_t(1)));
+    blocks_.reserve(max_blocks); // block pointers must remain valid
+    blocks_.emplace_back();
+    blocks_.back().data.resize(block_rows_ * rsize_);
+    current_ = &blocks_.back();
+}
+
 void event_stream::close_()
 {
+    if (sink_) {
+        // hand over any remaining events
+        flush();
+        sink_ = nullptr;
+        blocks_.clear();
+        current_ = nullptr;
+    }
+    stop_writer_();
     if (fs_) {
         std::fclose(fs_);
         fs_ = NULL;
-        std::remove(fname_.c_str());
+        // the disk buffer of a snapshot belongs to the source stream
+        if (!snapshot_)
+            std::remove(fname_.c_str());
         fname_.clear();
     }
+    if (snapshot_) {
+        snapshot_ = false;
+        blocks_.clear();
+        current_ = nullptr;
+    }
 }
+
 void event_stream::write(const event_buffer *ev)
 {
     if (is_open()) {
-        std::fwrite(ev->data(), sizeof ev->data()[0], ev->size(), fs_);
+        assert(ev->size() == rsize_);
+        if (max_rows_) {
+            reservoir_add_(ev->data());
+            return;
+        }
+        std::memcpy(current_->data.data() + current_->rows * rsize_, ev->data(), rsize_);
+        if (++current_->rows == block_rows_)
+            submit_();
         rows_++;
     }
 }
 
+void event_stream::submit_()
+{
+    if (sink_) {
+        // the sink copies the data, the block can be reused
+        if (codec_.enabled())
+            codec_.quantize(current_->data.data(), current_->rows);
+        if (sink_->append(sink_ch_, current_->data.data(), current_->rows) != 0)
+            io_error_ = true;
+        current_->rows = 0;
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    pending_.push_back(current_);
+    writer_t::instance().submit(this);
+
+    // get an empty block, allocating a new one if the limit is not reached
+    if (free_.empty() && blocks_.size() < max_blocks) {
+        blocks_.emplace_back();
+        blocks_.back().data.resize(block_rows_ * rsize_);
+        current_ = &blocks_.back();
+        return;
+    }
+
+    // all blocks are in use: wait for the writer
+    cv_free_.wait(lock, [this] { return !free_.empty(); });
+    current_ = free_.back();
+    free_.pop_back();
+}
+
+int event_stream::flush()
+{
+    if (!is_open())
+        return 0;
+
+    if (sink_) {
+        if (current_->rows)
+            submit_();
+        return io_error_ ? -1 : 0;
+    }
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    if (current_->rows) {
+        pending_.push_back(current_);
+        current_ = nullptr;
+        writer_t::instance().submit(this);
+    }
+    cv_free_.wait(lock, [this] { return pending_.empty() && !writing_; });
+    if (!current_) {
+        current_ = free_.back();
+        free_.pop_back();
+    }
+    return io_error_ ? -1 : 0;
+}
+
+void event_stream::stop_writer_()
+{
+    if (!attached_)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        pending_.clear();
+    }
+    writer_t::instance().detach(this);
+    attached_ = false;
+
+    blocks_.clear();
+    free_.clear();
+    current_ = nullptr;
+}
+
+void event_stream::write_pending_()
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    if (pending_.empty())
+        return;
+
+    block_t *b = pending_.front();
+    pending_.pop_front();
+    writing_ = true;
+
+    // write to disk without holding the lock
+    lock.unlock();
+    bool ok;
+    if (codec_.enabled()) {
+        assert(codec_.check(b->data.data(), b->rows));
+        // block header: # of rows, # of bytes
+        enc_.clear();
+        codec_.encode(b->data.data(), b->rows, enc_);
+        uint64_t hdr[2] = { b->rows, enc_.size() };
+        ok = std::fwrite(hdr, sizeof(hdr), 1, fs_) == 1
+                && std::fwrite(enc_.data(), 1, enc_.size(), fs_) == enc_.size();
+    } else
+        ok = std::fwrite(b->data.data(), rsize_, b->rows, fs_) == b->rows;
+    lock.lock();
+
+    if (!ok)
+        io_error_ = true;
+    b->rows = 0;
+    free_.push_back(b);
+    writing_ = false;
+    cv_free_.notify_all();
+}
+
 int event_stream::merge(event_stream &ev)
 {
-    if ((ev.cols() != cols()) || !is_open() || !ev.is_open())
+    if ((ev.record_size() != record_size()) || !is_open() || !ev.fs_)
         return -1;
 
+    if (max_rows_) {
+        reservoir_merge_({ &ev });
+        return 0;
+    }
+
     if (ev.rows() == 0)
         return 0;
 
@@ -147,7 +667,7 @@ int event_stream::merge(event_stream &ev)
 
     // local mem buffer ~1MB
     size_t n = (1 << 10);
-    std::vector<float> buff(n * cols());
+    std::vector<char> buff(n * rsize_);
 
     // copy data in chunks
     size_t nrows = ev.rows(); // total rows to copy
@@ -170,39 +690,88 @@ int event_stream::merge(std::vector<event_stream *> &v)
     if (!is_open())
         return -1;
     for (auto *p : v)
-        if (!p->is_open() || p->cols() != cols_)
+        if (!p->fs_ || p->record_size() != rsize_)
             return -1;
 
-    for (auto *p : v)
-        p->rewind();
-
-    std::vector<float> buff(cols_);
-
-    for (;;) {
-        // find the stream with the smallest peekid (loop A)
-        uint32_t min_id;
-        int min_idx = -1;
-        for (int i = 0; i < (int)v.size(); i++) {
-            uint32_t id;
-            if (v[i]->peekid(id) && (min_idx == -1 || id < min_id)) {
-                min_id = id;
-                min_idx = i;
+    if (max_rows_) {
+        reservoir_merge_(v);
+        return 0;
+    }
+
+    /*
+     * k-way merge of the input streams on the history id (1st column)
+     *
+     * Each input stream is read sequentially through a large buffer.
+     * A min-heap holds the next history id of each stream.
+     * Consecutive rows with the same id are copied as one run.
+     */
+
+    // read buffer of each input stream
+    struct reader_t
+    {
+        event_stream *es;
+        std::vector<char> buff;
+        size_t pos{ 0 }, n{ 0 }; // current row & # of rows in buff
+
+        bool fill()
+        {
+            if (pos == n) {
+                n = es->read(buff.data(), buff.size() / es->record_size());
+                pos = 0;
             }
+            return pos < n;
+        }
+        uint64_t id() const
+        {
+            return event_buffer::history_id(buff.data() + pos * es->record_size());
         }
+    };
 
-        if (min_idx == -1)
-            break;
+    // ~1MB buffer per stream
+    size_t buff_rows = std::max(size_t(1), size_t(1 << 20) / std::max(rsize_, size_t(1)));
 
-        // copy all consecutive events with min_id from that stream (loop B)
-        event_stream *src = v[min_idx];
-        uint32_t cur_id;
-        while (src->read(buff.data(), 1) == cols_) {
-            std::memcpy(&cur_id, buff.data(), sizeof(uint32_t));
-            if (cur_id != min_id) {
-                std::fseek(src->fs_, -(long)(cols_ * sizeof(float)), SEEK_CUR);
-                break;
+    std::vector<reader_t> rd(v.size());
+    for (size_t i = 0; i < v.size(); ++i) {
+        rd[i].es = v[i];
+        rd[i].buff.resize(buff_rows * rsize_);
+        v[i]->rewind();
+    }
+
+    // min-heap of (next id, stream index)
+    typedef std::pair<uint64_t, size_t> key_t;
+    std::vector<key_t> heap;
+    heap.reserve(rd.size());
+    for (size_t i = 0; i < rd.size(); ++i)
+        if (rd[i].fill())
+            heap.emplace_back(rd[i].id(), i);
+    auto cmp = std::greater<key_t>();
+    std::make_heap(heap.begin(), heap.end(), cmp);
+
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), cmp);
+        key_t k = heap.back();
+        heap.pop_back();
+        reader_t &r = rd[k.second];
+
+        // copy the run of rows with id = k.first
+        // continue with the next ids of this stream while it stays the minimum
+        for (;;) {
+            size_t start = r.pos;
+            while (r.pos < r.n && r.id() == k.first)
+                r.pos++;
+            write(r.buff.data() + start * rsize_, r.pos - start);
+            if (!r.fill())
+                break; // stream exhausted
+            if (r.id() != k.first) {
+                k.first = r.id();
+                if (!heap.empty() && cmp(k, heap.front()))
+                    break; // another stream has a smaller id
             }
-            write(buff.data(), 1);
+        }
+
+        if (r.pos < r.n) {
+            heap.push_back(k);
+            std::push_heap(heap.begin(), heap.end(), cmp);
         }
     }
 
@@ -212,89 +781,405 @@ int event_stream::merge(std::vector<event_stream *> &v)
 bool event_stream::set_event_prototype(const event_buffer &ev)
 {
     close_();
-    cols_ = ev.size();
+    rsize_ = ev.size();
     event_proto_ = event_buffer(ev);
+    codec_ = event_codec();
+    max_rows_ = seen_ = res_pos_ = 0;
+    reservoir_.clear();
     return true;
 }
 
 void event_stream::rewind()
 {
-    if (is_open())
-        std::rewind(fs_);
+    if (is_open()) {
+        flush();
+        if (fs_)
+            std::rewind(fs_);
+        rd_pos_ = rd_rows_ = rd_total_ = 0;
+        res_pos_ = 0;
+    }
 }
 
 void event_stream::clear()
 {
     if (is_open()) {
-        std::rewind(fs_);
+        flush();
+        if (fs_)
+            std::rewind(fs_);
         rows_ = 0;
+        rd_pos_ = rd_rows_ = rd_total_ = 0;
+        seen_ = res_pos_ = 0;
+        reservoir_.clear();
     }
 }
 
-size_t event_stream::read(float *buff, size_t nevents)
+void event_stream::set_max_rows(size_t n, uint64_t seed)
 {
-    return is_open() ? std::fread(buff, sizeof(float), nevents * cols_, fs_) : 0;
+    max_rows_ = n;
+    seen_ = res_pos_ = 0;
+    reservoir_.clear();
+    res_rng_.seed(seed);
 }
 
-bool event_stream::peekid(uint32_t &id)
+event_stream::reservoir_t event_stream::reservoir() const
 {
-    if (!is_open())
+    reservoir_t r;
+    r.rows = reservoir_;
+    r.seen = seen_;
+    std::ostringstream os;
+    os << res_rng_;
+    r.rng = os.str();
+    return r;
+}
+
+bool event_stream::set_reservoir(const reservoir_t &r)
+{
+    if (!max_rows_ || !rsize_ || r.rows.size() % rsize_ || r.rows.size() / rsize_ > max_rows_)
         return false;
-    if (std::fread(&id, sizeof(uint32_t), 1, fs_) != 1)
+    std::istringstream is(r.rng);
+    std::mt19937_64 g;
+    if (!(is >> g))
         return false;
-    std::fseek(fs_, -(long)sizeof(uint32_t), SEEK_CUR);
+    res_rng_ = g;
+    reservoir_ = r.rows;
+    rows_ = reservoir_.size() / rsize_;
+    seen_ = r.seen;
+    res_pos_ = 0;
     return true;
 }
 
-size_t event_stream::write(const float *buff, size_t nevents)
+void event_stream::reservoir_add_(const char *rec)
 {
-    if (is_open()) {
-        rows_ += nevents;
-        return std::fwrite(buff, sizeof(float), nevents * cols_, fs_);
+    // Algorithm R
+    size_t k = reservoir_.size() / rsize_;
+    if (k < max_rows_) {
+        reservoir_.insert(reservoir_.end(), rec, rec + rsize_);
+        k = rows_++;
+    } else {
+        k = std::uniform_int_distribution<size_t>(0, seen_)(res_rng_);
+        if (k < max_rows_)
+            std::memcpy(reservoir_.data() + k * rsize_, rec, rsize_);
+    }
+    if (k < max_rows_ && codec_.enabled())
+        codec_.quantize(reservoir_.data() + k * rsize_, 1);
+    seen_++;
+}
+
+void event_stream::reservoir_merge_(const std::vector<event_stream *> &v)
+{
+    /*
+     * Each reservoir is a uniform sample of its stream.
+     * A uniform sample of the union is drawn without replacement:
+     * pick stream i with probability (remaining events of i) / (total remaining events)
+     * and then a random, not yet picked row of its reservoir.
+     */
+    struct pool_t
+    {
+        std::vector<char> rows;
+        size_t n; // remaining rows in the reservoir
+        size_t seen; // remaining events of the stream
+    };
+    std::vector<pool_t> pool;
+    pool.push_back({ std::move(reservoir_), rows_, seen_ });
+    size_t total = seen_;
+    for (event_stream *es : v) {
+        if (es->max_rows_) {
+            pool.push_back({ es->reservoir_, es->rows_, es->seen_ });
+            total += es->seen_;
+        } else {
+            // a full stream: feed all rows through the reservoir
+            event_stream tmp;
+            tmp.set_event_prototype(event_proto_);
+            tmp.set_max_rows(max_rows_, res_rng_());
+            std::vector<char> rec(rsize_);
+            es->rewind();
+            while (es->read(rec.data(), 1) == 1)
+                tmp.reservoir_add_(rec.data());
+            pool.push_back({ std::move(tmp.reservoir_), tmp.rows_, tmp.seen_ });
+            total += tmp.seen_;
+        }
     }
+
+    size_t n = std::min(max_rows_, total);
+    reservoir_.clear();
+    reservoir_.reserve(n * rsize_);
+    seen_ = total;
+    for (size_t k = 0; k < n; ++k) {
+        size_t r = std::uniform_int_distribution<size_t>(0, total - 1)(res_rng_);
+        size_t i = 0;
+        while (r >= pool[i].seen)
+            r -= pool[i++].seen;
+        pool_t &p = pool[i];
+        // random row of the reservoir, swapped to the end
+        size_t j = std::uniform_int_distribution<size_t>(0, p.n - 1)(res_rng_);
+        char *a = p.rows.data() + j * rsize_;
+        char *b = p.rows.data() + (p.n - 1) * rsize_;
+        reservoir_.insert(reservoir_.end(), a, a + rsize_);
+        std::swap_ranges(a, a + rsize_, b);
+        p.n--;
+        p.seen--;
+        total--;
+    }
+    rows_ = n;
+    res_pos_ = 0;
+
+    // sort by history id
+    std::vector<size_t> idx(n);
+    for (size_t k = 0; k < n; ++k)
+        idx[k] = k;
+    std::stable_sort(idx.begin(), idx.end(), [this](size_t a, size_t b) {
+        return event_buffer::history_id(reservoir_.data() + a * rsize_)
+                < event_buffer::history_id(reservoir_.data() + b * rsize_);
+    });
+    std::vector<char> sorted(n * rsize_);
+    for (size_t k = 0; k < n; ++k)
+        std::memcpy(sorted.data() + k * rsize_, reservoir_.data() + idx[k] * rsize_, rsize_);
+    reservoir_.swap(sorted);
+}
+
+bool event_stream::read_block_()
+{
+    // stale blocks may follow after clear()
+    if (rd_total_ >= rows_)
+        return false;
+    uint64_t hdr[2];
+    if (std::fread(hdr, sizeof(hdr), 1, fs_) != 1)
+        return false;
+    rd_enc_.resize(hdr[1]);
+    rd_buff_.resize(hdr[0] * rsize_);
+    if (std::fread(rd_enc_.data(), 1, hdr[1], fs_) != hdr[1]
+        || !codec_.decode(rd_enc_.data(), hdr[1], hdr[0], rd_buff_.data()))
+        return false;
+    rd_pos_ = 0;
+    rd_rows_ = hdr[0];
+    rd_total_ += rd_rows_;
+    return true;
+}
+
+size_t event_stream::read(char *buff, size_t nevents)
+{
+    if (!fs_)
+        return 0;
+    if (max_rows_) {
+        size_t m = std::min(nevents, rows_ - res_pos_);
+        std::memcpy(buff, reservoir_.data() + res_pos_ * rsize_, m * rsize_);
+        res_pos_ += m;
+        return m;
+    }
+    if (!codec_.enabled()) {
+        // the disk buffer may contain stale rows after clear() or,
+        // for a snapshot, rows written after the snapshot was taken
+        size_t m = std::fread(buff, rsize_, std::min(nevents, rows_ - rd_total_), fs_);
+        rd_total_ += m;
+        return m;
+    }
+
+    size_t n = 0;
+    while (n < nevents) {
+        if (rd_pos_ == rd_rows_ && !read_block_())
+            break;
+        size_t m = std::min(nevents - n, rd_rows_ - rd_pos_);
+        std::memcpy(buff + n * rsize_, rd_buff_.data() + rd_pos_ * rsize_, m * rsize_);
+        rd_pos_ += m;
+        n += m;
+    }
+    return n;
+}
+
+bool event_stream::peekid(uint64_t &id)
+{
+    if (!fs_)
+        return false;
+    if (max_rows_) {
+        if (res_pos_ == rows_)
+            return false;
+        id = event_buffer::history_id(reservoir_.data() + res_pos_ * rsize_);
+        return true;
+    }
+    if (codec_.enabled()) {
+        if (rd_pos_ == rd_rows_ && !read_block_())
+            return false;
+        id = event_buffer::history_id(rd_buff_.data() + rd_pos_ * rsize_);
+        return true;
+    }
+    if (rd_total_ >= rows_ || std::fread(&id, sizeof(uint64_t), 1, fs_) != 1)
+        return false;
+    std::fseek(fs_, -(long)sizeof(uint64_t), SEEK_CUR);
+    return true;
+}
+
+size_t event_stream::write(const char *buff, size_t nevents)
+{
+    if (!is_open() || snapshot_)
+        return 0;
+
+    if (max_rows_) {
+        for (size_t i = 0; i < nevents; ++i)
+            reservoir_add_(buff + i * rsize_);
+        return nevents;
+    }
+
+    // copy to write blocks, submitting each one as it fills up
+    size_t n = nevents;
+    while (n) {
+        size_t m = std::min(n, block_rows_ - current_->rows);
+        std::memcpy(current_->data.data() + current_->rows * rsize_, buff, m * rsize_);
+        current_->rows += m;
+        buff += m * rsize_;
+        n -= m;
+        if (current_->rows == block_rows_)
+            submit_();
+    }
+    rows_ += nevents;
+    return nevents;
+}
+
+int event_view::map(event_stream &es)
+{
+    unmap();
+    if (!es.fs_ || es.codec_.enabled())
+        return -1;
+    layout_ = es.event_proto_.layout();
+    rsize_ = es.rsize_;
+    if (es.max_rows_) {
+        // sampled stream: view the reservoir
+        data_ = es.reservoir_.data();
+        rows_ = es.rows_;
+        return 0;
+    }
+    // stdio buffers must reach the file before it is mapped
+    if (es.flush() != 0 || std::fflush(es.fs_) != 0)
+        return -1;
+    return map(es.fname_, 0, es.rows_, layout_, rsize_);
+}
+
+int event_view::map(const std::string &fname, size_t offset, size_t nrows,
+                    const std::vector<event_buffer::column_t> &layout, size_t rsize)
+{
+    unmap();
+    layout_ = layout;
+    rsize_ = rsize;
+    if (nrows == 0) {
+        // nothing to map
+        static const char empty = 0;
+        data_ = &empty;
+        rows_ = 0;
+        return 0;
+    }
+
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < offset + nrows * rsize) {
+        ::close(fd);
+        return -1;
+    }
+    // the mapping must start at a page boundary
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = offset / page * page;
+    map_len_ = offset - start + nrows * rsize;
+    void *p = mmap(nullptr, map_len_, PROT_READ, MAP_SHARED, fd, start);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        map_len_ = 0;
+        return -1;
+    }
+    map_ = p;
+    data_ = static_cast<const char *>(p) + (offset - start);
+    rows_ = nrows;
     return 0;
 }
 
-exit_buffer::exit_buffer()
-    : event_buffer(static_cast<uint32_t>(Event::IonExit), ofEnd,
-                   { "hid", "iid", "cid", "E", "x", "y", "z", "nx", "ny", "nz" },
-                   { "history id", "ion species id", "ion's cell id before exiting",
-                     "ion energy [eV]", "x position [nm]", "y position [nm]", "z position [nm]",
-                     "x direction cosine", "y direction cosine", "z direction cosine" })
+void event_view::unmap()
+{
+    if (map_)
+        munmap(map_, map_len_);
+    map_ = nullptr;
+    map_len_ = 0;
+    data_ = nullptr;
+    rows_ = 0;
+}
+
+exit_buffer::exit_buffer() : event_buffer(static_cast<uint32_t>(Event::IonExit))
 {
+    ofHid_ = add_hid_column();
+    ofAtomId_ = add_column("iid", "ion species id", Int32);
+    ofCellId_ = add_column("cid", "ion's cell id before exiting", Int32);
+    ofErg_ = add_column("E", "ion energy [eV]", Float32);
+    ofPos_ = add_column("x", "x position [nm]", Float32, Position);
+    add_column("y", "y position [nm]", Float32, Position);
+    add_column("z", "z position [nm]", Float32, Position);
+    ofDir_ = add_column("nx", "x direction cosine", Float32, Direction);
+    add_column("ny", "y direction cosine", Float32, Direction);
+    add_column("nz", "z direction cosine", Float32, Direction);
 }
 
-void exit_buffer::set(const ion *i) //, int cellid)
+void exit_buffer::set(const ion *i)
 {
-    buff_[ofIonId] = i->ion_id();
-    buff_[ofAtomId] = i->myAtom()->id();
-    buff_[ofCellId] = i->prev_cellid();
-    buff_[ofErg] = i->erg();
-    buff_[ofPos] = i->pos().x();
-    buff_[ofPos + 1] = i->pos().y();
-    buff_[ofPos + 2] = i->pos().z();
-    buff_[ofDir] = i->dir().x();
-    buff_[ofDir + 1] = i->dir().y();
-    buff_[ofDir + 2] = i->dir().z();
+    at_<uint64_t>(ofHid_) = i->ion_id();
+    at_<int32_t>(ofAtomId_) = i->myAtom()->id();
+    at_<int32_t>(ofCellId_) = i->prev_cellid();
+    at_<float>(ofErg_) = i->erg();
+    for (int k = 0; k < 3; k++) {
+        at_<float>(ofPos_ + 4 * k) = i->pos()(k);
+        at_<float>(ofDir_ + 4 * k) = i->dir()(k);
+    }
+    setWeight(i->weight());
 }
 
-// { ofHid = 0, ofRid = 1, ofIid = 2, ofCid = 3, ofDid = 4, ofPos = 5, ofEnd = 8 }
 damage_event_buffer::damage_event_buffer()
-    : event_buffer(static_cast<uint32_t>(Event::IonStop) | static_cast<uint32_t>(Event::Vacancy),
-                   ofEnd, { "hid", "rid", "iid", "did", "x", "y", "z" },
-                   { "history id", "recoil id", "ion species id",
-                     "defect type id 0: vacancy, 1: interstitial", "x position [nm]",
-                     "y position [nm]", "z position [nm]" })
+    : event_buffer(static_cast<uint32_t>(Event::IonStop) | static_cast<uint32_t>(Event::Vacancy))
+{
+    ofHid_ = add_hid_column();
+    ofRid_ = add_column("rid", "recoil id", Int32);
+    ofIid_ = add_column("iid", "ion species id", Int32);
+    ofDid_ = add_column("did", "defect type id 0: vacancy, 1: interstitial", Int32);
+    ofPos_ = add_column("x", "x position [nm]", Float32, Position);
+    add_column("y", "y position [nm]", Float32, Position);
+    add_column("z", "z position [nm]", Float32, Position);
+}
+
+void damage_event_buffer::set_(size_t hid, int rid, int iid, int did, const vector3 &x)
 {
+    at_<uint64_t>(ofHid_) = hid;
+    at_<int32_t>(ofRid_) = rid;
+    at_<int32_t>(ofIid_) = iid;
+    at_<int32_t>(ofDid_) = did;
+    for (int k = 0; k < 3; k++)
+        at_<float>(ofPos_ + 4 * k) = x(k);
 }
 
 void damage_event_buffer::set(const ion &i)
 {
-    buff_[ofHid] = i.ion_id();
-    buff_[ofRid] = i.recoil_id();
-    buff_[ofIid] = i.myAtom()->id();
-    buff_[ofDid] = i.type();
-    buff_[ofPos] = i.pos().x();
-    buff_[ofPos + 1] = i.pos().y();
-    buff_[ofPos + 2] = i.pos().z();
+    set_(i.ion_id(), i.recoil_id(), i.myAtom()->id(), i.type(), i.pos());
+    setWeight(i.weight());
+}
+
+void damage_event_buffer::set(const defect &d, const defect_info &c)
+{
+    set_(c.ion_id, c.recoil_id, d.myAtom()->id(), d.type, d.pos);
+    setWeight(c.weight);
+}
+
+cluster_event_buffer::cluster_event_buffer()
+    : event_buffer(static_cast<uint32_t>(Event::CascadeComplete))
+{
+    ofHid_ = add_hid_column();
+    ofDid_ = add_column("did", "defect type id 0: vacancy, 1: interstitial", Int32);
+    ofN_ = add_column("n", "# of defects in the cluster", Int32);
+    ofErg_ = add_column("E", "PKA recoil energy [eV]", Float32);
+    ofPos_ = add_column("x", "centroid x position [nm]", Float32, Position);
+    add_column("y", "centroid y position [nm]", Float32, Position);
+    add_column("z", "centroid z position [nm]", Float32, Position);
+}
+
+void cluster_event_buffer::set(uint64_t hid, int did, size_t n, float pkaE, const vector3 &x)
+{
+    at_<uint64_t>(ofHid_) = hid;
+    at_<int32_t>(ofDid_) = did;
+    at_<int32_t>(ofN_) = n;
+    at_<float>(ofErg_) = pkaE;
+    for (int k = 0; k < 3; k++)
+        at_<float>(ofPos_ + 4 * k) = x(k);
 }
@@ -1,10 +1,19 @@
 #include "mccore.h"
 #include "mcdriver.h"
 #include "mcinfo.h"
+#include "event_reader.h"
 
 #include <iostream>
+#include <filesystem>
+#include <deque>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
 #include <highfive/H5Easy.hpp>
 #include <highfive/highfive.hpp>
+#include <H5Opublic.h>
+#include <zlib.h>
 
 #include "json_defs_p.h"
 
@@ -16,11 +25,20 @@ namespace h5 = HighFive;
 #define FILE_VERSION_MAJOR_FIELD_NAME "FileVersionMajor"
 #define FILE_VERSION_MINOR_FIELD_NAME "FileVersionMinor"
 #define FILE_VERSION_MAJOR_FIELD_VALUE 1
-#define FILE_VERSION_MINOR_FIELD_VALUE 0
+#define FILE_VERSION_MINOR_FIELD_VALUE 1
 
 using std::cerr;
 using std::endl;
 
+// The HDF5 library may not be thread-safe. Threads that access HDF5 files
+// concurrently (event sink, checkpoint writer, phase-space readers) serialize
+// their calls with this mutex
+std::mutex &h5_mutex()
+{
+    static std::mutex m;
+    return m;
+}
+
 int writeFileHeader(h5::File &file, std::ostream *os)
 {
     try {
@@ -117,10 +135,346 @@ int load_array(h5::File &file, const std::string &path, ArrayND<T> &A, ArrayND<T
     return 0;
 }
 
-int dump_event_stream(h5::File &h5f, const std::string &grp_name, event_stream &es)
+// HDF5 type of an event column
+h5::DataType event_column_type(event_buffer::column_type_t t)
+{
+    switch (t) {
+    case event_buffer::Uint64:
+        return h5::AtomicType<uint64_t>();
+    case event_buffer::Int32:
+        return h5::AtomicType<int32_t>();
+    case event_buffer::Float64:
+        return h5::AtomicType<double>();
+    default:
+        return h5::AtomicType<float>();
+    }
+}
+
+// HDF5 compound type with the same layout as the event record
+h5::CompoundType event_data_type(const event_buffer &proto)
+{
+    std::vector<h5::CompoundType::member_def> members;
+    for (const auto &c : proto.layout())
+        members.emplace_back(c.name, event_column_type(c.type), c.offset);
+    return h5::CompoundType(members, proto.size());
+}
+
+// store the quantization of event data as attributes of the dataset
+void write_resolution_attr(h5::DataSet &ds, const event_codec &codec)
+{
+    ds.createAttribute("position_resolution", codec.position_resolution());
+    ds.createAttribute("direction_resolution", codec.direction_resolution());
+}
+
+// storage settings of event datasets, from the output options
+struct event_storage
 {
-    // get row, column numbers
-    size_t nrows(es.rows()), ncols(es.cols());
+    int level;          // deflate level, 0 = no compression
+    bool shuffle;       // byte shuffle before deflate
+    size_t chunk_bytes; // approx. chunk size
+    int nthreads;       // compression threads
+
+    explicit event_storage(const mcconfig::output_options &opt)
+        : level(opt.event_deflate_level),
+          shuffle(opt.event_shuffle),
+          chunk_bytes(size_t(opt.event_chunk_kb) << 10),
+          nthreads(opt.compression_threads)
+    {
+        if (nthreads == 0)
+            nthreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    size_t chunk_rows(size_t rsize) const
+    {
+        return std::max(size_t(1), size_t(std::ceil(1. * chunk_bytes / rsize)));
+    }
+
+    // add shuffle/deflate/chunking to the dataset creation properties
+    void set_props(h5::DataSetCreateProps &dscp, size_t chunk_rows, bool quantized) const
+    {
+        if (level > 0 && (shuffle || quantized))
+            dscp.add(h5::Shuffle());
+        if (level > 0)
+            dscp.add(h5::Deflate(level));
+        dscp.add(h5::Chunking({ chunk_rows }));
+    }
+};
+
+/*
+ * A pool of compression threads
+ *
+ * The worker threads are started once, e.g. for a whole save(), and sleep between jobs.
+ * run(n, f) calls f(k) for k = 0..n-1, distributed over the workers and the calling thread,
+ * and returns when all calls are done.
+ */
+class compress_pool
+{
+    std::vector<std::thread> threads_;
+    std::mutex mtx_;
+    std::condition_variable start_cv_, done_cv_;
+    std::function<void(size_t)> job_;
+    size_t njobs_{ 0 };
+    std::atomic<size_t> next_job_{ 0 };
+    int busy_{ 0 }; // # of workers still running the current job
+    uint64_t gen_{ 0 }; // job counter, wakes up the workers
+    bool quit_{ false };
+
+    void work_()
+    {
+        size_t k;
+        while ((k = next_job_++) < njobs_)
+            job_(k);
+    }
+
+    void loop_()
+    {
+        uint64_t gen = 0;
+        std::unique_lock<std::mutex> lock(mtx_);
+        for (;;) {
+            start_cv_.wait(lock, [&] { return quit_ || gen_ != gen; });
+            if (quit_)
+                return;
+            gen = gen_;
+            lock.unlock();
+            work_();
+            lock.lock();
+            if (--busy_ == 0)
+                done_cv_.notify_one();
+        }
+    }
+
+public:
+    explicit compress_pool(int nthreads)
+    {
+        for (int i = 1; i < nthreads; ++i)
+            threads_.emplace_back([this] { loop_(); });
+    }
+    ~compress_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            quit_ = true;
+        }
+        start_cv_.notify_all();
+        for (auto &t : threads_)
+            t.join();
+    }
+    compress_pool(const compress_pool &) = delete;
+    compress_pool &operator=(const compress_pool &) = delete;
+
+    // # of threads, including the calling thread
+    int size() const { return threads_.size() + 1; }
+
+    void run(size_t n, const std::function<void(size_t)> &f)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            job_ = f;
+            njobs_ = n;
+            next_job_ = 0;
+            busy_ = threads_.size();
+            gen_++;
+        }
+        start_cv_.notify_all();
+        work_();
+        std::unique_lock<std::mutex> lock(mtx_);
+        done_cv_.wait(lock, [&] { return busy_ == 0; });
+    }
+};
+
+/*
+ * Parallel compression of event dataset chunks
+ *
+ * A batch of chunks is shuffled & deflated by a compress_pool, producing
+ * exactly the output of the HDF5 shuffle & deflate filters. The chunks are then
+ * written in order with H5Dwrite_chunk, bypassing the serial HDF5 filter pipeline.
+ */
+struct chunk_compressor
+{
+    struct chunk_t
+    {
+        std::vector<char> raw, tmp, out;
+        size_t row0{ 0 };
+        bool ok{ true };
+    };
+
+    size_t chunk_rows, rsize;
+    int level;
+    bool shuffle;
+    compress_pool &pool;
+    std::vector<chunk_t> batch;
+    size_t nbatch{ 0 }; // # of chunks in the current batch
+
+    chunk_compressor(size_t crows, size_t rs, int lvl, bool sh, compress_pool &p)
+        : chunk_rows(crows), rsize(rs), level(lvl), shuffle(sh), pool(p), batch(2 * p.size())
+    {
+        for (chunk_t &c : batch)
+            c.raw.resize(chunk_rows * rsize);
+    }
+
+    bool full() const { return nbatch == batch.size(); }
+
+    // next chunk buffer to fill with rows starting at row0
+    chunk_t &next(size_t row0)
+    {
+        chunk_t &c = batch[nbatch++];
+        c.row0 = row0;
+        return c;
+    }
+
+    // shuffle & deflate one chunk
+    void compress(chunk_t &c) const
+    {
+        const char *p = c.raw.data();
+        size_t nbytes = c.raw.size();
+        if (shuffle && rsize > 1) {
+            // byte j of record i goes to position j*n + i
+            c.tmp.resize(nbytes);
+            for (size_t j = 0; j < rsize; ++j) {
+                char *q = c.tmp.data() + j * chunk_rows;
+                for (size_t i = 0; i < chunk_rows; ++i)
+                    q[i] = p[i * rsize + j];
+            }
+            p = c.tmp.data();
+        }
+        uLongf len = compressBound(nbytes);
+        c.out.resize(len);
+        c.ok = compress2(reinterpret_cast<Bytef *>(c.out.data()), &len,
+                         reinterpret_cast<const Bytef *>(p), nbytes, level)
+                == Z_OK;
+        c.out.resize(len);
+    }
+
+    // compress the batch in parallel & write the chunks to the dataset
+    void flush(h5::DataSet &ds)
+    {
+        pool.run(nbatch, [this](size_t k) { compress(batch[k]); });
+
+        for (size_t k = 0; k < nbatch; ++k) {
+            const chunk_t &c = batch[k];
+            hsize_t offset[1] = { c.row0 };
+            if (!c.ok
+                || H5Dwrite_chunk(ds.getId(), H5P_DEFAULT, 0, offset, c.out.size(), c.out.data())
+                        < 0)
+                throw std::runtime_error("Error writing event data chunk");
+        }
+        nbatch = 0;
+    }
+};
+
+/*
+ * Companion index of an event dataset sorted by history id
+ *
+ * index/hid, index/offset : per-history offset table. The events of history hid[k]
+ * are the rows [offset[k], offset[k+1]) of event_data
+ *
+ * index/bin_mask : for each block of block_rows rows, a bit mask of the
+ * coarse spatial bins (nbin^3 bins on the simulation box) that contain events of the block
+ */
+struct event_index
+{
+    // # of spatial bins per axis
+    static constexpr int nbin = 8;
+    static constexpr size_t mask_bytes = nbin * nbin * nbin / 8;
+
+    size_t block_rows{ 0 };
+    box3D box;
+    // offset of the x position column, -1 if there are no positions
+    long pos_offset{ -1 };
+    std::string pos_column;
+
+    std::vector<uint64_t> hid, offset;
+    std::vector<uint8_t> mask;
+    size_t rows{ 0 };
+    // false if history ids decrease somewhere, the hid/offset table is then not valid
+    bool sorted{ true };
+
+    event_index(const std::vector<event_buffer::column_t> &layout, const box3D &b, size_t brows)
+        : block_rows(brows), box(b)
+    {
+        for (const auto &c : layout)
+            if (c.quantity == event_buffer::Position && c.type == event_buffer::Float32) {
+                pos_offset = c.offset;
+                pos_column = c.name;
+                break;
+            }
+    }
+
+    // spatial bin of position x
+    static int bin(const box3D &box, const float *x)
+    {
+        int k = 0;
+        for (int j = 0; j < 3; ++j) {
+            float L = box.max()(j) - box.min()(j);
+            int i = L > 0 ? int(std::floor((x[j] - box.min()(j)) / L * nbin)) : 0;
+            k = k * nbin + std::min(std::max(i, 0), nbin - 1);
+        }
+        return k;
+    }
+
+    void add(const char *rec, size_t n, size_t rsize)
+    {
+        for (size_t i = 0; i < n; ++i, ++rows, rec += rsize) {
+            uint64_t id = event_buffer::history_id(rec);
+            if (sorted && (hid.empty() || id != hid.back())) {
+                if (!hid.empty() && id < hid.back()) {
+                    sorted = false;
+                    hid.clear();
+                    offset.clear();
+                } else {
+                    hid.push_back(id);
+                    offset.push_back(rows);
+                }
+            }
+            if (pos_offset >= 0) {
+                size_t b = rows / block_rows;
+                if (mask.size() < (b + 1) * mask_bytes)
+                    mask.resize((b + 1) * mask_bytes, 0);
+                float x[3];
+                std::memcpy(x, rec + pos_offset, sizeof(x));
+                int k = bin(box, x);
+                mask[b * mask_bytes + k / 8] |= uint8_t(1 << (k % 8));
+            }
+        }
+    }
+
+    void write(h5::File &h5f, const std::string &grp_name)
+    {
+        std::string path = grp_name + "/index/";
+        // unsorted data: readers fall back to scanning for history lookups
+        if (sorted) {
+            offset.push_back(rows);
+            h5::DataSet ds = h5e::dump(h5f, path + "hid", hid);
+            ds.createAttribute("description", std::string("History ids with events, ascending"));
+            ds = h5e::dump(h5f, path + "offset", offset);
+            ds.createAttribute("description",
+                               std::string("Events of history hid[k] are the rows "
+                                           "[offset[k], offset[k+1]) of event_data"));
+        }
+        if (pos_offset < 0)
+            return;
+        h5::DataSet ds = h5f.createDataSet<uint8_t>(
+                path + "bin_mask", h5::DataSpace({ mask.size() / mask_bytes, mask_bytes }));
+        ds.write_raw(mask.data());
+        ds.createAttribute("description",
+                           std::string("Bit mask of spatial bins with events, per block of rows"));
+        ds.createAttribute("block_rows", block_rows);
+        ds.createAttribute("bins_per_axis", nbin);
+        ds.createAttribute("position_column", pos_column);
+        std::vector<float> lo(box.min().data(), box.min().data() + 3);
+        std::vector<float> hi(box.max().data(), box.max().data() + 3);
+        ds.createAttribute("box_min", lo);
+        ds.createAttribute("box_max", hi);
+    }
+};
+
+// pool, if not null, compresses the dataset chunks in parallel
+int dump_event_stream(h5::File &h5f, const std::string &grp_name, event_stream &es,
+                      const box3D &box, const event_storage &st,
+                      mcdriver::save_stats_t &stats, compress_pool *pool = nullptr)
+{
+    // get # of rows, record size
+    size_t nrows(es.rows()), rsize(es.record_size());
 
     std::string path;
     path = grp_name + "/column_names";
@@ -132,54 +486,117 @@ int dump_event_stream(h5::File &h5f, const std::string &grp_name, event_stream &
 
     path = grp_name + "/event_data";
 
+    h5::CompoundType dtype = event_data_type(es.event_prototype());
+
     if (nrows == 0) {
         // No data. Create empty dataset and leave
-        h5::DataSet dataset = h5f.createDataSet<float>(path, h5::DataSpace(nrows, ncols));
+        h5::DataSet dataset = h5f.createDataSet(path, h5::DataSpace(nrows), dtype);
         return 0;
     }
 
-    // mem buffer ~1MB
-    size_t buff_rows = std::ceil(1. * (1 << 20) / 4 / ncols);
-    buff_rows = std::min(buff_rows, nrows);
-    std::vector<float> buff(buff_rows * ncols);
+    // rows per chunk
+    size_t buff_rows = std::min(st.chunk_rows(rsize), nrows);
 
     // Create the dataset.
     // Use compression + chunking
+    // Quantized data have zero trailing bits & compress better after byte shuffling
+    // Without compression the dataset is contiguous and can be memory-mapped
+    bool quantized = es.codec().enabled();
     h5::DataSetCreateProps dscp;
-    dscp.add(h5::Deflate(6));
-    dscp.add(h5::Chunking({ buff_rows, ncols }));
-    h5::DataSet dataset = h5f.createDataSet<float>(path, h5::DataSpace(nrows, ncols), dscp);
-
-    std::vector<size_t> offset{ 0, 0 };
-    std::vector<size_t> count{ buff_rows, ncols };
+    if (st.level > 0)
+        st.set_props(dscp, buff_rows, quantized);
+    h5::DataSet dataset = h5f.createDataSet(path, h5::DataSpace(nrows), dtype, dscp);
+    if (quantized)
+        write_resolution_attr(dataset, es.codec());
+    // sampled stream: store the total # of events
+    if (es.max_rows())
+        dataset.createAttribute("rows_seen", es.rows_seen());
+
+    // index blocks coincide with dataset chunks
+    event_index index(es.event_prototype().layout(), box, buff_rows);
 
     es.rewind();
 
-    // copy data in chunks
-    while (nrows) {
-        count[0] = std::min(nrows, buff_rows); // # of rows to copy in this iter
-        nrows -= count[0];
+    size_t row = 0;
+    if (st.level > 0 && pool) {
+        // compress chunks in parallel
+        // the last chunk is zero padded, as chunks are always stored whole
+        chunk_compressor cc(buff_rows, rsize, st.level, st.shuffle || quantized, *pool);
+        while (row < nrows) {
+            size_t n = std::min(nrows - row, buff_rows);
+            auto &c = cc.next(row);
+            es.read(c.raw.data(), n);
+            std::fill(c.raw.begin() + n * rsize, c.raw.end(), 0);
+            index.add(c.raw.data(), n, rsize);
+            row += n;
+            if (cc.full() || row == nrows)
+                cc.flush(dataset);
+        }
+    } else {
+        std::vector<char> buff(buff_rows * rsize);
+        std::vector<size_t> offset{ 0 };
+        std::vector<size_t> count{ buff_rows };
 
-        // read from raw file buffer
-        es.read(buff.data(), count[0]);
+        // copy data in chunks
+        while (row < nrows) {
+            count[0] = std::min(nrows - row, buff_rows); // # of rows to copy in this iter
 
-        // write to HDF5 file
-        dataset.select(offset, count).write_raw<float>(buff.data());
+            // read from raw file buffer
+            es.read(buff.data(), count[0]);
 
-        // advance offset
-        offset[0] += count[0];
+            // write to HDF5 file
+            offset[0] = row;
+            dataset.select(offset, count).write_raw(buff.data(), dtype);
+            index.add(buff.data(), count[0], rsize);
+
+            row += count[0];
+        }
     }
 
+    index.write(h5f, grp_name);
+
+    stats.event_bytes += nrows * rsize;
+    stats.event_stored_bytes += H5Dget_storage_size(dataset.getId());
+
     return 0;
 }
 
+// convert rows of a 2D float dataset (file version 1.0) to event records
+void convert_legacy_rows(const float *src, size_t nrows, size_t ncols,
+                         const event_buffer &proto, char *dst)
+{
+    const auto &L = proto.layout();
+    for (size_t i = 0; i < nrows; ++i, src += ncols, dst += proto.size()) {
+        for (size_t j = 0; j < L.size() && j < ncols; ++j) {
+            char *p = dst + L[j].offset;
+            switch (L[j].type) {
+            case event_buffer::Uint64: {
+                uint64_t v = src[j];
+                std::memcpy(p, &v, sizeof(v));
+            } break;
+            case event_buffer::Int32: {
+                int32_t v = src[j];
+                std::memcpy(p, &v, sizeof(v));
+            } break;
+            case event_buffer::Float32:
+                std::memcpy(p, src + j, sizeof(float));
+                break;
+            case event_buffer::Float64: {
+                double v = src[j];
+                std::memcpy(p, &v, sizeof(v));
+            } break;
+            }
+        }
+    }
+}
+
 int load_event_stream(h5::File &h5f, const std::string &grp_name, event_stream &es)
 {
     if (!es.is_open())
         return -1;
 
-    // get row, column numbers
-    size_t ncols(es.cols());
+    const event_buffer &proto = es.event_prototype();
+    size_t rsize(es.record_size());
 
     std::string path;
     path = grp_name + "/event_data";
@@ -189,15 +606,23 @@ int load_event_stream(h5::File &h5f, const std::string &grp_name, event_stream &
 
     std::vector<size_t> dims = dataset.getSpace().getDimensions();
     size_t nrows = dims[0];
-    assert(ncols == dims[1]);
+    // 2D float datasets are from file version 1.0
+    bool legacy = dims.size() == 2;
+    size_t ncols = legacy ? dims[1] : 1;
+    assert(!legacy || ncols == proto.columns());
 
     // mem buffer ~1MB
-    size_t buff_rows = std::ceil(1. * (1 << 20) / 4 / ncols);
-    buff_rows = std::min(buff_rows, nrows);
-    std::vector<float> buff(buff_rows * ncols);
+    size_t buff_rows = std::ceil(1. * (1 << 20) / rsize);
+    buff_rows = std::max(size_t(1), std::min(buff_rows, nrows));
+    std::vector<char> buff(buff_rows * rsize);
+    std::vector<float> fbuff(legacy ? buff_rows * ncols : 0);
 
-    std::vector<size_t> offset{ 0, 0 };
-    std::vector<size_t> count{ buff_rows, ncols };
+    h5::CompoundType dtype = event_data_type(proto);
+
+    std::vector<size_t> offset(dims.size(), 0);
+    std::vector<size_t> count{ buff_rows };
+    if (legacy)
+        count.push_back(ncols);
 
     es.rewind();
 
@@ -207,7 +632,11 @@ int load_event_stream(h5::File &h5f, const std::string &grp_name, event_stream &
         nrows -= count[0];
 
         // read from HDF5 file
-        dataset.select(offset, count).read_raw<float>(buff.data());
+        if (legacy) {
+            dataset.select(offset, count).read_raw<float>(fbuff.data());
+            convert_legacy_rows(fbuff.data(), count[0], ncols, proto, buff.data());
+        } else
+            dataset.select(offset, count).read_raw(buff.data(), dtype);
 
         // write to raw file buffer
         es.write(buff.data(), count[0]);
@@ -216,9 +645,388 @@ int load_event_stream(h5::File &h5f, const std::string &grp_name, event_stream &
         offset[0] += count[0];
     }
 
+    if (dataset.hasAttribute("rows_seen"))
+        es.set_rows_seen(dataset.getAttribute("rows_seen").read<size_t>());
+
+    return 0;
+}
+
+// Creation properties of output files, which may hold direct event output
+// Free space is tracked persistently, so the space of objects unlinked by an in-place
+// save() is reused by the next save, instead of growing the file each time
+h5::FileCreateProps event_file_props()
+{
+    h5::FileCreateProps fcp;
+    fcp.add(h5::FileSpaceStrategy(H5F_FSPACE_STRATEGY_FSM_AGGR, true, 0));
+    return fcp;
+}
+
+// copy the /events group of file src_name to dst
+// H5Ocopy copies the datasets as stored, i.e., chunks are not decompressed,
+// but all event data are still read & written once. The source file is not modified
+void copy_events(const std::string &src_name, h5::File &dst)
+{
+    h5::File src(src_name, h5::File::ReadOnly);
+    if (!src.exist("events"))
+        return;
+    if (H5Ocopy(src.getId(), "events", dst.getId(), "events", H5P_DEFAULT, H5P_DEFAULT) < 0)
+        throw std::runtime_error("Failed copying events from " + src_name);
+}
+
+// true if the 2 names point to the same file
+bool same_file(const std::string &f1, const std::string &f2)
+{
+    if (f1.empty() || f2.empty())
+        return false;
+    namespace fs = std::filesystem;
+    return fs::weakly_canonical(f1) == fs::weakly_canonical(f2);
+}
+
+/*
+ * An event_sink writing events directly to the HDF5 output file
+ *
+ * Blocks appended by the simulation threads are queued and a dedicated
+ * I/O thread writes them into extendible, chunked & compressed datasets
+ * /events/<name>/event_data.
+ *
+ * Rows of each dataset are collected and written one full chunk at a time.
+ * The queue size is bounded; append() blocks if the I/O thread falls behind.
+ *
+ * No HDF5 calls are made by other threads while the I/O thread is active.
+ */
+class h5_event_sink : public event_sink
+{
+public:
+    // max. size of queued event data
+    static constexpr size_t max_queued_bytes = 1 << 26;
+
+    explicit h5_event_sink(std::unique_ptr<h5::File> f) : file_(std::move(f))
+    {
+        io_ = std::thread(&h5_event_sink::io_loop_, this);
+    }
+    ~h5_event_sink() override { close(); }
+
+    // create or open the dataset of channel ch
+    // codec, if given & enabled, describes the quantization of the data
+    void add_channel(int ch, const std::string &grp_name, const event_buffer &proto,
+                     const event_storage &st, const event_codec *codec = nullptr);
+
+    int append(int ch, const char *data, size_t nrows) override;
+    int sync() override;
+    size_t rows(int ch) const override;
+    int close() override;
+
+    // discard rows of channel ch beyond the 1st n
+    void truncate(int ch, size_t n);
+
+private:
+    struct channel_t
+    {
+        std::unique_ptr<h5::DataSet> ds;
+        std::unique_ptr<h5::CompoundType> dtype;
+        size_t rsize{ 0 }, rows{ 0 }, chunk_rows{ 0 };
+        // rows waiting to fill a chunk
+        std::vector<char> stage;
+        size_t stage_rows{ 0 };
+    };
+    struct job_t
+    {
+        int ch;
+        std::vector<char> data;
+        size_t rows;
+    };
+
+    std::unique_ptr<h5::File> file_;
+    std::vector<channel_t> ch_;
+    std::deque<job_t> queue_;
+    size_t queued_bytes_{ 0 };
+    bool busy_{ false }, stop_{ false }, error_{ false };
+    std::thread io_;
+    mutable std::mutex mtx_;
+    mutable std::condition_variable cv_space_;
+    std::condition_variable cv_work_;
+
+    void io_loop_();
+    void write_rows_(channel_t &c, const char *data, size_t nrows);
+    void write_stage_(channel_t &c);
+};
+
+void h5_event_sink::add_channel(int ch, const std::string &grp_name, const event_buffer &proto,
+                                const event_storage &st, const event_codec *codec)
+{
+    // wait for the I/O thread to become idle
+    std::unique_lock<std::mutex> lock(mtx_);
+    cv_space_.wait(lock, [this] { return queue_.empty() && !busy_; });
+
+    if (ch >= (int)ch_.size())
+        ch_.resize(ch + 1);
+    channel_t &c = ch_[ch];
+    if (c.ds)
+        return; // already there
+
+    c.rsize = proto.size();
+    c.dtype = std::make_unique<h5::CompoundType>(event_data_type(proto));
+    c.chunk_rows = st.chunk_rows(c.rsize);
+    c.stage.resize(c.chunk_rows * c.rsize);
+    c.stage_rows = 0;
+
+    std::string path = grp_name + "/event_data";
+    if (file_->exist(path)) {
+        // append to the dataset of a previous run
+        h5::DataSet ds = file_->getDataSet(path);
+        h5::DataSpace sp = ds.getSpace();
+        std::vector<size_t> dims = sp.getDimensions();
+        std::vector<size_t> maxdims = sp.getMaxDimensions();
+        if (dims.size() != 1 || maxdims[0] != h5::DataSpace::UNLIMITED
+            || ds.getDataType().getClass() != h5::DataTypeClass::Compound)
+            throw std::runtime_error("Cannot append to " + path
+                                     + ". It was not created with direct event output.");
+        c.rows = dims[0];
+        c.ds = std::make_unique<h5::DataSet>(ds);
+    } else {
+        const auto &s1 = proto.columnNames();
+        dump(*file_, grp_name + "/column_names", s1, { s1.size() }, "Event data column names");
+        const auto &s2 = proto.columnDescriptions();
+        dump(*file_, grp_name + "/column_descriptions", s2, { s2.size() },
+             "Event data column descriptions");
+
+        // extendible datasets are always chunked
+        h5::DataSetCreateProps dscp;
+        bool quantized = codec && codec->enabled();
+        st.set_props(dscp, c.chunk_rows, quantized);
+        h5::DataSpace sp({ 0 }, { h5::DataSpace::UNLIMITED });
+        c.rows = 0;
+        c.ds = std::make_unique<h5::DataSet>(file_->createDataSet(path, sp, *c.dtype, dscp));
+        if (quantized)
+            write_resolution_attr(*c.ds, *codec);
+    }
+}
+
+int h5_event_sink::append(int ch, const char *data, size_t nrows)
+{
+    if (nrows == 0)
+        return 0;
+    size_t rsize;
+    {
+        // channels may be added concurrently
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (ch < 0 || ch >= (int)ch_.size() || !ch_[ch].ds)
+            return -1;
+        rsize = ch_[ch].rsize;
+    }
+
+    // copy data without holding the lock
+    job_t job{ ch, std::vector<char>(data, data + nrows * rsize), nrows };
+    size_t nbytes = job.data.size();
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    if (stop_)
+        return -1;
+    // bounded queue: wait for space
+    cv_space_.wait(lock, [&] { return queued_bytes_ == 0 || queued_bytes_ + nbytes <= max_queued_bytes; });
+    queue_.push_back(std::move(job));
+    queued_bytes_ += nbytes;
+    cv_work_.notify_one();
+    return error_ ? -1 : 0;
+}
+
+int h5_event_sink::sync()
+{
+    // wait for the I/O thread to become idle
+    std::unique_lock<std::mutex> lock(mtx_);
+    cv_space_.wait(lock, [this] { return queue_.empty() && !busy_; });
+    if (!file_)
+        return -1;
+    try {
+        std::lock_guard<std::mutex> h5lock(h5_mutex());
+        for (channel_t &c : ch_)
+            if (c.ds)
+                write_stage_(c);
+        file_->flush();
+    } catch (std::exception &) {
+        error_ = true;
+    }
+    return error_ ? -1 : 0;
+}
+
+size_t h5_event_sink::rows(int ch) const
+{
+    // the I/O thread updates the row counts, wait until it is idle
+    std::unique_lock<std::mutex> lock(mtx_);
+    cv_space_.wait(lock, [this] { return queue_.empty() && !busy_; });
+    return ch >= 0 && ch < (int)ch_.size() ? ch_[ch].rows + ch_[ch].stage_rows : 0;
+}
+
+void h5_event_sink::truncate(int ch, size_t n)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    cv_space_.wait(lock, [this] { return queue_.empty() && !busy_; });
+    if (ch < 0 || ch >= (int)ch_.size())
+        return;
+    channel_t &c = ch_[ch];
+    if (c.ds && n < c.rows) {
+        c.ds->resize({ n });
+        c.rows = n;
+    }
+}
+
+int h5_event_sink::close()
+{
+    if (io_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stop_ = true;
+        }
+        cv_work_.notify_one();
+        io_.join();
+    }
+    if (file_) {
+        try {
+            ch_.clear(); // datasets must be closed before the file
+            file_->flush();
+        } catch (std::exception &) {
+            error_ = true;
+        }
+        file_.reset();
+    }
+    return error_ ? -1 : 0;
+}
+
+void h5_event_sink::io_loop_()
+{
+    bool ok = true;
+    std::unique_lock<std::mutex> lock(mtx_);
+    for (;;) {
+        cv_work_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+        // on stop, exit after the queue has been drained
+        if (queue_.empty())
+            break;
+
+        job_t job = std::move(queue_.front());
+        queue_.pop_front();
+        busy_ = true;
+
+        lock.unlock();
+        try {
+            std::lock_guard<std::mutex> h5lock(h5_mutex());
+            write_rows_(ch_[job.ch], job.data.data(), job.rows);
+        } catch (std::exception &) {
+            ok = false;
+        }
+        lock.lock();
+
+        queued_bytes_ -= job.data.size();
+        busy_ = false;
+        if (!ok)
+            error_ = true;
+        cv_space_.notify_all();
+    }
+    lock.unlock();
+
+    // write the last incomplete chunks
+    try {
+        std::lock_guard<std::mutex> h5lock(h5_mutex());
+        for (channel_t &c : ch_)
+            if (c.ds)
+                write_stage_(c);
+    } catch (std::exception &) {
+        ok = false;
+    }
+    lock.lock();
+    if (!ok)
+        error_ = true;
+}
+
+void h5_event_sink::write_rows_(channel_t &c, const char *data, size_t nrows)
+{
+    while (nrows) {
+        size_t m = std::min(nrows, c.chunk_rows - c.stage_rows);
+        std::memcpy(c.stage.data() + c.stage_rows * c.rsize, data, m * c.rsize);
+        c.stage_rows += m;
+        data += m * c.rsize;
+        nrows -= m;
+        if (c.stage_rows == c.chunk_rows)
+            write_stage_(c);
+    }
+}
+
+void h5_event_sink::write_stage_(channel_t &c)
+{
+    if (!c.stage_rows)
+        return;
+    c.ds->resize({ c.rows + c.stage_rows });
+    c.ds->select({ c.rows }, { c.stage_rows }).write_raw(c.stage.data(), *c.dtype);
+    c.rows += c.stage_rows;
+    c.stage_rows = 0;
+}
+
+int mcdriver::open_event_sink_(std::ostream *os)
+{
+    std::string fname = config_.Output.outfilename + ".h5";
+    try {
+        if (!event_sink_) {
+            std::unique_ptr<h5::File> f;
+            if (same_file(fname, event_file_)) {
+                // continue writing in the same file
+                f = std::make_unique<h5::File>(fname, h5::File::ReadWrite);
+            } else {
+                // new file, bring along events from a previous run
+                f = std::make_unique<h5::File>(fname, h5::File::Truncate, event_file_props());
+                if (!event_file_.empty())
+                    copy_events(event_file_, *f);
+            }
+            event_sink_ = std::make_shared<h5_event_sink>(std::move(f));
+            event_file_ = fname;
+        }
+
+        auto *sink = static_cast<h5_event_sink *>(event_sink_.get());
+        event_storage st(config_.Output);
+        std::string page = "/events/";
+        if (config_.Output.store_pka_events)
+            sink->add_channel(mccore::PkaStream, page + "pka",
+                              s_->event_prototype(mccore::PkaStream), st);
+        // exit & damage positions are quantized by the clone streams
+        event_codec codec;
+        if (config_.Output.store_exit_events) {
+            codec = event_codec(s_->event_prototype(mccore::ExitStream),
+                                config_.Output.event_position_resolution);
+            sink->add_channel(mccore::ExitStream, page + "exit",
+                              s_->event_prototype(mccore::ExitStream), st, &codec);
+        }
+        if (config_.Output.store_damage_events) {
+            codec = event_codec(s_->event_prototype(mccore::DamageStream),
+                                config_.Output.event_position_resolution);
+            sink->add_channel(mccore::DamageStream, page + "damage",
+                              s_->event_prototype(mccore::DamageStream), st, &codec);
+        }
+        if (config_.Output.store_cluster_events)
+            sink->add_channel(mccore::ClusterStream, page + "cluster",
+                              s_->event_prototype(mccore::ClusterStream), st);
+
+        // continuing from a checkpoint: drop events written after it
+        for (size_t k = 0; k < resume_event_rows_.size(); ++k)
+            sink->truncate(k, resume_event_rows_[k]);
+
+    } catch (std::exception &e) {
+        if (os)
+            (*os) << e.what() << endl;
+        event_sink_.reset();
+        return -1;
+    }
     return 0;
 }
 
+int mcdriver::close_event_sink_(std::ostream *os)
+{
+    if (!event_sink_)
+        return 0;
+    int ret = event_sink_->close();
+    event_sink_.reset();
+    if (ret != 0 && os)
+        (*os) << "Error writing events to " << event_file_ << endl;
+    return ret;
+}
+
 // save data from mcinfo, called recursively
 int dump(h5::File &h5f, const std::string &path, const mcinfo_node &i)
 {
@@ -274,8 +1082,32 @@ int dump(h5::File &h5f, const std::string &path, const mcinfo_node &i)
 
 int mcdriver::save(const std::string &h5filename, std::ostream *os)
 {
+    bool direct_events = config_.Output.direct_event_output;
+
+    auto t0 = std::chrono::steady_clock::now();
+    save_stats_ = save_stats_t();
+
+    // finish writing events to the file
+    if (direct_events && close_event_sink_(os) != 0)
+        return -1;
+
     try {
-        h5::File h5f(h5filename, h5::File::Truncate);
+        // with direct event output the events may already be in the file
+        bool in_place = direct_events && same_file(h5filename, event_file_);
+
+        // a new file may receive direct event output when the run is continued
+        h5::File h5f = in_place
+                ? h5::File(h5filename, h5::File::ReadWrite)
+                : h5::File(h5filename, h5::File::Truncate, event_file_props());
+
+        if (in_place) {
+            // keep the events, everything else is rewritten
+            for (const std::string &name : h5f.listObjectNames())
+                if (name != "events")
+                    h5f.unlink(name);
+            for (const std::string &name : h5f.listAttributeNames())
+                h5f.deleteAttribute(name);
+        }
 
         if (writeFileHeader(h5f, os) != 0)
             return -1;
@@ -283,24 +1115,176 @@ int mcdriver::save(const std::string &h5filename, std::ostream *os)
         mcinfo mci(shared_from_this());
         dump(h5f, "", mci);
 
+        // position of each thread's phase-space reader
+        if (!phase_space_pos_.empty()) {
+            std::vector<uint64_t> pos(phase_space_pos_.begin(), phase_space_pos_.end());
+            h5::DataSet ds = h5e::dump(h5f, "/run_info/phase_space_position", pos);
+            ds.createAttribute("description",
+                               std::string("Phase-space records used by each thread"));
+        }
+
         // events
         std::string page = "/events/";
-        if (config_.Output.store_pka_events)
-            dump_event_stream(h5f, page + "pka", s_->pka_stream());
-        if (config_.Output.store_exit_events)
-            dump_event_stream(h5f, page + "exit", s_->exit_stream());
-        if (config_.Output.store_damage_events)
-            dump_event_stream(h5f, page + "damage", s_->damage_stream());
+        if (direct_events) {
+            if (!in_place && !event_file_.empty())
+                copy_events(event_file_, h5f);
+        } else {
+            // spatial index bins cover the simulation box
+            const box3D &box = s_->getTarget().grid().box();
+            event_storage st(config_.Output);
+            // one pool of compression threads for all streams
+            std::unique_ptr<compress_pool> pool;
+            if (st.level > 0 && st.nthreads > 1)
+                pool = std::make_unique<compress_pool>(st.nthreads);
+            if (config_.Output.store_pka_events)
+                dump_event_stream(h5f, page + "pka", s_->pka_stream(), box, st, save_stats_,
+                                  pool.get());
+            if (config_.Output.store_exit_events)
+                dump_event_stream(h5f, page + "exit", s_->exit_stream(), box, st, save_stats_,
+                                  pool.get());
+            if (config_.Output.store_damage_events)
+                dump_event_stream(h5f, page + "damage", s_->damage_stream(), box, st,
+                                  save_stats_, pool.get());
+            if (config_.Output.store_cluster_events)
+                dump_event_stream(h5f, page + "cluster", s_->cluster_stream(), box, st,
+                                  save_stats_, pool.get());
+        }
 
-    } catch (h5::Exception &e) {
+        h5f.flush();
+
+    } catch (std::exception &e) {
         if (os)
             (*os) << e.what() << endl;
         return -1;
     }
 
+    std::error_code ec;
+    save_stats_.file_bytes = std::filesystem::file_size(h5filename, ec);
+    save_stats_.wall_time_s =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
     return 0;
 }
 
+// dump a 1D vector with a description, also if it has a single element
+template <class T>
+void dump_vector(h5::File &file, const std::string &path, const std::vector<T> &data,
+                 const std::string &desc)
+{
+    h5::DataSet ds = h5e::dump(file, path, data);
+    ds.createAttribute("description", desc);
+}
+
+// checkpoint group names of the reservoir samples, per stream id
+const char *const reservoir_group[mccore::NStreams] = { "pka", "exit", "damage", "cluster" };
+
+// append the thread states & event offsets of a checkpoint to a saved file
+int mcdriver::write_checkpoint_info(const std::string &fname, const checkpoint_t &c)
+{
+    try {
+        h5::File h5f(fname, h5::File::ReadWrite);
+        std::string path("/run_info/checkpoint/");
+        size_t n = c.threads.size(), m = random_vars::state_type().size();
+        std::vector<uint64_t> rng, next_id, stride, left, ps_pos;
+        std::vector<double> sums;
+        for (const auto &t : c.threads) {
+            rng.insert(rng.end(), t.rng.begin(), t.rng.end());
+            next_id.push_back(t.next_id);
+            stride.push_back(t.id_stride);
+            left.push_back(t.ions_left);
+            ps_pos.push_back(t.phase_space_pos);
+            sums.insert(sums.end(), t.tallies.begin(), t.tallies.end());
+        }
+        h5::DataSet ds = h5f.createDataSet<uint64_t>(path + "thread_rng_state",
+                                                     h5::DataSpace({ n, m }));
+        ds.write_raw(rng.data());
+        ds.createAttribute("description",
+                           std::string("Random number generator state of each thread"));
+
+        // raw partial tallies, so that the final sums are the same as in the interrupted run
+        h5e::dump(h5f, path + "base_ion_count", c.base.ion_count);
+        dump_vector(h5f, path + "base_tally_sums", c.base.tallies,
+                    "Raw tally sums at the start of the interrupted run");
+        ds = h5f.createDataSet<double>(path + "thread_tally_sums",
+                                       h5::DataSpace({ n, c.base.tallies.size() }));
+        ds.write_raw(sums.data());
+        ds.createAttribute("description", std::string("Raw partial tally sums of each thread"));
+
+        // reservoir samples of the main stream (1st row) & of each thread
+        for (int k = 0; k < mccore::NStreams; ++k) {
+            std::vector<const event_stream::reservoir_t *> src{ &c.base.reservoir[k] };
+            for (const auto &t : c.threads)
+                src.push_back(&t.reservoir[k]);
+            if (std::all_of(src.begin(), src.end(), [](auto r) { return r->rng.empty(); }))
+                continue;
+            std::string grp = path + "reservoir/" + reservoir_group[k] + "/";
+            std::vector<uint8_t> rows;
+            std::vector<uint64_t> bytes, seen;
+            std::vector<std::string> rng_state;
+            for (const auto *r : src) {
+                rows.insert(rows.end(), r->rows.begin(), r->rows.end());
+                bytes.push_back(r->rows.size());
+                seen.push_back(r->seen);
+                rng_state.push_back(r->rng);
+            }
+            dump_vector(h5f, grp + "rows", rows, "Sampled event records, raw bytes");
+            dump_vector(h5f, grp + "bytes", bytes, "Size of each sample in bytes");
+            dump_vector(h5f, grp + "seen", seen, "Events offered to each reservoir");
+            dump_vector(h5f, grp + "rng_state", rng_state, "State of each sampling rng");
+        }
+        dump_vector(h5f, path + "thread_next_id", next_id, "Next ion id of each thread");
+        dump_vector(h5f, path + "thread_id_stride", stride, "Ion id stride of each thread");
+        dump_vector(h5f, path + "thread_ions_left", left, "Remaining ions of each thread");
+        dump_vector(h5f, path + "thread_phase_space_position", ps_pos,
+                    "Phase-space records used by each thread");
+        h5e::dump(h5f, path + "target_ion_count", c.target_ion_count);
+        if (!c.event_file.empty()) {
+            h5e::dump(h5f, path + "event_file", c.event_file);
+            dump_vector(h5f, path + "event_rows", c.event_rows,
+                        "Rows of the event datasets in event_file consistent with the checkpoint");
+        }
+    } catch (std::exception &) {
+        return -1;
+    }
+    return 0;
+}
+
+void mcdriver::write_checkpoint_(std::shared_ptr<checkpoint_t> c)
+{
+    mcdriver &D = *c->snap;
+    bool ok = true;
+
+    // merge the stream snapshots, ordered per history id
+    if (!D.config_.Output.direct_event_output) {
+        D.init_streams_(D.s_.get(), nullptr);
+        for (int k = 0; k < mccore::NStreams; ++k) {
+            if (c->streams[k].empty())
+                continue;
+            std::vector<event_stream *> v;
+            for (auto &es : c->streams[k])
+                v.push_back(es.get());
+            ok = ok && D.s_->stream(mccore::stream_id_t(k)).merge(v) == 0;
+            c->streams[k].clear();
+        }
+    }
+
+    // write everything to a temp file, then rename it,
+    // so that the checkpoint file is always complete
+    std::string tmpname = c->fname + ".tmp";
+    if (ok) {
+        std::lock_guard<std::mutex> h5lock(h5_mutex());
+        ok = D.save(tmpname) == 0 && write_checkpoint_info(tmpname, *c) == 0;
+    }
+
+    std::error_code ec;
+    if (ok)
+        std::filesystem::rename(tmpname, c->fname, ec);
+    else
+        std::filesystem::remove(tmpname, ec);
+
+    ckpt_busy_ = false;
+}
+
 std::shared_ptr<mcdriver> mcdriver::load(const std::string &h5filename, std::ostream *os)
 {
     std::shared_ptr<mcdriver> D;
@@ -392,15 +1376,94 @@ std::shared_ptr<mcdriver> mcdriver::load(const std::string &h5filename, std::ost
             S->setIonCount(Nh);
         }
 
+        // phase-space records used in previous runs
+        if (h5f.exist("/run_info/phase_space_position")) {
+            auto pos = h5e::load<std::vector<uint64_t>>(h5f, "/run_info/phase_space_position");
+            D->phase_space_pos_.assign(pos.begin(), pos.end());
+        }
+
+        // checkpoint of an interrupted run
+        std::string ckpt_event_file;
+        if (h5f.exist("/run_info/checkpoint")) {
+            std::string path("/run_info/checkpoint/");
+            h5::DataSet ds = h5f.getDataSet(path + "thread_rng_state");
+            std::vector<uint64_t> rng(ds.getElementCount());
+            ds.read_raw(rng.data());
+            auto next_id = h5e::load<std::vector<uint64_t>>(h5f, path + "thread_next_id");
+            auto stride = h5e::load<std::vector<uint64_t>>(h5f, path + "thread_id_stride");
+            auto left = h5e::load<std::vector<uint64_t>>(h5f, path + "thread_ions_left");
+            std::vector<uint64_t> ps_pos;
+            if (h5f.exist(path + "thread_phase_space_position"))
+                ps_pos = h5e::load<std::vector<uint64_t>>(h5f,
+                                                          path + "thread_phase_space_position");
+            size_t m = random_vars::state_type().size();
+            for (size_t i = 0; i < next_id.size() && (i + 1) * m <= rng.size(); ++i) {
+                mccore::thread_state t;
+                std::copy(rng.begin() + i * m, rng.begin() + (i + 1) * m, t.rng.begin());
+                t.next_id = next_id[i];
+                t.id_stride = stride[i];
+                t.ions_left = left[i];
+                t.phase_space_pos = i < ps_pos.size() ? ps_pos[i] : 0;
+                D->resume_threads_.push_back(t);
+            }
+            D->resume_target_ = h5e::load<size_t>(h5f, path + "target_ion_count");
+
+            // partial results of the interrupted run
+            // without them, the run continues from the merged results
+            run_base_t &base = D->resume_base_;
+            if (h5f.exist(path + "thread_tally_sums")) {
+                base.ion_count = h5e::load<size_t>(h5f, path + "base_ion_count");
+                base.tallies = h5e::load<std::vector<double>>(h5f, path + "base_tally_sums");
+                ds = h5f.getDataSet(path + "thread_tally_sums");
+                size_t M = base.tallies.size();
+                std::vector<double> sums(ds.getElementCount());
+                ds.read_raw(sums.data());
+                for (size_t i = 0; i < D->resume_threads_.size() && (i + 1) * M <= sums.size();
+                     ++i)
+                    D->resume_threads_[i].tallies.assign(sums.begin() + i * M,
+                                                         sums.begin() + (i + 1) * M);
+            } else
+                D->resume_threads_.clear();
+            for (int k = 0; k < mccore::NStreams; ++k) {
+                std::string grp = path + "reservoir/" + reservoir_group[k] + "/";
+                if (!h5f.exist(grp + "rows"))
+                    continue;
+                auto rows = h5e::load<std::vector<uint8_t>>(h5f, grp + "rows");
+                auto bytes = h5e::load<std::vector<uint64_t>>(h5f, grp + "bytes");
+                auto seen = h5e::load<std::vector<uint64_t>>(h5f, grp + "seen");
+                auto rng_state = h5e::load<std::vector<std::string>>(h5f, grp + "rng_state");
+                size_t pos = 0;
+                for (size_t i = 0; i < bytes.size() && i < seen.size() && i < rng_state.size()
+                     && pos + bytes[i] <= rows.size();
+                     ++i) {
+                    event_stream::reservoir_t r;
+                    r.rows.assign(rows.begin() + pos, rows.begin() + pos + bytes[i]);
+                    r.seen = seen[i];
+                    r.rng = rng_state[i];
+                    pos += bytes[i];
+                    if (i == 0)
+                        base.reservoir[k] = std::move(r);
+                    else if (i <= D->resume_threads_.size())
+                        D->resume_threads_[i - 1].reservoir[k] = std::move(r);
+                }
+            }
+            if (h5f.exist(path + "event_file")) {
+                ckpt_event_file = h5e::load<std::string>(h5f, path + "event_file");
+                D->resume_event_rows_ =
+                        h5e::load<std::vector<size_t>>(h5f, path + "event_rows");
+            }
+        }
+
+        // with direct event output, events stay in the file
+        // and are appended to in the next run
+        // a checkpoint refers to the events in the output file of the interrupted run
+        if (D->config_.Output.direct_event_output) {
+            D->event_file_ = ckpt_event_file.empty() ? h5filename : ckpt_event_file;
+            return D;
+        }
+
         // prepare to load events
-        uint32_t ev_mask{ 0 };
-        if (D->config_.Output.store_pka_events)
-            ev_mask |= static_cast<uint32_t>(Event::CascadeComplete);
-        if (D->config_.Output.store_exit_events)
-            ev_mask |= static_cast<uint32_t>(Event::IonExit);
-        if (D->config_.Output.store_damage_events)
-            ev_mask |= static_cast<uint32_t>(Event::Vacancy);
-        S->init_streams(ev_mask);
+        D->init_streams_(S, nullptr);
 
         // load pka events
         if (D->config_.Output.store_pka_events) {
@@ -417,6 +1480,11 @@ std::shared_ptr<mcdriver> mcdriver::load(const std::string &h5filename, std::ost
             load_event_stream(h5f, "/events/damage", S->damage_stream());
         }
 
+        // load cluster events
+        if (D->config_.Output.store_cluster_events) {
+            load_event_stream(h5f, "/events/cluster", S->cluster_stream());
+        }
+
     } catch (h5::Exception &e) {
         if (os)
             (*os) << e.what() << endl;
@@ -425,3 +1493,430 @@ std::shared_ptr<mcdriver> mcdriver::load(const std::string &h5filename, std::ost
 
     return D;
 }
+
+/*
+ * event_reader implementation
+ */
+
+struct event_reader::impl
+{
+    std::string fname;
+    std::unique_ptr<h5::File> file;
+    std::unique_ptr<h5::DataSet> ds;
+    std::unique_ptr<h5::CompoundType> dtype;
+    std::vector<event_buffer::column_t> layout;
+    size_t rsize{ 0 }, rows{ 0 };
+
+    // history index
+    std::vector<uint64_t> hid, offset;
+
+    // spatial index
+    std::vector<uint8_t> mask;
+    size_t block_rows{ 0 };
+    box3D box;
+    long pos_offset{ -1 };
+
+    // block size for scans
+    size_t scan_rows() const
+    {
+        return block_rows ? block_rows : std::max(size_t(1), size_t(1 << 20) / rsize);
+    }
+};
+
+event_reader::event_reader() { }
+event_reader::~event_reader() { }
+
+int event_reader::open(const std::string &fname, const std::string &name, std::ostream *os)
+{
+    close();
+    auto d = std::make_unique<impl>();
+    try {
+        d->fname = fname;
+        d->file = std::make_unique<h5::File>(fname, h5::File::ReadOnly);
+        std::string grp = "/events/" + name;
+        d->ds = std::make_unique<h5::DataSet>(d->file->getDataSet(grp + "/event_data"));
+
+        std::vector<size_t> dims = d->ds->getSpace().getDimensions();
+        h5::DataType ftype = d->ds->getDataType();
+        if (dims.size() != 1 || ftype.getClass() != h5::DataTypeClass::Compound)
+            throw std::runtime_error("Unsupported event data format in " + grp
+                                     + " (file version < 1.1)");
+        d->rows = dims[0];
+
+        // column layout from the compound members,
+        // naturally aligned as in event_buffer
+        std::vector<std::string> desc;
+        if (d->file->exist(grp + "/column_descriptions"))
+            d->file->getDataSet(grp + "/column_descriptions").read(desc);
+        hid_t t = ftype.getId();
+        int nm = H5Tget_nmembers(t);
+        std::vector<h5::CompoundType::member_def> members;
+        for (int i = 0; i < nm; ++i) {
+            char *mname = H5Tget_member_name(t, i);
+            hid_t mt = H5Tget_member_type(t, i);
+            bool is_float = H5Tget_class(mt) == H5T_FLOAT;
+            size_t sz = H5Tget_size(mt);
+            H5Tclose(mt);
+
+            event_buffer::column_t c;
+            c.name = mname;
+            H5free_memory(mname);
+            c.description = i < (int)desc.size() ? desc[i] : std::string();
+            c.type = is_float ? (sz == 8 ? event_buffer::Float64 : event_buffer::Float32)
+                              : (sz == 8 ? event_buffer::Uint64 : event_buffer::Int32);
+            c.quantity = event_buffer::Value;
+            sz = event_buffer::type_size(c.type);
+            c.offset = (d->rsize + sz - 1) / sz * sz;
+            d->rsize = c.offset + sz;
+            d->layout.push_back(c);
+            members.emplace_back(c.name, event_column_type(c.type), c.offset);
+        }
+        d->dtype = std::make_unique<h5::CompoundType>(members, d->rsize);
+
+        // load the index if available
+        if (d->file->exist(grp + "/index/hid")) {
+            d->file->getDataSet(grp + "/index/hid").read(d->hid);
+            d->file->getDataSet(grp + "/index/offset").read(d->offset);
+        }
+        if (d->file->exist(grp + "/index/bin_mask")) {
+            h5::DataSet m = d->file->getDataSet(grp + "/index/bin_mask");
+            d->mask.resize(m.getElementCount());
+            m.read_raw(d->mask.data());
+            d->block_rows = m.getAttribute("block_rows").read<size_t>();
+            std::string pc = m.getAttribute("position_column").read<std::string>();
+            auto lo = m.getAttribute("box_min").read<std::vector<float>>();
+            auto hi = m.getAttribute("box_max").read<std::vector<float>>();
+            d->box = box3D(box3D::VectorType(lo[0], lo[1], lo[2]),
+                           box3D::VectorType(hi[0], hi[1], hi[2]));
+            for (auto &c : d->layout)
+                if (c.name == pc)
+                    d->pos_offset = c.offset;
+            if (d->pos_offset < 0 || m.getAttribute("bins_per_axis").read<int>() != event_index::nbin)
+                d->mask.clear();
+        }
+    } catch (std::exception &e) {
+        if (os)
+            (*os) << e.what() << endl;
+        return -1;
+    }
+    d_ = std::move(d);
+    return 0;
+}
+
+void event_reader::close()
+{
+    d_.reset();
+}
+
+bool event_reader::is_open() const
+{
+    return d_ != nullptr;
+}
+
+size_t event_reader::rows() const
+{
+    return d_ ? d_->rows : 0;
+}
+
+size_t event_reader::record_size() const
+{
+    return d_ ? d_->rsize : 0;
+}
+
+const std::vector<event_buffer::column_t> &event_reader::layout() const
+{
+    static const std::vector<event_buffer::column_t> empty;
+    return d_ ? d_->layout : empty;
+}
+
+int event_reader::column(const std::string &name) const
+{
+    const auto &L = layout();
+    for (size_t i = 0; i < L.size(); ++i)
+        if (L[i].name == name)
+            return i;
+    return -1;
+}
+
+bool event_reader::hasHistoryIndex() const
+{
+    return d_ && !d_->offset.empty();
+}
+
+bool event_reader::hasSpatialIndex() const
+{
+    return d_ && !d_->mask.empty();
+}
+
+size_t event_reader::read(size_t first, size_t n, char *buff) const
+{
+    if (!d_ || first >= d_->rows)
+        return 0;
+    n = std::min(n, d_->rows - first);
+    if (n)
+        d_->ds->select({ first }, { n }).read_raw(buff, *d_->dtype);
+    return n;
+}
+
+int event_reader::map(event_view &v) const
+{
+    v.unmap();
+    if (!d_)
+        return -1;
+
+    // the dataset must be contiguous, unfiltered & stored with the record layout
+    hid_t ds = d_->ds->getId();
+    hid_t dcpl = H5Dget_create_plist(ds);
+    bool contiguous = H5Pget_layout(dcpl) == H5D_CONTIGUOUS && H5Pget_nfilters(dcpl) == 0;
+    H5Pclose(dcpl);
+    if (!contiguous)
+        return -1;
+    if (H5Tequal(d_->ds->getDataType().getId(), d_->dtype->getId()) <= 0)
+        return -1;
+    haddr_t offset = d_->rows ? H5Dget_offset(ds) : 0;
+    if (offset == HADDR_UNDEF)
+        return -1;
+
+    return v.map(d_->fname, offset, d_->rows, d_->layout, d_->rsize);
+}
+
+std::pair<size_t, size_t> event_reader::history_rows(uint64_t hid) const
+{
+    if (!d_)
+        return { 0, 0 };
+
+    if (hasHistoryIndex()) {
+        // O(log n) lookup
+        auto it = std::lower_bound(d_->hid.begin(), d_->hid.end(), hid);
+        if (it == d_->hid.end() || *it != hid)
+            return { 0, 0 };
+        size_t k = it - d_->hid.begin();
+        return { d_->offset[k], d_->offset[k + 1] };
+    }
+
+    // no index: scan for the 1st contiguous run of hid
+    size_t nb = d_->scan_rows(), first = 0, last = 0;
+    bool found = false;
+    std::vector<char> buff(nb * d_->rsize);
+    for (size_t r = 0; r < d_->rows; r += nb) {
+        size_t n = read(r, nb, buff.data());
+        for (size_t i = 0; i < n; ++i) {
+            bool match = event_buffer::history_id(buff.data() + i * d_->rsize) == hid;
+            if (match && !found) {
+                found = true;
+                first = r + i;
+            }
+            if (found && !match)
+                return { first, r + i };
+            last = r + i + 1;
+        }
+    }
+    return found ? std::make_pair(first, last) : std::make_pair(size_t(0), size_t(0));
+}
+
+size_t event_reader::read_history(uint64_t hid, std::vector<char> &out) const
+{
+    auto r = history_rows(hid);
+    size_t n = r.second - r.first;
+    out.resize(n * record_size());
+    return read(r.first, n, out.data());
+}
+
+size_t event_reader::read_box(const vector3 &lo, const vector3 &hi, std::vector<char> &out) const
+{
+    out.clear();
+    if (!d_)
+        return 0;
+
+    const size_t rsize = d_->rsize;
+    long pos = d_->pos_offset;
+    if (pos < 0) {
+        // no index: look for the position columns
+        for (auto &c : d_->layout)
+            if (c.name == "x" && c.type == event_buffer::Float32)
+                pos = c.offset;
+        if (pos < 0)
+            return 0;
+    }
+
+    // bins touched by the query box
+    std::vector<uint8_t> qmask;
+    if (hasSpatialIndex()) {
+        const int nb = event_index::nbin;
+        qmask.assign(event_index::mask_bytes, 0);
+        float flo[3] = { lo.x(), lo.y(), lo.z() }, fhi[3] = { hi.x(), hi.y(), hi.z() };
+        int b0 = event_index::bin(d_->box, flo), b1 = event_index::bin(d_->box, fhi);
+        int i0[3] = { b0 / (nb * nb), (b0 / nb) % nb, b0 % nb };
+        int i1[3] = { b1 / (nb * nb), (b1 / nb) % nb, b1 % nb };
+        for (int i = i0[0]; i <= i1[0]; ++i)
+            for (int j = i0[1]; j <= i1[1]; ++j)
+                for (int k = i0[2]; k <= i1[2]; ++k) {
+                    int b = (i * nb + j) * nb + k;
+                    qmask[b / 8] |= uint8_t(1 << (b % 8));
+                }
+    }
+
+    size_t nb = d_->scan_rows();
+    std::vector<char> buff(nb * rsize);
+    size_t n_out = 0;
+    for (size_t r = 0, blk = 0; r < d_->rows; r += nb, ++blk) {
+        if (!qmask.empty() && (blk + 1) * event_index::mask_bytes <= d_->mask.size()) {
+            // skip blocks without events in the query bins
+            const uint8_t *m = d_->mask.data() + blk * event_index::mask_bytes;
+            bool hit = false;
+            for (size_t k = 0; k < event_index::mask_bytes && !hit; ++k)
+                hit = m[k] & qmask[k];
+            if (!hit)
+                continue;
+        }
+        size_t n = read(r, nb, buff.data());
+        for (size_t i = 0; i < n; ++i) {
+            const char *rec = buff.data() + i * rsize;
+            float x[3];
+            std::memcpy(x, rec + pos, sizeof(x));
+            if (x[0] >= lo.x() && x[1] >= lo.y() && x[2] >= lo.z() && x[0] <= hi.x()
+                && x[1] <= hi.y() && x[2] <= hi.z()) {
+                out.insert(out.end(), rec, rec + rsize);
+                n_out++;
+            }
+        }
+    }
+    return n_out;
+}
+
+int cascade_library::save(const std::string &fname, std::ostream *os) const
+{
+    std::shared_lock lock(mtx_);
+
+    // flatten the library, record fields in separate columns
+    std::vector<int> key;
+    std::vector<float> E;
+    std::vector<size_t> offset(1, 0);
+    std::vector<float> x, t, erg, ioniz, phonon, path;
+    std::vector<uint32_t> ncoll;
+    std::vector<int32_t> duid;
+    std::vector<uint8_t> type, atom, gen;
+    for (size_t k = 0; k < bins_.size(); ++k)
+        for (const footprint_ptr &f : bins_[k]) {
+            key.push_back(k);
+            E.push_back(f->E);
+            for (const record &r : f->rec) {
+                x.insert(x.end(), r.x, r.x + 3);
+                t.push_back(r.t);
+                erg.push_back(r.erg);
+                ioniz.push_back(r.ioniz);
+                phonon.push_back(r.phonon);
+                path.push_back(r.path);
+                ncoll.push_back(r.ncoll);
+                duid.push_back(r.duid);
+                type.push_back(r.type);
+                atom.push_back(r.atom);
+                gen.push_back(r.gen);
+            }
+            offset.push_back(t.size());
+        }
+    if (key.empty())
+        return 0;
+
+    try {
+        h5::File h5f(fname, h5::File::Truncate);
+        if (writeFileHeader(h5f, os) != 0)
+            return -1;
+        std::string p("/cascade_library/");
+        h5e::dump(h5f, p + "natoms", natoms_);
+        h5e::dump(h5f, p + "nmat", nmat_);
+        h5e::dump(h5f, p + "bins_per_decade", bpd_);
+        h5e::dump(h5f, p + "size", n_);
+        h5e::dump(h5f, p + "config_hash", hash_);
+        dump_vector(h5f, p + "key", key, "Library bin of each cascade");
+        dump_vector(h5f, p + "E", E, "PKA energy of each cascade [eV]");
+        dump_vector(h5f, p + "offset", offset, "Offset of the 1st record of each cascade");
+        p += "records/";
+        dump_vector(h5f, p + "x", x, "Position relative to the PKA [nm]");
+        dump_vector(h5f, p + "t", t, "Time after the PKA start [ns]");
+        dump_vector(h5f, p + "erg", erg, "Recoil energy [eV]");
+        dump_vector(h5f, p + "ioniz", ioniz, "Energy lost to ionization [eV]");
+        dump_vector(h5f, p + "phonon", phonon, "Energy lost to phonons [eV]");
+        dump_vector(h5f, p + "path", path, "Recoil path [nm]");
+        dump_vector(h5f, p + "ncoll", ncoll, "Recoil collisions");
+        dump_vector(h5f, p + "duid", duid, "Recoil uid relative to the PKA");
+        dump_vector(h5f, p + "type", type, "Record type");
+        dump_vector(h5f, p + "atom", atom, "Atom id");
+        dump_vector(h5f, p + "gen", gen, "Recoil generation relative to the PKA");
+    } catch (h5::Exception &e) {
+        if (os)
+            (*os) << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
+
+int cascade_library::load(const std::string &fname, std::ostream *os)
+{
+    std::unique_lock lock(mtx_);
+    try {
+        h5::File h5f(fname, h5::File::ReadOnly);
+        std::string p("/cascade_library/");
+        if (h5e::load<int>(h5f, p + "natoms") != natoms_ || h5e::load<int>(h5f, p + "nmat") != nmat_
+            || h5e::load<int>(h5f, p + "bins_per_decade") != bpd_) {
+            if (os)
+                (*os) << "Cascade library " << fname << " does not match the simulation" << endl;
+            return -1;
+        }
+        if (!h5f.exist(p + "config_hash") || h5e::load<uint64_t>(h5f, p + "config_hash") != hash_) {
+            if (os)
+                (*os) << "Cascade library " << fname
+                      << " was created with different target or simulation options" << endl;
+            return -1;
+        }
+        auto key = h5e::load<std::vector<int>>(h5f, p + "key");
+        auto E = h5e::load<std::vector<float>>(h5f, p + "E");
+        auto offset = h5e::load<std::vector<size_t>>(h5f, p + "offset");
+        p += "records/";
+        auto x = h5e::load<std::vector<float>>(h5f, p + "x");
+        auto t = h5e::load<std::vector<float>>(h5f, p + "t");
+        auto erg = h5e::load<std::vector<float>>(h5f, p + "erg");
+        auto ioniz = h5e::load<std::vector<float>>(h5f, p + "ioniz");
+        auto phonon = h5e::load<std::vector<float>>(h5f, p + "phonon");
+        auto path = h5e::load<std::vector<float>>(h5f, p + "path");
+        auto ncoll = h5e::load<std::vector<uint32_t>>(h5f, p + "ncoll");
+        auto duid = h5e::load<std::vector<int32_t>>(h5f, p + "duid");
+        auto type = h5e::load<std::vector<uint8_t>>(h5f, p + "type");
+        auto atom = h5e::load<std::vector<uint8_t>>(h5f, p + "atom");
+        auto gen = h5e::load<std::vector<uint8_t>>(h5f, p + "gen");
+
+        for (auto &b : bins_)
+            b.clear();
+        for (size_t i = 0; i < key.size(); ++i) {
+            if (key[i] < 0 || size_t(key[i]) >= bins_.size())
+                continue;
+            auto &b = bins_[key[i]];
+            if (b.size() >= n_)
+                continue;
+            auto f = std::make_shared<footprint>();
+            f->E = E[i];
+            for (size_t j = offset[i]; j < offset[i + 1]; ++j) {
+                record r;
+                std::copy(&x[3 * j], &x[3 * j] + 3, r.x);
+                r.t = t[j];
+                r.erg = erg[j];
+                r.ioniz = ioniz[j];
+                r.phonon = phonon[j];
+                r.path = path[j];
+                r.ncoll = ncoll[j];
+                r.duid = duid[j];
+                r.type = type[j];
+                r.atom = atom[j];
+                r.gen = gen[j];
+                r.reserved = 0;
+                f->rec.push_back(r);
+            }
+            b.push_back(f);
+        }
+    } catch (h5::Exception &e) {
+        if (os)
+            (*os) << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
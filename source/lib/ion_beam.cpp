@@ -2,6 +2,12 @@
 #include "random_vars.h"
 #include "ion.h"
 #include "target.h"
+#include "event_reader.h"
+
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
 
 ion_beam::ion_beam() : par_() { }
 
@@ -17,6 +23,11 @@ void ion_beam::init(target &t, bool is_cascade_sim)
 
     par_.energy_distribution.init();
     par_.spatial_distribution.init(t);
+
+    species_atoms_.clear();
+    if (par_.energy_distribution.type == Tabulated)
+        for (int id : par_.energy_distribution.species)
+            species_atoms_.push_back(t.atoms()[id]);
     par_.angular_distribution.init(t);
 }
 
@@ -28,13 +39,33 @@ void ion_beam::source_ion(random_vars &g, const target &t, ion &i)
     par_.spatial_distribution.sample(g, t, v);
     i.setPos(v);
 
-    if (is_pka_source_) {
+    float E;
+    const atom *a = nullptr;
+    if (par_.energy_distribution.type == Tabulated) {
+        int sp;
+        E = par_.energy_distribution.sample(g, i.ion_id(), sp);
+        if (is_pka_source_ && !species_atoms_.empty()) {
+            // resample the position until it falls in the material of the species
+            a = species_atoms_[sp];
+            for (int k = 0; k < 1000 && t.cell(i.cellid()) != a->mat(); k++) {
+                par_.spatial_distribution.sample(g, t, v);
+                i.setPos(v);
+            }
+            if (t.cell(i.cellid()) != a->mat())
+                a = nullptr;
+        }
+    } else
+        E = par_.energy_distribution.sample(g);
+
+    if (a)
+        i.setAtom(a);
+    else if (is_pka_source_) {
         const material *mat = t.cell(i.cellid());
         i.setAtom(mat->selectAtom(g));
     } else
         i.setAtom(t.atoms().front());
 
-    i.setErg(par_.energy_distribution.sample(g));
+    i.setErg(E);
 
     par_.angular_distribution.sample(g, t, v);
     i.setNormalizedDir(v);
@@ -42,6 +73,55 @@ void ion_beam::source_ion(random_vars &g, const target &t, ion &i)
     i.setTime(0.0);
 }
 
+int ion_beam::source_ion(random_vars &g, const target &t, ion &i, phase_space_reader &ps)
+{
+    i.setGrid(&t.grid());
+
+    const phase_space_t &P = par_.phase_space;
+    const spatial_distribution_t &S = par_.spatial_distribution;
+    const box3D &box = t.grid().box();
+    phase_space_reader::record r;
+    bool reused;
+    size_t n = ps.partitionSize();
+    for (size_t k = 0; k < n; k++) {
+        if (!ps.next(r, reused))
+            return -1;
+        if (r.species != P.species || !(r.erg > 0.f))
+            continue;
+
+        r.pos += P.offset;
+        if (S.geometry == Surface) {
+            if (!(r.dir.x() > 0.f))
+                continue;
+            r.pos.x() = t.grid().x().front();
+        }
+
+        // random rotation about the x-axis through the beam center
+        if (reused && P.rotate) {
+            float c, s;
+            g.random_azimuth_dir(c, s);
+            float y = r.pos.y() - S.center.y(), z = r.pos.z() - S.center.z();
+            r.pos.y() = S.center.y() + c * y - s * z;
+            r.pos.z() = S.center.z() + s * y + c * z;
+            y = r.dir.y(), z = r.dir.z();
+            r.dir.y() = c * y - s * z;
+            r.dir.z() = s * y + c * z;
+        }
+
+        if (!box.contains(r.pos))
+            continue;
+
+        i.setPos(r.pos);
+        i.setAtom(t.atoms().front());
+        i.setErg(r.erg);
+        i.setNormalizedDir(r.dir.normalized());
+        i.setWeight(i.weight() * r.w);
+        i.setTime(0.0);
+        return 0;
+    }
+    return -1;
+}
+
 float ion_beam::energy_distribution_t::sample(random_vars &r) const
 {
     float e;
@@ -55,6 +135,10 @@ float ion_beam::energy_distribution_t::sample(random_vars &r) const
             e = center + r.normal() * a;
         } while (e <= 0.f);
         return e;
+    case Tabulated: {
+        int sp;
+        return sample(r, 0, sp);
+    }
     default:
         assert(0);
         break;
@@ -62,6 +146,27 @@ float ion_beam::energy_distribution_t::sample(random_vars &r) const
     return 0;
 }
 
+float ion_beam::energy_distribution_t::sample(random_vars &r, size_t hid, int &sp) const
+{
+    sp = 0;
+    if (type != Tabulated)
+        return sample(r);
+    if (alias_prob_.empty())
+        return center;
+
+    // select a (species, bin) cell with the alias method
+    int n = alias_prob_.size();
+    double u = (stratified ? radical_inverse2(hid) : r.u01d()) * n;
+    int k = std::min(int(u), n - 1);
+    if (u - k >= alias_prob_[k])
+        k = alias_idx_[k];
+
+    int nbins = energy_bins.size() - 1;
+    sp = k / nbins;
+    k = k % nbins;
+    return energy_bins[k] + (energy_bins[k + 1] - energy_bins[k]) * r.u01s();
+}
+
 void ion_beam::energy_distribution_t::init()
 {
     switch (type) {
@@ -74,12 +179,102 @@ void ion_beam::energy_distribution_t::init()
         break;
     case SingleValue:
         break;
+    case Tabulated: {
+        if (!file.empty())
+            read_spectrum(file, energy_bins, weights);
+
+        // Vose's method for the alias table
+        alias_prob_.clear();
+        alias_idx_.clear();
+        int n = weights.size();
+        double sum = 0;
+        for (float w : weights)
+            sum += w;
+        if (n == 0 || energy_bins.size() < 2 || sum <= 0)
+            break;
+        std::vector<double> p(n);
+        std::vector<int> small, large;
+        for (int i = 0; i < n; i++) {
+            p[i] = weights[i] * n / sum;
+            if (p[i] < 1.0)
+                small.push_back(i);
+            else
+                large.push_back(i);
+        }
+        alias_prob_.assign(n, 1.f);
+        alias_idx_.resize(n);
+        for (int i = 0; i < n; i++)
+            alias_idx_[i] = i;
+        while (!small.empty() && !large.empty()) {
+            int l = small.back();
+            small.pop_back();
+            int g = large.back();
+            alias_prob_[l] = p[l];
+            alias_idx_[l] = g;
+            p[g] -= 1.0 - p[l];
+            if (p[g] < 1.0) {
+                large.pop_back();
+                small.push_back(g);
+            }
+        }
+        // remaining cells (round-off) keep probability 1
+
+        // mean energy of the spectrum, used for reporting
+        double Em = 0;
+        int nbins = energy_bins.size() - 1;
+        for (int i = 0; i < n; i++) {
+            int k = i % nbins;
+            Em += weights[i] * 0.5 * (energy_bins[k] + energy_bins[k + 1]);
+        }
+        center = Em / sum;
+    } break;
     default:
         assert(0);
         break;
     }
 }
 
+int ion_beam::energy_distribution_t::read_spectrum(const std::string &fname,
+                                                   std::vector<float> &bins, std::vector<float> &w)
+{
+    std::ifstream is(fname);
+    if (!is.is_open())
+        return -1;
+
+    // rows of the file: E_lo E_hi w1 [w2 ...]
+    std::vector<std::vector<float>> rows;
+    std::string line;
+    while (std::getline(is, line)) {
+        size_t p = line.find_first_not_of(" \t\r");
+        if (p == std::string::npos || line[p] == '#')
+            continue;
+        std::istringstream ss(line);
+        std::vector<float> row;
+        float x;
+        while (ss >> x)
+            row.push_back(x);
+        if (row.size() < 3 || (!rows.empty() && row.size() != rows.front().size()))
+            return -1;
+        if (!rows.empty() && row[0] != rows.back()[1])
+            return -1; // bins must be contiguous
+        rows.push_back(row);
+    }
+    if (rows.empty())
+        return -1;
+
+    int nbins = rows.size();
+    int nsp = rows.front().size() - 2;
+    bins.resize(nbins + 1);
+    w.resize(nbins * nsp);
+    for (int k = 0; k < nbins; k++) {
+        bins[k] = rows[k][0];
+        for (int s = 0; s < nsp; s++)
+            w[s * nbins + k] = rows[k][s + 2];
+    }
+    bins[nbins] = rows.back()[1];
+    return 0;
+}
+
 void ion_beam::spatial_distribution_t::sample(random_vars &g, const target &t, vector3 &pos) const
 {
     switch (geometry) {
@@ -244,3 +439,200 @@ void ion_beam::angular_distribution_t::init(const target &t)
         cs.xzvector = { 0, 0, 1 };
     cs.init();
 }
+
+/*
+ * phase_space_reader implementation
+ */
+
+struct phase_space_reader::impl
+{
+    // HDF5 exit events
+    event_reader h5;
+    long ofIid{ -1 }, ofE{ -1 }, ofW{ -1 };
+    long ofX[3] = { -1, -1, -1 }, ofN[3] = { -1, -1, -1 };
+
+    // binary file
+    std::ifstream bin;
+
+    size_t rows{ 0 }, rsize{ 0 };
+
+    // partition & position
+    size_t first{ 0 }, last{ 0 }, recycle{ 1 }, use{ 0 };
+
+    // read buffer
+    std::vector<char> buff;
+    size_t buff_rows{ 4096 }, buff_first{ 0 }, buff_n{ 0 };
+
+    ~impl()
+    {
+        std::lock_guard<std::mutex> lock(h5_mutex());
+        h5.close();
+    }
+
+    const char *fetch(size_t row);
+    void decode(const char *p, record &r) const;
+};
+
+const char *phase_space_reader::impl::fetch(size_t row)
+{
+    if (row < buff_first || row >= buff_first + buff_n) {
+        size_t n = std::min(buff_rows, last - row);
+        buff.resize(n * rsize);
+        if (h5.is_open()) {
+            std::lock_guard<std::mutex> lock(h5_mutex());
+            buff_n = h5.read(row, n, buff.data());
+        } else {
+            bin.clear();
+            bin.seekg(row * rsize);
+            bin.read(buff.data(), n * rsize);
+            buff_n = bin.gcount() / rsize;
+        }
+        buff_first = row;
+        if (row >= buff_first + buff_n)
+            return nullptr;
+    }
+    return buff.data() + (row - buff_first) * rsize;
+}
+
+void phase_space_reader::impl::decode(const char *p, record &r) const
+{
+    auto f = [p](long of) {
+        float x;
+        std::memcpy(&x, p + of, sizeof(x));
+        return x;
+    };
+    if (h5.is_open()) {
+        int32_t id;
+        std::memcpy(&id, p + ofIid, sizeof(id));
+        r.species = id;
+        r.erg = f(ofE);
+        for (int k = 0; k < 3; k++) {
+            r.pos[k] = f(ofX[k]);
+            r.dir[k] = f(ofN[k]);
+        }
+        r.w = ofW < 0 ? 1.f : f(ofW);
+    } else {
+        int32_t id;
+        std::memcpy(&id, p, sizeof(id));
+        r.species = id;
+        r.erg = f(4);
+        for (int k = 0; k < 3; k++) {
+            r.pos[k] = f(8 + 4 * k);
+            r.dir[k] = f(20 + 4 * k);
+        }
+        r.w = f(32);
+    }
+}
+
+phase_space_reader::phase_space_reader() { }
+phase_space_reader::~phase_space_reader() { }
+
+int phase_space_reader::open(const std::string &fname, std::ostream *os)
+{
+    d_.reset();
+    auto d = std::make_unique<impl>();
+
+    // check the HDF5 signature
+    char sig[8] = { 0 };
+    {
+        std::ifstream is(fname, std::ios::binary);
+        if (!is.is_open()) {
+            if (os)
+                (*os) << "Cannot open phase-space file " << fname << std::endl;
+            return -1;
+        }
+        is.read(sig, 8);
+    }
+
+    if (std::memcmp(sig, "\x89HDF\r\n\x1a\n", 8) == 0) {
+        int ret;
+        {
+            std::lock_guard<std::mutex> lock(h5_mutex());
+            ret = d->h5.open(fname, "exit", os);
+        }
+        if (ret)
+            return -1;
+        auto of = [&d](const char *name) {
+            int c = d->h5.column(name);
+            return c < 0 ? -1L : long(d->h5.layout()[c].offset);
+        };
+        d->ofIid = of("iid");
+        d->ofE = of("E");
+        d->ofW = of("w");
+        const char *x[] = { "x", "y", "z" }, *n[] = { "nx", "ny", "nz" };
+        for (int k = 0; k < 3; k++) {
+            d->ofX[k] = of(x[k]);
+            d->ofN[k] = of(n[k]);
+        }
+        if (d->ofIid < 0 || d->ofE < 0 || d->ofX[0] < 0 || d->ofX[1] < 0 || d->ofX[2] < 0
+            || d->ofN[0] < 0 || d->ofN[1] < 0 || d->ofN[2] < 0) {
+            if (os)
+                (*os) << "Missing exit event columns in " << fname << std::endl;
+            return -1;
+        }
+        d->rows = d->h5.rows();
+        d->rsize = d->h5.record_size();
+    } else {
+        d->bin.open(fname, std::ios::binary | std::ios::ate);
+        size_t sz = d->bin.tellg();
+        if (!d->bin.is_open() || sz % binary_record_size) {
+            if (os)
+                (*os) << "Invalid binary phase-space file " << fname << std::endl;
+            return -1;
+        }
+        d->rsize = binary_record_size;
+        d->rows = sz / binary_record_size;
+    }
+    d->last = d->rows;
+    d_ = std::move(d);
+    return 0;
+}
+
+size_t phase_space_reader::rows() const
+{
+    return d_ ? d_->rows : 0;
+}
+
+void phase_space_reader::setPartition(size_t first, size_t last, size_t recycle,
+                                      size_t buffer_size, size_t start)
+{
+    if (!d_)
+        return;
+    d_->first = std::min(first, d_->rows);
+    d_->last = std::min(std::max(last, d_->first), d_->rows);
+    d_->recycle = std::max(recycle, size_t(1));
+    d_->buff_rows = std::max(buffer_size, size_t(1));
+    d_->use = start;
+    d_->buff_n = 0;
+}
+
+size_t phase_space_reader::partitionSize() const
+{
+    return d_ ? (d_->last - d_->first) * d_->recycle : 0;
+}
+
+size_t phase_space_reader::position() const
+{
+    return d_ ? d_->use : 0;
+}
+
+void phase_space_reader::setPosition(size_t pos)
+{
+    if (d_)
+        d_->use = pos;
+}
+
+bool phase_space_reader::next(record &r, bool &reused)
+{
+    size_t n = d_ ? d_->last - d_->first : 0;
+    if (!n)
+        return false;
+    size_t k = d_->use / d_->recycle;
+    reused = (d_->use % d_->recycle) || k >= n;
+    d_->use++;
+    const char *p = d_->fetch(d_->first + k % n);
+    if (!p)
+        return false;
+    d_->decode(p, r);
+    return true;
+}
@@ -4,14 +4,19 @@
 #include "scattering.h"
 #include "cascade.h"
 
+#include <limits>
+#include <numeric>
+
 mccore::mccore()
     : source_(new ion_beam),
       target_(new target),
+      prec_(3),
       ref_count_(new int(0)),
       ion_counter_(new std::atomic_size_t(0)),
       abort_flag_(new std::atomic_bool()),
       thread_ion_counter_(0),
-      tally_mutex_(new std::mutex)
+      tally_mutex_(new std::mutex),
+      pause_(new pause_ctrl_t)
 {
 }
 
@@ -20,11 +25,13 @@ mccore::mccore(const parameters &p, const transport_options &t)
       tr_opt_(t),
       source_(new ion_beam),
       target_(new target),
+      prec_(3),
       ref_count_(new int(0)),
       ion_counter_(new std::atomic_size_t(0)),
       abort_flag_(new std::atomic_bool()),
       thread_ion_counter_(0),
-      tally_mutex_(new std::mutex)
+      tally_mutex_(new std::mutex),
+      pause_(new pause_ctrl_t)
 {
 }
 
@@ -36,16 +43,28 @@ mccore::mccore(const mccore &s)
       tally_(s.tally_),
       dtally_(s.dtally_),
       tion_(s.tion_),
+      prec_(3),
+      prec_tid_(s.prec_tid_),
+      prec_ut_(s.prec_ut_),
+      prec_bin_(s.prec_bin_),
       ref_count_(s.ref_count_),
       ion_counter_(s.ion_counter_),
       abort_flag_(s.abort_flag_),
       thread_ion_counter_(0),
       tally_mutex_(s.tally_mutex_),
+      pause_(s.pause_),
       dedx_calc_(s.dedx_calc_),
       flight_path_calc_(s.flight_path_calc_),
+      importance_(s.importance_),
+      ww_lower_(s.ww_lower_),
+      forced_ip_(s.forced_ip_),
+      library_(s.library_),
       scattering_matrix_(s.scattering_matrix_),
       rng(s.rng),
-      pka(s.pka)
+      pka(s.pka),
+      exit_ev(s.exit_ev),
+      damage_ev(s.damage_ev),
+      cluster_ev(s.cluster_ev)
 {
     tally_.clear();
     dtally_.clear();
@@ -171,7 +190,84 @@ int mccore::init()
     // prepare event buffers
     std::vector<std::string> atom_labels = target_->atom_labels();
     atom_labels.erase(atom_labels.begin());
-    pka.setNatoms(natoms - 1, atom_labels);
+    pka.setNatoms(natoms - 1, atom_labels, par_.cluster_analysis);
+
+    /*
+     * Cell importance map for splitting & Russian roulette
+     *  = depth zone importance x region importance
+     */
+    importance_.clear();
+    if (par_.simulation_type != CascadesOnly
+        && (!tr_opt_.importance_values.empty() || !tr_opt_.importance_regions.empty())) {
+        const grid3D &g = target_->grid();
+        const std::vector<target::region> &regions = target_->regions();
+        const std::vector<float> &zx = tr_opt_.importance_planes;
+        size_t nreg = std::min(regions.size(), tr_opt_.importance_regions.size());
+        importance_.assign(ncells, 1.f);
+        for (int ix = 0; ix < dim[0]; ++ix)
+            for (int iy = 0; iy < dim[1]; ++iy)
+                for (int iz = 0; iz < dim[2]; ++iz) {
+                    vector3 c(0.5f * (g.x()[ix] + g.x()[ix + 1]),
+                              0.5f * (g.y()[iy] + g.y()[iy + 1]),
+                              0.5f * (g.z()[iz] + g.z()[iz + 1]));
+                    float I = 1.f;
+                    if (!tr_opt_.importance_values.empty())
+                        I = tr_opt_.importance_values[std::upper_bound(zx.begin(), zx.end(),
+                                                                       c.x())
+                                                      - zx.begin()];
+                    // the last region containing the cell center defines the cell
+                    float Ir = 1.f;
+                    for (size_t r = 0; r < nreg; ++r) {
+                        vector3 x0 = regions[r].origin, x1 = x0 + regions[r].size;
+                        if ((c.array() >= x0.array()).all() && (c.array() < x1.array()).all())
+                            Ir = tr_opt_.importance_regions[r];
+                    }
+                    importance_[g.cellid(ivector3(ix, iy, iz))] = I * Ir;
+                }
+        // all importances equal = no variance reduction
+        if (std::all_of(importance_.begin(), importance_.end(),
+                        [this](float I) { return I == importance_[0]; }))
+            importance_.clear();
+    }
+
+    /*
+     * Forced PKA production tables
+     * p_f(E) for the beam ion on each target atom
+     */
+    forced_ip_ = ArrayNDf();
+    if (par_.simulation_type != CascadesOnly && tr_opt_.forced_pka_energy > 0.f) {
+        typedef flight_path_calc::fp_tbl_iterator fp_tbl_iterator;
+        const float &Tf = tr_opt_.forced_pka_energy;
+        forced_ip_ = ArrayNDf(natoms, flight_path_calc::fp_tbl_erange::count);
+        for (int z2 = 1; z2 < natoms; z2++) {
+            const abstract_scattering_calc *xs = scattering_matrix_(0, z2);
+            for (fp_tbl_iterator ie; ie != ie.end(); ie++) {
+                float E = *ie;
+                // T_f above the max. recoil energy -> no forced collisions
+                forced_ip_(z2, ie) = Tf < xs->gamma() * E ? xs->find_p(E, Tf) : 0.f;
+            }
+        }
+    }
+
+    // cascade library
+    library_.reset();
+    if (par_.simulation_type != IonsOnly && par_.cascade_library_size)
+        library_ = std::make_shared<cascade_library>(natoms, nmat, par_.cascade_library_size,
+                                                     par_.cascade_library_bins,
+                                                     cascade_config_hash_());
+
+    // weight window
+    ww_lower_.clear();
+    if (par_.simulation_type != CascadesOnly && tr_opt_.weight_window.size() == size_t(ncells))
+        ww_lower_ = tr_opt_.weight_window;
+
+    // events carry the statistical weight
+    if (weighted()) {
+        pka.addWeightColumn();
+        exit_ev.addWeightColumn();
+        damage_ev.addWeightColumn();
+        cluster_ev.addWeightColumn();
+    }
 
     return 0;
 }
@@ -191,17 +287,37 @@ void mccore::arm(size_t N, size_t id1, size_t id_stride)
     *abort_flag_ = false;
 }
 
+abstract_cascade *mccore::new_cascade_() const
+{
+    if (!par_.intra_cascade_recombination)
+        return nullptr;
+    // largest recombination radius sets the size of the cascade cell list
+    float rc_max = 0.f;
+    for (const atom *a : target_->atoms())
+        rc_max = std::max(rc_max, a->Rc());
+    return par_.time_ordered_cascades
+            ? (abstract_cascade *)(new time_ordered_cascade(target_->grid(), rc_max))
+            : (abstract_cascade *)(new unordered_cascade(target_->grid(), rc_max));
+}
+
 int mccore::run()
 {
-    abstract_cascade *cscd = nullptr;
-    if (par_.intra_cascade_recombination) {
-        cscd = par_.time_ordered_cascades
-                ? (abstract_cascade *)(new time_ordered_cascade(target_->grid()))
-                : (abstract_cascade *)(new unordered_cascade(target_->grid()));
-    }
+    // cascade stage of a pipelined simulation
+    if (pipeline_ && cascade_stage_)
+        return run_cascades_();
+
+    abstract_cascade *cscd = new_cascade_();
+
+    defect_clusters *clusters = par_.cluster_analysis
+            ? new defect_clusters(target_->grid(), par_.cluster_radius)
+            : nullptr;
+
+    ion_queue_.setRecoilOrder(par_.recoil_order);
 
     bool cascadesOnly = par_.simulation_type == CascadesOnly;
 
+    enter_run_();
+
     while (!(*abort_flag_) && thread_ion_counter_ < thread_max_no_ions_) {
 
         // get the ion id = 1-based index
@@ -220,8 +336,19 @@ int mccore::run()
         ion *i = ion_queue_.create_ion();
         i->setId(ion_id);
         i->setRecoilId(cascadesOnly ? 1 : 0);
+        i->setWeight(1.0);
         i->reset_counters();
-        source_->source_ion(rng, *target_, *i);
+        if (!phase_space_)
+            source_->source_ion(rng, *target_, *i);
+        else if (source_->source_ion(rng, *target_, *i, *phase_space_) != 0) {
+            // no more valid records: undo the history & stop
+            ion_queue_.free_ion(i);
+            next_ion_id_ -= ion_id_stride_;
+            thread_ion_counter_--;
+            (*ion_counter_)--;
+            abort();
+            break;
+        }
         tion_(Event::NewSourceIon, *i);
 
         /*
@@ -246,107 +373,563 @@ int mccore::run()
                 ion_queue_.free_ion(i);
         } else {
             transport(i);
+            // transport the copies of split ions
+            while (ion *j = ion_queue_.pop_split())
+                transport(j);
         }
 
-        // transport all PKAs
-        while (ion *j = ion_queue_.pop_pka()) {
+        if (pipeline_ && pipeline_->is_open()) {
+            // pass the PKAs & the ion scores to the cascade stage,
+            // which completes the history
+            pka_pipeline::job job;
+            job.hid = ion_id;
+            while (ion *j = ion_queue_.pop_pka()) {
+                job.pkas.push_back(*j);
+                ion_queue_.free_ion(j);
+            }
+            job.tion.copy(tion_);
+            tion_.clear();
+            for (int k = 0; k < ution_.size(); ++k) {
+                job.ution.push_back(*(ution_[k]));
+                ution_[k]->clear();
+            }
+            pipeline_->push(std::move(job));
+        } else {
+            process_pkas_(cscd, clusters);
 
-            // zero-out the pka buffer
-            pka.init(j);
+            // add this ion's tally to total score
+            score_history_();
+        }
 
-            // keep a copy of the ion to have initial position
-            ion j1(*j);
+        // stop here if a pause was requested
+        if (pause_->requested)
+            wait_if_paused_();
 
-            // FullCascade or CascadesOnly
-            if (par_.simulation_type != IonsOnly) {
+    } // ion loop
 
-                // reset this to get total ionization in the cascade
-                tion_.resetIonizationCounter();
+    // the cascade stage should not wait for the rest of our ids
+    if (pipeline_)
+        pipeline_->leave(next_ion_id_);
 
-                // create a vacancy at pka position
-                // and store a copy in the vacancy queue
-                ion *v = ion_queue_.clone_ion(*j);
-                // Only for the PKA vacancy use pos0()
-                // to take into account "move_recoil" option
-                v->setPos(v->pos0());
-                ion_queue_.push_vacancy(v);
+    leave_run_();
 
-                // transport the PKA
-                transport(j);
+    if (cscd)
+        delete cscd;
+    if (clusters)
+        delete clusters;
 
-                // transport all secondary recoils
-                while (ion *k = ion_queue_.pop_recoil())
-                    transport(k);
-
-                // optional cascade recombination
-                if (cscd)
-                    cscd->intra_cascade_recombination(ion_queue_);
-
-                // process PKA cascade events
-                {
-                    float *p = &pka.Impl(0);
-                    while (ion *k = ion_queue_.pop_interstitial()) {
-                        handle_event(Event::IonStop, *k);
-                        p[k->myAtom()->id() - 1]++;
-                        ion_queue_.free_ion(k);
-                    }
-                    p = &pka.Vac(0);
-                    while (ion *k = ion_queue_.pop_vacancy()) {
-                        handle_event(Event::Vacancy, *k);
-                        p[k->myAtom()->id() - 1]++;
-                        ion_queue_.free_ion(k);
-                    }
-                }
+    return 0;
+}
 
-                // calc Tdam = Er - Eioniz
-                pka.Tdam() = pka.recoilE() - tion_.ionizationCounter();
+void mccore::process_pkas_(abstract_cascade *cscd, defect_clusters *clusters)
+{
+    while (ion *j = ion_queue_.pop_pka()) {
 
-                // count recombinations into pka
-                // clear optional cascade buffers
-                if (cscd) {
-                    cscd->count_riv(&pka.Icr(0), &pka.Icr_corr(0));
-                    cscd->clear(ion_queue_);
-                }
+        // zero-out the pka buffer
+        pka.init(j);
+
+        // keep a copy of the ion to have initial position
+        ion j1(*j);
+
+        // FullCascade or CascadesOnly
+        if (par_.simulation_type != IonsOnly) {
 
-            } // end cascade
+            // reset this to get total ionization in the cascade
+            tion_.resetIonizationCounter();
 
-            // Calc NRT values (using j1 - at initial pos!)
-            pka.calc_nrt(
-                    j1, par_.nrt_calculation == NRT_average ? target_->cell(j1.cellid()) : nullptr);
+            // simulate or replay the cascade
+            cascade_(j);
 
-            // CascadeComplete event
-            handle_event(Event::CascadeComplete, j1, &pka);
+            // optional cascade recombination
+            if (cscd)
+                cscd->intra_cascade_recombination(ion_queue_);
 
-        } // end pka loop
+            // optional cluster analysis of surviving defects
+            if (clusters)
+                analyze_clusters(*clusters);
+
+            // process PKA cascade events
+            {
+                float *p = &pka.Impl(0);
+                for (const defect &d : ion_queue_.interstitials()) {
+                    ion *src = ion_queue_.info(d).src;
+                    handle_event(Event::IonStop, *src);
+                    p[d.myAtom()->id() - 1]++;
+                    ion_queue_.free_ion(src);
+                }
+                p = &pka.Vac(0);
+                for (const defect &d : ion_queue_.vacancies()) {
+                    handle_event(Event::Vacancy, d, ion_queue_.info(d));
+                    p[d.myAtom()->id() - 1]++;
+                }
+            }
 
-        // compute total sums for current ion tally
-        tion_.computeSums();
+            // calc Tdam = Er - Eioniz
+            pka.Tdam() = pka.recoilE() - tion_.ionizationCounter();
 
-        // add this ion's tally to total score
-        // lock the tally_mutex to allow merge operations
-        {
-            std::lock_guard<std::mutex> lock(*tally_mutex_);
-            tally_ += tion_;
-            dtally_.addSquared(tion_);
-            for (int i = 0; i < utally_.size(); ++i) {
-                *(utally_[i]) += *(ution_[i]);
-                dutally_[i]->addSquared(*(ution_[i]));
+            // count recombinations into pka
+            // clear optional cascade buffers
+            if (cscd) {
+                cscd->count_riv(&pka.Icr(0), &pka.Icr_corr(0));
+                cscd->clear(ion_queue_);
             }
+            ion_queue_.clear_defects();
+
+        } // end cascade
+
+        // Calc NRT values (using j1 - at initial pos!)
+        pka.calc_nrt(
+                j1, par_.nrt_calculation == NRT_average ? target_->cell(j1.cellid()) : nullptr);
+
+        // CascadeComplete event
+        handle_event(Event::CascadeComplete, j1, &pka);
+
+    } // end pka loop
+}
+
+void mccore::score_history_()
+{
+    // compute total sums for current ion tally
+    tion_.computeSums();
+
+    // total of the precision quantity in this history
+    double x = 0;
+    if (prec_tid_ > 0) {
+        const ArrayNDd &T = tion_.at(0);
+        for (int iid = 0; iid < int(T.dim()[1]); iid++)
+            if (prec_bin_ < 0 || prec_bin_ == iid)
+                x += T(prec_tid_, iid);
+    } else if (prec_ut_ >= 0) {
+        const ArrayNDd &U = ution_[prec_ut_]->data();
+        if (prec_bin_ < 0)
+            x = std::accumulate(U.data(), U.data() + U.size(), 0.0);
+        else if (prec_bin_ < int(U.size()))
+            x = U[prec_bin_];
+    }
+
+    // add this ion's tally to total score
+    // lock the tally_mutex to allow merge operations
+    {
+        std::lock_guard<std::mutex> lock(*tally_mutex_);
+        tally_ += tion_;
+        dtally_.addSquared(tion_);
+        prec_[0] += 1;
+        prec_[1] += x;
+        prec_[2] += x * x;
+        for (int i = 0; i < utally_.size(); ++i) {
+            *(utally_[i]) += *(ution_[i]);
+            dutally_[i]->addSquared(*(ution_[i]));
         }
+    }
 
-        // clear the tally scores
-        tion_.clear();
-        for (int i = 0; i < utally_.size(); ++i)
-            ution_[i]->clear();
+    // clear the tally scores
+    tion_.clear();
+    for (int i = 0; i < utally_.size(); ++i)
+        ution_[i]->clear();
+}
 
-    } // ion loop
+int mccore::run_cascades_()
+{
+    abstract_cascade *cscd = new_cascade_();
+
+    defect_clusters *clusters = par_.cluster_analysis
+            ? new defect_clusters(target_->grid(), par_.cluster_radius)
+            : nullptr;
+
+    ion_queue_.setRecoilOrder(par_.recoil_order);
+
+    // process the PKAs of each ion history, until the ion stage closes the pipeline
+    pka_pipeline::job job;
+    while (pipeline_->pop(job)) {
+        tion_ += job.tion;
+        for (int k = 0; k < ution_.size() && k < job.ution.size(); ++k)
+            *(ution_[k]) += job.ution[k];
+        for (const ion &p : job.pkas)
+            ion_queue_.push_pka(ion_queue_.clone_ion(p));
+        process_pkas_(cscd, clusters);
+        score_history_();
+    }
 
     if (cscd)
         delete cscd;
+    if (clusters)
+        delete clusters;
 
     return 0;
 }
 
+pka_pipeline::pka_pipeline(size_t capacity, size_t first, size_t stride)
+    : capacity_(std::max(capacity, size_t(1))),
+      next_(first),
+      stride_(std::max(stride, size_t(1))),
+      stop_(stride_, std::numeric_limits<size_t>::max())
+{
+}
+
+// skip ids that will not be pushed, up to the last waiting job
+void pka_pipeline::advance_()
+{
+    while (!q_.empty() && next_ < q_.rbegin()->first && q_.count(next_) == 0
+           && next_ >= stop_[next_ % stride_])
+        next_++;
+}
+
+void pka_pipeline::push(job &&j)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    // the next job is always accepted, otherwise the queue could stall
+    size_t hid = j.hid;
+    not_full_.wait(lock, [this, hid] { return q_.size() < capacity_ || hid == next_ || closed_; });
+    q_[hid] = std::move(j);
+    advance_();
+    not_empty_.notify_all();
+}
+
+bool pka_pipeline::pop(job &j)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    not_empty_.wait(lock, [this] { return (!q_.empty() && q_.begin()->first == next_) || closed_; });
+    if (q_.empty())
+        return false;
+    auto it = q_.begin();
+    j = std::move(it->second);
+    next_ = it->first + 1;
+    q_.erase(it);
+    advance_();
+    not_full_.notify_all();
+    not_empty_.notify_all();
+    return true;
+}
+
+void pka_pipeline::leave(size_t next_id)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    stop_[next_id % stride_] = next_id;
+    advance_();
+    not_full_.notify_all();
+    not_empty_.notify_all();
+}
+
+void pka_pipeline::close()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    closed_ = true;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+}
+
+bool pka_pipeline::is_open() const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return !closed_;
+}
+
+void mccore::enter_run_()
+{
+    std::unique_lock<std::mutex> lock(pause_->mtx);
+    pause_->active++;
+    pause_->cv.notify_all();
+    lock.unlock();
+    // do not start while paused
+    wait_if_paused_();
+}
+
+void mccore::leave_run_()
+{
+    std::lock_guard<std::mutex> lock(pause_->mtx);
+    pause_->active--;
+    pause_->cv.notify_all();
+}
+
+void mccore::wait_if_paused_()
+{
+    std::unique_lock<std::mutex> lock(pause_->mtx);
+    if (!pause_->requested)
+        return;
+    pause_->paused++;
+    pause_->cv.notify_all();
+    pause_->cv.wait(lock, [this] { return !pause_->requested; });
+    pause_->paused--;
+}
+
+void mccore::pause()
+{
+    std::unique_lock<std::mutex> lock(pause_->mtx);
+    pause_->requested = true;
+    pause_->cv.wait(lock, [this] { return pause_->paused == pause_->active; });
+}
+
+void mccore::resume()
+{
+    std::lock_guard<std::mutex> lock(pause_->mtx);
+    pause_->requested = false;
+    pause_->cv.notify_all();
+}
+
+mccore::thread_state mccore::threadState() const
+{
+    thread_state st{ rng.state(), next_ion_id_, ion_id_stride_,
+                     thread_max_no_ions_ - std::min(thread_max_no_ions_, thread_ion_counter_),
+                     phaseSpacePosition(), tallySums() };
+    for (int k = 0; k < NStreams; ++k) {
+        const event_stream &es = stream(stream_id_t(k));
+        if (es.max_rows())
+            st.reservoir[k] = es.reservoir();
+    }
+    return st;
+}
+
+void mccore::setThreadState(const thread_state &st)
+{
+    rng.state(st.rng);
+    if (phase_space_)
+        phase_space_->setPosition(st.phase_space_pos);
+    setTallySums(st.tallies);
+    for (int k = 0; k < NStreams; ++k) {
+        event_stream &es = stream(stream_id_t(k));
+        if (es.max_rows())
+            es.set_reservoir(st.reservoir[k]);
+    }
+    arm(st.ions_left, st.next_id, st.id_stride);
+}
+
+std::vector<ArrayNDd> mccore::tally_arrays_() const
+{
+    std::vector<ArrayNDd> v;
+    for (int k = 0; k < tally::std_tallies; ++k) {
+        v.push_back(tally_.at(k));
+        v.push_back(dtally_.at(k));
+    }
+    for (size_t i = 0; i < utally_.size(); ++i) {
+        v.push_back(utally_[i]->data());
+        v.push_back(dutally_[i]->data());
+    }
+    v.push_back(prec_);
+    return v;
+}
+
+std::vector<double> mccore::tallySums() const
+{
+    std::vector<double> v;
+    std::lock_guard<std::mutex> lock(*tally_mutex_);
+    for (const ArrayNDd &A : tally_arrays_())
+        if (!A.isNull())
+            v.insert(v.end(), A.data(), A.data() + A.size());
+    return v;
+}
+
+bool mccore::setTallySums(const std::vector<double> &v)
+{
+    std::lock_guard<std::mutex> lock(*tally_mutex_);
+    std::vector<ArrayNDd> arrays = tally_arrays_();
+    size_t n = 0;
+    for (const ArrayNDd &A : arrays)
+        n += A.isNull() ? 0 : A.size();
+    if (n != v.size())
+        return false;
+    const double *p = v.data();
+    for (ArrayNDd &A : arrays)
+        if (!A.isNull()) {
+            std::copy(p, p + A.size(), A.data());
+            p += A.size();
+        }
+    return true;
+}
+
+void mccore::sumTallies(const std::vector<double> &base, const std::vector<mccore *> &parts)
+{
+    // the same lock as for scoring, thus readers never see a partial sum
+    std::lock_guard<std::mutex> lock(*tally_mutex_);
+    const double *p = base.data(), *pend = p + base.size();
+    for (ArrayNDd &A : tally_arrays_())
+        if (!A.isNull() && p + A.size() <= pend) {
+            std::copy(p, p + A.size(), A.data());
+            p += A.size();
+        }
+    for (const mccore *o : parts) {
+        tally_ += o->tally_;
+        dtally_ += o->dtally_;
+        prec_ += o->prec_;
+        for (int i = 0; i < utally_.size(); ++i) {
+            *(utally_[i]) += *(o->utally_[i]);
+            *(dutally_[i]) += *(o->dutally_[i]);
+        }
+    }
+}
+
+mccore *mccore::snapshot() const
+{
+    mccore *s = new mccore(*this);
+    // detach the shared run control
+    s->ion_counter_ = std::make_shared<std::atomic_size_t>(ion_count());
+    s->abort_flag_ = std::make_shared<std::atomic_bool>(false);
+    s->tally_mutex_ = std::make_shared<std::mutex>();
+    s->pause_ = std::make_shared<pause_ctrl_t>();
+    // copy the tallies
+    s->tally_.copy(tally_);
+    s->dtally_.copy(dtally_);
+    s->prec_ = prec_.copy();
+    for (size_t i = 0; i < utally_.size(); ++i) {
+        s->utally_[i]->copy(*utally_[i]);
+        s->dutally_[i]->copy(*dutally_[i]);
+    }
+    return s;
+}
+
+void mccore::analyze_clusters(defect_clusters &c)
+{
+    const std::vector<defect> *d[] = { &ion_queue_.vacancies(), &ion_queue_.interstitials() };
+    for (int did = 0; did < 2; ++did) {
+        c.analyze(*d[did]);
+        pka.Ncl(did) = c.count();
+        pka.Ncl_def(did) = c.clustered();
+        pka.Ncl_max(did) = c.max_size();
+        if (cluster_stream_.is_open()) {
+            for (const auto &cl : c.clusters()) {
+                if (cl.n < 2)
+                    continue;
+                cluster_ev.set(pka.ionid(), did, cl.n, pka.recoilE(), cl.x);
+                cluster_ev.setWeight(pka.weight());
+                cluster_stream_.write(&cluster_ev);
+            }
+        }
+    }
+}
+
+void mccore::setWeightWindow(const std::vector<float> &wl)
+{
+    ww_lower_ = wl;
+    tr_opt_.weight_window = wl;
+    if (weighted()) {
+        pka.addWeightColumn();
+        exit_ev.addWeightColumn();
+        damage_ev.addWeightColumn();
+        cluster_ev.addWeightColumn();
+    }
+}
+
+std::vector<float> mccore::generateWeightWindow(weight_window_quantity_t q) const
+{
+    const grid3D &g = target_->grid();
+    int ncells = g.ncells();
+    const ArrayNDd &A = tally_.at(q == WWDamage ? tally::dpVnrt : tally::isFlightPath);
+    // beam ion flux from the projectile row only, damage from all atoms
+    size_t natoms = q == WWDamage ? A.dim()[0] : 1;
+
+    std::vector<double> phi(ncells, 0.0);
+    for (size_t iid = 0; iid < natoms; ++iid) {
+        const double *p = A.data() + iid * ncells;
+        for (int k = 0; k < ncells; ++k)
+            phi[k] += p[k];
+    }
+
+    // density = score / cell volume
+    double phimax = 0.0, phimin = std::numeric_limits<double>::max();
+    for (int ix = 0; ix < g.x().size() - 1; ++ix)
+        for (int iy = 0; iy < g.y().size() - 1; ++iy)
+            for (int iz = 0; iz < g.z().size() - 1; ++iz) {
+                double V = double(g.x()[ix + 1] - g.x()[ix]) * (g.y()[iy + 1] - g.y()[iy])
+                        * (g.z()[iz + 1] - g.z()[iz]);
+                double &f = phi[g.cellid(ivector3(ix, iy, iz))];
+                f /= V;
+                if (f > 0.0) {
+                    phimax = std::max(phimax, f);
+                    phimin = std::min(phimin, f);
+                }
+            }
+    if (phimax <= 0.0)
+        return {};
+
+    double c = 2.0 / (1.0 + tr_opt_.weight_window_ratio) / phimax;
+    std::vector<float> wl(ncells);
+    for (int k = 0; k < ncells; ++k)
+        wl[k] = c * (phi[k] > 0.0 ? phi[k] : phimin);
+    return wl;
+}
+
+bool mccore::force_pka(ion *i, const atom *z2, const abstract_scattering_calc *xs, float ip)
+{
+    // the weight must use the pmax with which the analog ip was sampled,
+    // i.e., at the ion energy before ionization losses along the flight path
+    float pm = flight_path_calc_.sampled_ipmax();
+    int ie = flight_path_calc::fp_tbl_iterator(flight_path_calc_.sampled_erg());
+    float pf = std::min(forced_ip_(z2->id(), ie), pm);
+    float E = i->erg();
+    if (!(pf > 0.f))
+        return false;
+
+    // forced collision, p^2 uniform in [0, pf^2]
+    float T, sintheta, costheta, nx, ny;
+    xs->scatter(E, pf * std::sqrt(rng.u01s_lopen()), T, sintheta, costheta);
+    if (T >= z2->Ed()) {
+        // recoil dir from momentum conservation with the virtually deflected ion
+        rng.random_azimuth_dir(nx, ny);
+        vector3 d = i->dir();
+        deflect_vector(d, vector3(nx * sintheta, ny * sintheta, costheta));
+        float b = std::max(E - T, 0.f) / T;
+        vector3 nt = i->dir() - d * std::sqrt(b / (1.f + b));
+        nt.normalize();
+
+        ion *j = new_recoil(i, z2, T, nt);
+        j->setWeight(i->weight() * (pf / pm) * (pf / pm));
+        displace_recoil_(j, z2, T);
+    }
+
+    // the analog recoil is replaced by the forced one
+    return ip < pf;
+}
+
+void mccore::split_(ion *i, int n)
+{
+    if (n < 2)
+        return;
+    i->setWeight(i->weight() / n);
+    for (int k = 1; k < n; ++k)
+        ion_queue_.push_split(ion_queue_.clone_ion(*i));
+}
+
+bool mccore::split_or_roulette(ion *i)
+{
+    if (!ww_lower_.empty()) {
+        float wl = ww_lower_[i->cellid()];
+        if (!(wl > 0.f))
+            return true; // no window in this cell
+        double w = i->weight();
+        double wu = wl * tr_opt_.weight_window_ratio;
+        if (w > wu) {
+            split_(i, int(std::min(std::ceil(w / wu), double(tr_opt_.max_split))));
+        } else if (w < wl) {
+            // Russian roulette, survivors get the window center weight
+            double ws = 0.5 * (wl + wu);
+            if (rng.u01d() * ws >= w)
+                return false;
+            i->setWeight(ws);
+        }
+        return true;
+    }
+
+    float I0 = importance_[i->prev_cellid()];
+    float I1 = importance_[i->cellid()];
+    if (I0 == I1)
+        return true;
+
+    double r = double(I1) / I0;
+    if (r < 1.0) {
+        // Russian roulette
+        if (rng.u01d() >= r)
+            return false;
+        i->setWeight(i->weight() / r);
+        return true;
+    }
+
+    // splitting into n ions, E[n] = r
+    int n = int(r);
+    if (rng.u01d() < r - n)
+        n++;
+    split_(i, std::min(n, tr_opt_.max_split));
+    return true;
+}
+
 int mccore::transport(ion *i)
 {
     // collision flag
@@ -400,6 +983,11 @@ int mccore::transport(ion *i)
                 // register event
                 handle_event(Event::BoundaryCrossing, *i);
                 i->reset_counters();
+                // splitting / roulette of source ions
+                if (weighted() && !i->recoil_id() && !split_or_roulette(i)) {
+                    ion_queue_.free_ion(i);
+                    return 0; // killed by roulette
+                }
                 // get new material and dEdx, mfp tables
                 mat = target_->cell(i->cellid());
                 if (mat) {
@@ -431,6 +1019,11 @@ int mccore::transport(ion *i)
             // register event
             handle_event(Event::BoundaryCrossing, *i);
             i->reset_counters();
+            // splitting / roulette of source ions
+            if (weighted() && !i->recoil_id() && !split_or_roulette(i)) {
+                ion_queue_.free_ion(i);
+                return 0; // killed by roulette
+            }
             // get new material and dEdx, mfp tables
             mat = target_->cell(i->cellid());
             if (mat) {
@@ -467,6 +1060,10 @@ int mccore::transport(ion *i)
 
         // get the cross-section and calculate scattering
         auto xs = scattering_matrix_(iid, z2->id());
+
+        // forced PKA production by beam ions
+        bool suppressRecoil = !forced_ip_.isNull() && !i->recoil_id() && force_pka(i, z2, xs, ip);
+
         float T; // recoil energy
         float sintheta, costheta; // Lab sys scattering angle sin & cos
         xs->scatter(i->erg(), ip, T, sintheta, costheta);
@@ -500,6 +1097,10 @@ int mccore::transport(ion *i)
             // subtract recoil energy from the ion's kinetic energy
             i->de_recoil(T);
 
+            // a forced recoil has replaced this one
+            if (suppressRecoil)
+                continue;
+
             // calc recoil dir from momentum conservation
             float b = i->erg() / T;
             vector3 nt = dir0 - i->dir() * std::sqrt(b / (1.f + b)); // un-normalized
@@ -530,25 +1131,11 @@ int mccore::transport(ion *i)
             // a vacancy is created
             // store to the vacancy queue only if i is a recoil (recoil_id>0)
             // if i is a beam ion (recoil_id==0), the vacancy will be created with the pka
-            if (i->recoil_id()) {
-                ion *v = ion_queue_.clone_ion(*j);
-                ion_queue_.push_vacancy(v);
-            }
+            if (i->recoil_id())
+                ion_queue_.push_vacancy(*j);
 
-            // subtract El from the recoil kinetic energy,
-            // this accounts for the FP creation
-            j->de_other(z2->El());
-
-            // move recoil to the edge of recomb. area
-            // checking also for boundary crossing
-            if (par_.move_recoil) {
-                j->move(z2->Rc() * 1.001f);
-                dedx_calc_(*j, z2->Rc());
-                if (par_.recoil_sub_ed) {
-                    double de = j->erg() + z2->Ed() - T;
-                    j->de_phonon(de);
-                }
-            }
+            // FP energy & optional displacement
+            displace_recoil_(j, z2, T);
 
         } else { // T<E_d, recoil cannot be displaced
             // energy goes to phonons
@@ -560,6 +1147,258 @@ int mccore::transport(ion *i)
     return 0;
 }
 
+/*
+ * Footprint of a cascade being recorded
+ * positions & times are relative to the PKA
+ */
+struct mccore::footprint_recorder
+{
+    int key;
+    cascade_library::footprint f;
+    coord_sys cs;
+    size_t uid0;
+    double t0;
+    int gen0;
+    bool surface{ false }; // a recoil exited the target
+
+    void add(cascade_library::record_t tp, const ion &i, const vector3 &x)
+    {
+        cascade_library::record r;
+        vector3 x1 = cs.transformPoint(x);
+        r.x[0] = x1.x();
+        r.x[1] = x1.y();
+        r.x[2] = x1.z();
+        r.t = i.t() - t0;
+        r.erg = i.erg();
+        r.ioniz = i.ioniz();
+        r.phonon = i.phonon();
+        r.path = i.path();
+        r.ncoll = i.ncoll();
+        r.duid = int32_t(i.uid() - uid0);
+        r.type = tp;
+        r.atom = i.myAtom()->id();
+        r.gen = i.recoil_id() - gen0;
+        r.reserved = 0;
+        f.rec.push_back(r);
+    }
+
+    void add(const defect &d, const defect_info &c)
+    {
+        cascade_library::record r{};
+        vector3 x1 = cs.transformPoint(d.pos);
+        r.x[0] = x1.x();
+        r.x[1] = x1.y();
+        r.x[2] = x1.z();
+        r.t = d.t - t0;
+        r.erg = c.erg;
+        r.duid = int32_t(d.uid - uid0);
+        r.type = cascade_library::Vacancy;
+        r.atom = d.myAtom()->id();
+        r.gen = c.recoil_id - gen0;
+        f.rec.push_back(r);
+    }
+};
+
+void mccore::record_event_(Event ev, const ion &i)
+{
+    // energy is deposited along the path in the previous cell,
+    // it is recorded at the path midpoint
+    switch (ev) {
+    case Event::BoundaryCrossing:
+        recorder_->add(cascade_library::Deposit, i, i.pos() - float(0.5 * i.path()) * i.dir());
+        break;
+    case Event::IonExit:
+        // the footprint depends on the distance to the surface, it will not be stored
+        recorder_->surface = true;
+        break;
+    case Event::Replacement:
+        recorder_->add(cascade_library::Replacement, i, i.pos());
+        break;
+    default:
+        break;
+    }
+}
+
+void mccore::cascade_(ion *j)
+{
+    int key = -1;
+    if (library_) {
+        const material *m = target_->cell(j->cellid0());
+        if (m) {
+            key = library_->key(j->myAtom()->id(), m->id(), j->erg());
+            cascade_library::footprint_ptr f = library_->pick(key, rng);
+            if (f && replay_cascade_(j, *f))
+                return;
+        }
+    }
+
+    // start recording the footprint
+    // the PKA frame has the z-axis along the PKA direction
+    if (key >= 0) {
+        recorder_ = std::make_unique<footprint_recorder>();
+        footprint_recorder &r = *recorder_;
+        r.key = key;
+        r.f.E = j->erg();
+        r.cs.origin = j->pos0();
+        r.cs.zaxis = j->dir();
+        r.cs.xzvector = std::abs(j->dir().x()) < 0.9f ? vector3(1, 0, 0) : vector3(0, 1, 0);
+        r.cs.init();
+        r.uid0 = j->uid();
+        r.t0 = j->t();
+        r.gen0 = j->recoil_id();
+    }
+
+    // create a vacancy at pka position
+    // and store it in the vacancy queue
+    defect &v = ion_queue_.push_vacancy(*j);
+    // Only for the PKA vacancy use pos0()
+    // to take into account "move_recoil" option
+    v.pos = j->pos0();
+    ion_queue_.info(v).cellid = j->cellid0();
+
+    // transport the PKA
+    transport(j);
+
+    // transport all secondary recoils
+    while (ion *k = ion_queue_.pop_recoil())
+        transport(k);
+
+    if (!recorder_)
+        return;
+
+    // store only bulk cascades
+    footprint_recorder &r = *recorder_;
+    if (r.surface) {
+        recorder_.reset();
+        return;
+    }
+
+    // add the defects, before recombination
+    for (const defect &d : ion_queue_.vacancies())
+        r.add(d, ion_queue_.info(d));
+    for (const defect &d : ion_queue_.interstitials())
+        r.add(cascade_library::Interstitial, *ion_queue_.info(d).src, d.pos);
+
+    auto f = std::make_shared<cascade_library::footprint>(std::move(r.f));
+    library_->add(r.key, f);
+    recorder_.reset();
+}
+
+bool mccore::replay_cascade_(ion *j, const cascade_library::footprint &f)
+{
+    // energies scale with the PKA energy
+    double s = j->erg() / f.E;
+
+    // PKA frame, randomly rotated around the PKA direction
+    coord_sys cs;
+    cs.origin = j->pos0();
+    cs.zaxis = j->dir();
+    do {
+        cs.xzvector = vector3(rng.normal(), rng.normal(), rng.normal());
+    } while (!cs.init());
+    Eigen::Matrix3f Rt = cs.rotation().transpose();
+
+    const grid3D &g = target_->grid();
+    const std::vector<atom *> &atoms = target_->atoms();
+
+    // the footprint must fit in the target, otherwise the PKA is simulated
+    std::vector<vector3> &xs = replay_pos_;
+    xs.resize(f.rec.size());
+    for (size_t k = 0; k < f.rec.size(); k++) {
+        const cascade_library::record &r = f.rec[k];
+        vector3 &x = xs[k];
+        x = cs.origin + Rt * vector3(r.x[0], r.x[1], r.x[2]);
+        g.apply_bc(x);
+        if (!g.contains(x) || r.type == cascade_library::Exit)
+            return false;
+    }
+
+    for (size_t n = 0; n < f.rec.size(); n++) {
+        const cascade_library::record &r = f.rec[n];
+        const vector3 &x = xs[n];
+
+        if (r.type == cascade_library::Vacancy) {
+            defect &v = ion_queue_.push_vacancy(*j, j->uid() + r.duid);
+            v.pos = x;
+            v.t = j->t() + r.t;
+            v.atom_ = atoms[r.atom];
+            defect_info &c = ion_queue_.info(v);
+            c.erg = s * r.erg;
+            c.recoil_id = j->recoil_id() + r.gen;
+            c.cellid = g.cellid(g.pos2cell(x));
+            continue;
+        }
+
+        ion *k = ion_queue_.clone_ion(*j);
+        k->setAtom(atoms[r.atom]);
+        k->setUid(j->uid() + r.duid);
+        k->setRecoilId(j->recoil_id() + r.gen);
+        k->setTime(j->t() + r.t);
+        k->setReplayState(x, s * r.erg, s * r.ioniz, s * r.phonon, r.path, r.ncoll);
+
+        switch (r.type) {
+        case cascade_library::Interstitial:
+            ion_queue_.push_interstitial(k);
+            break;
+        case cascade_library::Deposit:
+            handle_event(Event::BoundaryCrossing, *k);
+            ion_queue_.free_ion(k);
+            break;
+        case cascade_library::Replacement:
+            handle_event(Event::Replacement, *k, atoms[r.atom]);
+            ion_queue_.free_ion(k);
+            break;
+        default:
+            ion_queue_.free_ion(k);
+            break;
+        }
+    }
+
+    ion_queue_.free_ion(j);
+    return true;
+}
+
+// FNV-1a hash of trivially copyable values
+struct fnv1a_hash
+{
+    uint64_t h{ 0xcbf29ce484222325ULL };
+    template <class T>
+    fnv1a_hash &operator<<(const T &v)
+    {
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(&v);
+        for (size_t i = 0; i < sizeof(T); ++i)
+            h = (h ^ p[i]) * 0x100000001b3ULL;
+        return *this;
+    }
+};
+
+uint64_t mccore::cascade_config_hash_() const
+{
+    fnv1a_hash h;
+    h << int(par_.simulation_type) << int(par_.screening_type) << int(par_.electronic_stopping)
+      << int(par_.electronic_straggling) << int(par_.nrt_calculation)
+      << par_.intra_cascade_recombination << int(par_.recoil_order)
+      << par_.time_ordered_cascades << par_.correlated_recombination << par_.move_recoil
+      << par_.recoil_sub_ed;
+    h << int(tr_opt_.flight_path_type) << tr_opt_.flight_path_const << tr_opt_.min_energy
+      << tr_opt_.min_recoil_energy << tr_opt_.min_scattering_angle << tr_opt_.max_rel_eloss
+      << tr_opt_.mfp_range;
+    for (const material *m : target_->materials()) {
+        h << m->atomicDensity();
+        for (const atom *a : m->atoms())
+            h << a->Z() << a->M() << a->X() << a->Ed() << a->El() << a->Es() << a->Er()
+              << a->Rc();
+    }
+    return h.h;
+}
+
+void mccore::setPrecisionQuantity(int tid, int ut, int bin)
+{
+    prec_tid_ = tid;
+    prec_ut_ = tid > 0 ? -1 : ut;
+    prec_bin_ = bin;
+}
+
 void mccore::mergeTallies(mccore &other)
 {
     std::lock_guard<std::mutex> lock(*tally_mutex_);
@@ -567,6 +1406,8 @@ void mccore::mergeTallies(mccore &other)
     other.tally_.clear();
     dtally_ += other.dtally_;
     other.dtally_.clear();
+    prec_ += other.prec_;
+    other.prec_.clear();
     if (utally_.size()) {
         for (int i = 0; i < utally_.size(); ++i) {
             *(utally_[i]) += *(other.utally_[i]);
@@ -585,6 +1426,8 @@ void mccore::mergeEvents(mccore &other)
     other.exit_stream_.clear();
     damage_stream_.merge(other.damage_stream_);
     other.damage_stream_.clear();
+    cluster_stream_.merge(other.cluster_stream_);
+    other.cluster_stream_.clear();
 }
 
 void mccore::mergeEvents(std::vector<mccore *> &other)
@@ -600,6 +1443,9 @@ void mccore::mergeEvents(std::vector<mccore *> &other)
     for (int i = 0; i < n; ++i)
         streams[i] = &(other[i]->damage_stream_);
     damage_stream_.merge(streams);
+    for (int i = 0; i < n; ++i)
+        streams[i] = &(other[i]->cluster_stream_);
+    cluster_stream_.merge(streams);
 }
 
 ArrayNDd mccore::getTallyTable(int i) const
@@ -650,26 +1496,98 @@ void mccore::addUserTally(const user_tally::parameters &p)
     ution_.push_back(new user_tally(p));
 }
 
-int mccore::init_streams(uint32_t event_mask)
+int mccore::init_streams(uint32_t event_mask, bool cluster_events, event_sink *sink,
+                         float position_resolution)
 {
+    // open a stream on a temp file or attached to the sink
+    auto open = [sink](event_stream &es, int id) { return sink ? es.open(sink, id) : es.open(); };
+
     if (event_mask & static_cast<uint32_t>(Event::CascadeComplete)) {
         pka_stream_.set_event_prototype(pka);
-        pka_stream_.open();
+        open(pka_stream_, PkaStream);
         pka_stream_mask_ =
                 pka_stream_.is_open() ? static_cast<uint32_t>(Event::CascadeComplete) : 0;
     }
     if ((event_mask & static_cast<uint32_t>(Event::Vacancy))
         || (event_mask & static_cast<uint32_t>(Event::IonStop))) {
         damage_stream_.set_event_prototype(damage_ev);
-        damage_stream_.open();
+        damage_stream_.set_position_resolution(position_resolution);
+        open(damage_stream_, DamageStream);
         damage_stream_mask_ = damage_stream_.is_open()
                 ? static_cast<uint32_t>(Event::Vacancy) | static_cast<uint32_t>(Event::IonStop)
                 : 0;
     }
     if (event_mask & static_cast<uint32_t>(Event::IonExit)) {
         exit_stream_.set_event_prototype(exit_ev);
-        exit_stream_.open();
+        exit_stream_.set_position_resolution(position_resolution);
+        open(exit_stream_, ExitStream);
         exit_stream_mask_ = exit_stream_.is_open() ? static_cast<uint32_t>(Event::IonExit) : 0;
     }
+    if (cluster_events && par_.cluster_analysis) {
+        cluster_stream_.set_event_prototype(cluster_ev);
+        open(cluster_stream_, ClusterStream);
+    }
     return 0;
 }
+
+void mccore::set_event_filter(stream_id_t id, const event_filter::parameters &p)
+{
+    event_stream *es;
+    switch (id) {
+    case PkaStream:
+        pka_filter_ = event_filter(p);
+        es = &pka_stream_;
+        break;
+    case ExitStream:
+        exit_filter_ = event_filter(p);
+        es = &exit_stream_;
+        break;
+    case DamageStream:
+        damage_filter_ = event_filter(p);
+        es = &damage_stream_;
+        break;
+    default:
+        return;
+    }
+    // seed the sampling from a copy of the rng, so that the
+    // simulation random sequence is not altered
+    random_vars r(rng);
+    es->set_max_rows(p.max_rows, r() + id);
+}
+
+const event_buffer &mccore::event_prototype(stream_id_t id) const
+{
+    switch (id) {
+    case ExitStream:
+        return exit_ev;
+    case DamageStream:
+        return damage_ev;
+    case ClusterStream:
+        return cluster_ev;
+    default:
+        return pka;
+    }
+}
+
+event_stream &mccore::stream(stream_id_t id)
+{
+    switch (id) {
+    case ExitStream:
+        return exit_stream_;
+    case DamageStream:
+        return damage_stream_;
+    case ClusterStream:
+        return cluster_stream_;
+    default:
+        return pka_stream_;
+    }
+}
+
+int mccore::flushEvents()
+{
+    int ret = 0;
+    for (event_stream *es : { &pka_stream_, &exit_stream_, &damage_stream_, &cluster_stream_ })
+        if (es->flush() != 0)
+            ret = -1;
+    return ret;
+}
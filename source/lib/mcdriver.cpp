@@ -8,6 +8,10 @@
 #include <algorithm>
 #include <cctype>
 #include <set>
+#include <numeric>
+#include <functional>
+#include <filesystem>
+#include <iostream>
 
 #define CHECK_INVALID_ENUM(OptName, EnumName) \
     if (int(OptName.EnumName) < 0)            \
@@ -62,6 +66,8 @@ mcdriver::mcdriver(const mcconfig &cfg) : config_(cfg), s_(nullptr)
     s_->init();
 }
 
+mcdriver::mcdriver(const mcconfig &cfg, mccore *s) : config_(cfg), s_(s) { }
+
 std::shared_ptr<mcdriver> mcdriver::create(const mcconfig &cfg, std::ostream *os)
 {
     std::shared_ptr<mcdriver> D;
@@ -87,10 +93,14 @@ mcdriver::~mcdriver()
         abort();
         wait();
     }
+    if (ckpt_thread_.joinable())
+        ckpt_thread_.join();
 }
 
 void mcdriver::abort()
 {
+    if (mcdriver *p = pilot_)
+        p->abort();
     if (s_)
         s_->abort();
 }
@@ -101,6 +111,16 @@ void mcdriver::wait()
         thread_pool_[i].join();
 }
 
+int mcdriver::mapEvents(mccore::stream_id_t id, event_view &v)
+{
+    v.unmap();
+    if (!s_ || is_running() || config_.Output.direct_event_output)
+        return -1;
+    event_stream *es[mccore::NStreams] = { &s_->pka_stream(), &s_->exit_stream(),
+                                           &s_->damage_stream(), &s_->cluster_stream() };
+    return v.map(*es[id]);
+}
+
 double elapsed_sec(const timespec &t0, const timespec &t1)
 {
     double d = 1. * (t1.tv_sec - t0.tv_sec);
@@ -108,14 +128,59 @@ double elapsed_sec(const timespec &t0, const timespec &t1)
     return d;
 }
 
-int mcdriver::exec(progress_callback cb, size_t msInterval, void *callback_user_data)
+// run info from the start of exec() until now
+mcdriver::run_data current_run_data(std::time_t start_time, const timespec &t_start,
+                                    size_t n_start, size_t ion_count, int nthreads)
+{
+    struct timespec t_end;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t_end); // POSIX
+    std::time_t end_time = std::time(nullptr);
+
+    mcdriver::run_data rd;
+    rd.cpu_time_s = elapsed_sec(t_start, t_end);
+    rd.run_ion_count = ion_count - n_start;
+    rd.total_ion_count = ion_count;
+    rd.ions_per_cpu_s = rd.run_ion_count / rd.cpu_time_s;
+    rd.nthreads = nthreads;
+    // store ISO 8601 timestamps %Y-%m-%dT%H:%M:%SZ
+    {
+        std::stringstream ss;
+        ss << std::put_time(std::gmtime(&start_time), "%Y-%m-%dT%H:%M:%SZ");
+        rd.start_time = ss.str();
+    }
+    {
+        std::stringstream ss;
+        ss << std::put_time(std::gmtime(&end_time), "%Y-%m-%dT%H:%M:%SZ");
+        rd.end_time = ss.str();
+    }
+    return rd;
+}
+
+void mcdriver::init_streams_(mccore *s, event_sink *sink)
+{
+    const mcconfig::output_options &opt = config_.Output;
+    uint32_t ev_mask{ 0 };
+    if (opt.store_pka_events)
+        ev_mask |= static_cast<uint32_t>(Event::CascadeComplete);
+    if (opt.store_exit_events)
+        ev_mask |= static_cast<uint32_t>(Event::IonExit);
+    if (opt.store_damage_events)
+        ev_mask |= static_cast<uint32_t>(Event::Vacancy);
+    s->init_streams(ev_mask, opt.store_cluster_events, sink, opt.event_position_resolution);
+    s->set_event_filter(mccore::PkaStream, opt.pka_filter);
+    s->set_event_filter(mccore::ExitStream, opt.exit_filter);
+    s->set_event_filter(mccore::DamageStream, opt.damage_filter);
+}
+
+int mcdriver::exec(progress_callback cb, size_t msInterval, void *callback_user_data,
+                   std::ostream *os)
 {
     using namespace std::chrono_literals;
     static const size_t msTick = 100;
     size_t nTickPerInterval = std::max(msInterval / msTick, size_t(1));
 
     // wall clock time
-    std::time_t start_time_, end_time_;
+    std::time_t start_time_;
     // cpu time
     struct timespec t_start, t_end;
 
@@ -128,6 +193,12 @@ int mcdriver::exec(progress_callback cb, size_t msInterval, void *callback_user_
             nthreads >>= 1; // use half the available threads
     }
 
+    // pipelined FullCascade simulation: extra threads for the cascade stage
+    size_t ncascade = config_.Simulation.simulation_type == mccore::FullCascade
+            ? config_.Run.cascade_threads
+            : 0;
+    std::shared_ptr<pka_pipeline> pipeline;
+
     // TIMING
     start_time_ = std::time(nullptr);
     clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t_start);
@@ -149,52 +220,163 @@ int mcdriver::exec(progress_callback cb, size_t msInterval, void *callback_user_
             tlim -= rd.cpu_time_s;
     }
 
+    // If ion_count == 0, i.e. simulation starts,
+    // generate the weight window by a pilot run, if requested
+    if (s_->ion_count() == 0 && config_.Transport.weight_window_pilot
+        && s_->weightWindow().empty() && run_pilot_() != 0)
+        return -1;
+
     // If ion_count == 0, i.e. simulation starts, seed the rng
     if (s_->ion_count() == 0)
         s_->seed(config_.Run.seed);
 
+    // load a cached cascade library
+    const std::string &lib_file = config_.Simulation.cascade_library_file;
+    if (s_->ion_count() == 0 && s_->cascadeLibrary() && !lib_file.empty()
+        && std::filesystem::exists(lib_file) && s_->cascadeLibrary()->load(lib_file, os) != 0)
+        return -1;
+
+    // direct event output: prepare the output file
+    bool direct_events = config_.Output.direct_event_output;
+    if (direct_events && open_event_sink_(os) != 0)
+        return -1;
+
+    // phase-space source: each ion stage thread reads a disjoint partition of the file
+    // a continued run skips the records used so far in each partition
+    std::vector<std::unique_ptr<phase_space_reader>> ps_readers;
+    const ion_beam::phase_space_t &ps = config_.IonBeam.phase_space;
+    if (!ps.file.empty()) {
+        if (!phase_space_pos_.empty() && phase_space_pos_.size() != nthreads) {
+            if (os)
+                (*os) << "Phase-space partitions changed with the # of threads, "
+                         "records are used again from the start"
+                      << std::endl;
+            phase_space_pos_.clear();
+        }
+        phase_space_pos_.resize(nthreads, 0);
+        for (size_t i = 0; i < nthreads; i++) {
+            auto rd = std::make_unique<phase_space_reader>();
+            if (rd->open(ps.file, os) != 0)
+                return -1;
+            size_t N = rd->rows();
+            size_t first = i * N / nthreads, last = (i + 1) * N / nthreads;
+            if (first == last) {
+                if (os)
+                    (*os) << "Phase-space file " << ps.file << " has fewer records than threads"
+                          << std::endl;
+                return -1;
+            }
+            rd->setPartition(first, last, ps.recycle, ps.buffer_size, phase_space_pos_[i]);
+            ps_readers.push_back(std::move(rd));
+        }
+    }
+
+    // the quantity checked for the target precision, accumulated per history by the clones
+    {
+        const std::string &q = config_.Run.precision_tally;
+        int tid = 0, ut = -1;
+        for (int i = 1; i < tally::std_tallies && !tid; i++)
+            if (q == tally::arrayName(i))
+                tid = i;
+        const auto &U = s_->getUserTally();
+        for (int k = 0; k < int(U.size()) && !tid && ut < 0; k++)
+            if (U[k]->id() == q)
+                ut = k;
+        s_->setPrecisionQuantity(tid, ut, config_.Run.precision_bin);
+    }
+
     // create simulation clones
-    sim_clones_.resize(nthreads);
-    for (size_t i = 0; i < nthreads; i++)
+    // the cascade stage clones, if any, come after the ion stage clones
+    sim_clones_.resize(nthreads + ncascade);
+    for (size_t i = 0; i < sim_clones_.size(); i++)
         sim_clones_[i] = new mccore(*s_);
+    for (size_t i = 0; i < ps_readers.size(); i++)
+        sim_clones_[i]->setPhaseSpace(std::move(ps_readers[i]));
 
     // jump the rng's of clones (except the 1st one)
-    for (size_t i = 1; i < nthreads; i++) {
+    for (size_t i = 1; i < sim_clones_.size(); i++) {
         for (size_t j = 0; j < i; ++j)
             sim_clones_[i]->rngJump();
     }
 
-    // init event streams
-    uint32_t ev_mask{ 0 };
-    if (config_.Output.store_pka_events)
-        ev_mask |= static_cast<uint32_t>(Event::CascadeComplete);
-    if (config_.Output.store_exit_events)
-        ev_mask |= static_cast<uint32_t>(Event::IonExit);
-    if (config_.Output.store_damage_events)
-        ev_mask |= static_cast<uint32_t>(Event::Vacancy);
-
     // open clone streams
-    for (size_t i = 0; i < nthreads; i++)
-        sim_clones_[i]->init_streams(ev_mask);
+    // for direct event output they are attached to the event sink
+    for (mccore *sc : sim_clones_)
+        init_streams_(sc, event_sink_.get());
 
     // If ion_count == 0, i.e. simulation starts,
     // open also the main simulation streams
-    if (s_->ion_count() == 0)
-        s_->init_streams(ev_mask);
+    if (s_->ion_count() == 0 && !direct_events)
+        init_streams_(s_.get(), nullptr);
+
+    // a run loaded from a checkpoint continues exactly where it was interrupted,
+    // if the # of threads and ions are the same
+    bool resume = resume_threads_.size() == nthreads && resume_target_ == n_end
+            && s_->setTallySums(resume_base_.tallies);
+
+    // results at the start of the run
+    // clones keep their partial tallies until the end of the run and are added to these,
+    // so that the final sums do not depend on when intermediate results are merged
+    run_base_t base;
+    if (resume) {
+        base = std::move(resume_base_);
+        for (int k = 0; k < mccore::NStreams; ++k) {
+            event_stream &es = s_->stream(mccore::stream_id_t(k));
+            if (es.is_open() && es.max_rows())
+                es.set_reservoir(base.reservoir[k]);
+        }
+    } else {
+        base.ion_count = n_start;
+        base.tallies = s_->tallySums();
+    }
 
     // arm the clones
     // each clone runs N/nthread ions +1 if i < N % nthread
+    // 1st ion id of each thread
+    std::vector<size_t> id1(nthreads);
     for (size_t i = 0; i < nthreads; i++) {
-        // 1st ion id for this thread
-        size_t id1 = n_start + i + 1;
+        if (resume) {
+            sim_clones_[i]->setThreadState(resume_threads_[i]);
+            id1[i] = resume_threads_[i].next_id;
+            continue;
+        }
+        id1[i] = n_start + i + 1;
         // ions for this thread
         size_t thread_n_ions = (n_run / nthreads) + (i < (n_run % nthreads) ? 1 : 0);
-        sim_clones_[i]->arm(thread_n_ions, id1, nthreads);
+        sim_clones_[i]->arm(thread_n_ions, id1[i], nthreads);
+    }
+    int ret = resume ? resume_events_(base) : 0;
+    resume_threads_.clear();
+    resume_event_rows_.clear();
+    resume_base_ = run_base_t();
+    if (ret != 0) {
+        for (mccore *sc : sim_clones_)
+            delete sc;
+        sim_clones_.clear();
+        return -1;
+    }
+
+    // the pipeline passes the ion histories to the cascade stage in id order
+    if (ncascade) {
+        pipeline = std::make_shared<pka_pipeline>(
+                config_.Run.pipeline_capacity, *std::min_element(id1.begin(), id1.end()),
+                nthreads);
+        for (size_t i = 0; i < sim_clones_.size(); i++)
+            sim_clones_[i]->setPipeline(pipeline, i >= nthreads);
     }
 
+    // checkpoint timing
+    typedef std::chrono::steady_clock ckpt_clock_t;
+    auto ckpt_interval = std::chrono::milliseconds(config_.Output.storage_interval);
+    auto ckpt_time = ckpt_clock_t::now();
+
     // create & start worker threads
-    for (size_t i = 0; i < nthreads; i++)
-        thread_pool_.emplace_back(&mccore::run, sim_clones_[i]);
+    for (mccore *sc : sim_clones_)
+        thread_pool_.emplace_back(&mccore::run, sc);
+
+    // stop conditions other than max_no_ions
+    bool check_precision = config_.Run.target_rel_sem > 0.f;
+    bool precision_reached = false, cpu_limit = false;
 
     // waiting loop
     do {
@@ -206,17 +388,37 @@ int mcdriver::exec(progress_callback cb, size_t msInterval, void *callback_user_
             std::this_thread::sleep_for(std::chrono::milliseconds(msTick));
             iTick++;
             clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t_end);
-            if (elapsed_sec(t_start, t_end) >= tlim)
+            if (elapsed_sec(t_start, t_end) >= tlim) {
+                cpu_limit = true;
                 abort();
+            }
         } while ((iTick < nTickPerInterval) && (s_->ion_count() < n_end) && !(s_->abort_flag()));
 
+        // consolidate results for the callback & the precision check
+        if (cb || check_precision)
+            s_->sumTallies(base.tallies, sim_clones_);
+
         // report progress if callback function is given
-        if (cb) {
-            // consolidate results
-            for (size_t i = 0; i < nthreads; i++)
-                s_->mergeTallies(*(sim_clones_[i]));
-            // callback
+        if (cb)
             cb(this, callback_user_data);
+
+        // stop cleanly when the target precision is reached
+        if (check_precision && !s_->abort_flag() && s_->ion_count() < n_end
+            && s_->ion_count() >= config_.Run.precision_min_ions) {
+            double e = precision_();
+            if (e >= 0 && e <= config_.Run.target_rel_sem) {
+                precision_reached = true;
+                abort();
+            }
+        }
+
+        // periodic checkpoint, if the previous one has been written
+        if (config_.Output.storage_interval > 0 && !ckpt_busy_
+            && ckpt_clock_t::now() - ckpt_time >= ckpt_interval
+            && (s_->ion_count() < n_end) && !(s_->abort_flag())) {
+            checkpoint_(n_end, base,
+                        current_run_data(start_time_, t_start, n_start, s_->ion_count(), nthreads));
+            ckpt_time = ckpt_clock_t::now();
         }
 
     } while ((s_->ion_count() < n_end) && !(s_->abort_flag()));
@@ -225,9 +427,25 @@ int mcdriver::exec(progress_callback cb, size_t msInterval, void *callback_user_
     for (size_t i = 0; i < nthreads; i++)
         thread_pool_[i].join();
 
+    // ... the cascade stage finishes the PKAs left in the pipeline
+    if (pipeline) {
+        pipeline->close();
+        for (size_t i = nthreads; i < thread_pool_.size(); i++)
+            thread_pool_[i].join();
+    }
+
+    // ... and for the checkpoint writer, which reads the clone event streams
+    if (ckpt_thread_.joinable())
+        ckpt_thread_.join();
+
+    const char *stop_reason = precision_reached ? "target_precision"
+            : cpu_limit                         ? "max_cpu_time"
+            : s_->ion_count() < n_end           ? "aborted"
+                                                : "max_no_ions";
+
     // if the actual total ion count is less than the expected
     // (due to the simulation being aborted by the user or due to
-    // the time limit reached)
+    // the time limit or target precision reached)
     // we have to check if we have all consequtive ion history ids
     if (s_->ion_count() < n_end) {
 
@@ -237,18 +455,20 @@ int mcdriver::exec(progress_callback cb, size_t msInterval, void *callback_user_
         n_run = n_end - n_start;
 
         // get the last ion ID in each thread
-        std::vector<size_t> ids(nthreads);
+        // if a thread did not run any ion, it is the id before its 1st (may be <= 0)
+        std::vector<long long> ids(nthreads);
         for (size_t i = 0; i < nthreads; i++)
-            ids[i] = sim_clones_[i]->thread_ion_count() ? sim_clones_[i]->next_ion_id() - nthreads
-                                                        : size_t(-1);
+            ids[i] = (long long)(sim_clones_[i]->thread_ion_count() ? sim_clones_[i]->next_ion_id()
+                                                                    : id1[i])
+                    - (long long)nthreads;
 
         // get the max ID and the thread index where it occured
         auto max_it = std::max_element(ids.begin(), ids.end());
         int i = std::distance(ids.begin(), max_it);
-        size_t maxId = *max_it;
+        long long maxId = *max_it;
 
         // if maxID > n_end => missing IDs
-        if (maxId > n_end) {
+        if (maxId > (long long)n_end) {
             // how many
             size_t n_missing = maxId - n_end;
             // check all other threads (except the one with maxID) to find the missing
@@ -261,11 +481,8 @@ int mcdriver::exec(progress_callback cb, size_t msInterval, void *callback_user_
                 // this should be the i-th thread maxID
                 maxId--;
                 // check if the last id is below that
-                while ((ids[i] < maxId || ids[i] == size_t(-1)) && n_missing) {
-                    if (ids[i] == size_t(-1)) {
-                        ids[i] = n_start + i + 1;
-                    } else
-                        ids[i] += nthreads;
+                while (ids[i] < maxId && n_missing) {
+                    ids[i] += nthreads;
                     // simulate 1 missing ion
                     sim_clones_[i]->arm(1, ids[i], nthreads);
                     sim_clones_[i]->run();
@@ -276,58 +493,270 @@ int mcdriver::exec(progress_callback cb, size_t msInterval, void *callback_user_
             }
             assert(!n_missing);
         } else {
-            assert(maxId == n_end);
+            assert(maxId <= (long long)n_end);
         }
     }
 
     // consolidate tallies
-    for (size_t i = 0; i < nthreads; i++) {
-        s_->mergeTallies(*(sim_clones_[i]));
-    }
+    s_->sumTallies(base.tallies, sim_clones_);
     // consolidate events, ordered per history id
-    s_->mergeEvents(sim_clones_);
+    // or, for direct event output, pass any remaining events to the sink
+    if (direct_events) {
+        for (mccore *sc : sim_clones_)
+            sc->flushEvents();
+    } else
+        s_->mergeEvents(sim_clones_);
 
     // report progress for the last time
     if (cb) {
         cb(this, callback_user_data);
     }
 
-    // mark cpu time and world clock time
-    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t_end); // POSIX
-    end_time_ = std::time(nullptr);
-
     // save run info
-    run_data rd;
-    rd.cpu_time_s = elapsed_sec(t_start, t_end);
-    rd.run_ion_count = s_->ion_count() - n_start;
-    rd.total_ion_count = s_->ion_count();
-    rd.ions_per_cpu_s = rd.run_ion_count / rd.cpu_time_s;
-    rd.nthreads = nthreads;
-    // store ISO 8601 timestamps %Y-%m-%dT%H:%M:%SZ
-    {
-        std::stringstream ss;
-        ss << std::put_time(std::gmtime(&start_time_), "%Y-%m-%dT%H:%M:%SZ");
-        rd.start_time = ss.str();
-    }
-    {
-        std::stringstream ss;
-        ss << std::put_time(std::gmtime(&end_time_), "%Y-%m-%dT%H:%M:%SZ");
-        rd.end_time = ss.str();
-    }
+    run_data rd = current_run_data(start_time_, t_start, n_start, s_->ion_count(), nthreads);
+    rd.stop_reason = stop_reason;
+    if (check_precision)
+        rd.rel_sem = precision_();
     run_history_.push_back(rd);
 
+    // cache the cascade library
+    // the results of the run are kept even if this fails
+    if (s_->cascadeLibrary() && !lib_file.empty())
+        ret = s_->cascadeLibrary()->save(lib_file, os);
+
     // copy back rng state from 1st clone
     s_->setRngState(sim_clones_[0]->rngState());
 
+    // phase-space records used so far
+    if (!ps.file.empty())
+        for (size_t i = 0; i < nthreads; i++)
+            phase_space_pos_[i] = sim_clones_[i]->phaseSpacePosition();
+
     // delete simulation clones
-    for (int i = 0; i < nthreads; i++) {
-        delete sim_clones_[i];
+    for (mccore *sc : sim_clones_) {
+        delete sc;
     }
 
     // clear threads & clone pointers
     thread_pool_.clear();
     sim_clones_.clear();
 
+    return ret;
+}
+
+double mcdriver::precision_() const
+{
+    const mccore &S = *s_;
+    // # of histories in the merged tallies. In a pipelined simulation this is less
+    // than the ion count, as the histories waiting in the pipeline are not scored yet
+    ArrayNDd A = S.getTallyTable(0), dA = S.getTallyTableVar(0);
+    double N = A.size() ? A[0] : 0;
+    if (N < 2)
+        return -1;
+
+    // per-history totals of the precision quantity give the exact SEM
+    const ArrayNDd &P = S.precisionSums();
+    if (P[0] == N) {
+        double m = P[1] / N;
+        double e = std::sqrt(std::max(0.0, (P[2] / N - m * m) / (N - 1)));
+        return m != 0 ? e / std::abs(m) : -1;
+    }
+
+    // some histories were scored without the per-history totals, e.g. when
+    // continuing a run loaded from an output file. Use the tally bins instead
+    const std::string &q = config_.Run.precision_tally;
+    const int bin = config_.Run.precision_bin;
+
+    // sums & sums of squares of the per-history scores to check
+    std::vector<std::pair<double, double>> x;
+    int tid = -1;
+    for (int i = 1; i < tally::std_tallies; i++)
+        if (q == tally::arrayName(i)) {
+            tid = i;
+            break;
+        }
+    if (tid > 0) {
+        for (int iid = 0; iid < int(A.dim()[1]); iid++)
+            if (bin < 0 || bin == iid)
+                x.emplace_back(A(tid, iid), dA(tid, iid));
+    } else {
+        const auto &ut = S.getUserTally();
+        const auto &dut = S.getUserTallyVar();
+        for (size_t k = 0; k < ut.size(); k++)
+            if (ut[k]->id() == q) {
+                const ArrayNDd &U = ut[k]->data(), &dU = dut[k]->data();
+                for (int i = 0; i < int(U.size()); i++)
+                    if (bin < 0 || bin == i)
+                        x.emplace_back(U[i], dU[i]);
+            }
+    }
+
+    // the covariance of the bins is not known,
+    // the SEM of a total is bounded by the sum of the SEMs of its terms
+    double m = 0, e = 0;
+    for (const auto &p : x) {
+        double mu = p.first / N;
+        m += mu;
+        e += std::sqrt(std::max(0.0, (p.second / N - mu * mu) / (N - 1)));
+    }
+    return m > 0 ? e / std::abs(m) : -1;
+}
+
+void mcdriver::checkpoint_(size_t n_end, const run_base_t &base, const run_data &rd)
+{
+    auto c = std::make_shared<checkpoint_t>();
+    c->fname = checkpointFileName();
+    c->target_ion_count = n_end;
+
+    // stop all threads after their current ion history
+    s_->pause();
+
+    // tallies & thread states are now consistent
+    s_->sumTallies(base.tallies, sim_clones_);
+    for (mccore *sc : sim_clones_)
+        c->threads.push_back(sc->threadState());
+
+    // the main streams are not changed during the run
+    c->base = base;
+    for (int k = 0; k < mccore::NStreams; ++k) {
+        const event_stream &es = s_->stream(mccore::stream_id_t(k));
+        if (es.is_open() && es.max_rows())
+            c->base.reservoir[k] = es.reservoir();
+    }
+
+    // detached copy of the driver
+    mccore *s = s_->snapshot();
+    s->setRngState(sim_clones_[0]->rngState());
+    c->snap = std::shared_ptr<mcdriver>(new mcdriver(config_, s));
+    c->snap->run_history_ = run_history_;
+    c->snap->run_history_.push_back(rd);
+    if (!config_.IonBeam.phase_space.file.empty())
+        for (const auto &t : c->threads)
+            c->snap->phase_space_pos_.push_back(t.phase_space_pos);
+
+    // events up to this point
+    if (config_.Output.direct_event_output) {
+        // write them to the output file & record the # of rows
+        bool ok = event_sink_ != nullptr;
+        for (mccore *sc : sim_clones_)
+            ok = ok && sc->flushEvents() == 0;
+        if (!ok || event_sink_->sync() != 0) {
+            // no consistent checkpoint possible
+            s_->resume();
+            return;
+        }
+        c->event_file = event_file_;
+        for (int k = 0; k < mccore::NStreams; ++k)
+            c->event_rows.push_back(event_sink_->rows(k));
+    } else {
+        // read-only snapshots of the main & clone streams, merged by the writer thread
+        for (int k = 0; k < mccore::NStreams; ++k) {
+            auto id = mccore::stream_id_t(k);
+            std::vector<event_stream *> src{ &s_->stream(id) };
+            for (mccore *sc : sim_clones_)
+                src.push_back(&sc->stream(id));
+            for (event_stream *es : src) {
+                if (!es->is_open())
+                    continue;
+                auto v = std::make_unique<event_stream>();
+                if (v->open_snapshot(*es) == 0)
+                    c->streams[k].push_back(std::move(v));
+            }
+        }
+    }
+
+    s_->resume();
+
+    // write the file in the background
+    if (ckpt_thread_.joinable())
+        ckpt_thread_.join();
+    ckpt_busy_ = true;
+    ckpt_thread_ = std::thread(&mcdriver::write_checkpoint_, this, c);
+}
+
+int mcdriver::resume_events_(const run_base_t &base)
+{
+    /*
+     * The events of a checkpoint are the events of the previous runs & of each thread,
+     * merged in history id order. They are split again on the history id, so that
+     * the final merge gives the same result as in the interrupted run.
+     * Thread i simulates the ids with id % stride == next_id(i) % stride
+     */
+    size_t stride = std::max(resume_threads_[0].id_stride, size_t(1));
+    std::vector<int> owner(stride, -1);
+    for (size_t i = 0; i < resume_threads_.size(); ++i)
+        owner[resume_threads_[i].next_id % stride] = i;
+
+    for (int k = 0; k < mccore::NStreams; ++k) {
+        auto id = mccore::stream_id_t(k);
+        event_stream &es = s_->stream(id);
+        // reservoir samples are restored with the thread states
+        if (!es.is_open() || es.max_rows() || es.rows() == 0)
+            continue;
+
+        // events of the previous runs
+        event_stream prev;
+        prev.set_event_prototype(es.event_prototype());
+        if (prev.open() != 0)
+            return -1;
+
+        size_t rsize = es.record_size();
+        size_t buff_rows = std::max(size_t(1), size_t(1 << 20) / rsize);
+        std::vector<char> buff(buff_rows * rsize);
+        es.rewind();
+        size_t n;
+        while ((n = es.read(buff.data(), buff_rows)) > 0) {
+            for (size_t j = 0; j < n; ++j) {
+                const char *rec = buff.data() + j * rsize;
+                uint64_t hid = event_buffer::history_id(rec);
+                int i = hid > base.ion_count ? owner[hid % stride] : -1;
+                (i < 0 ? prev : sim_clones_[i]->stream(id)).write(rec, 1);
+            }
+        }
+
+        es.clear();
+        if (es.merge(prev) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int mcdriver::run_pilot_()
+{
+    // a plain run with the same setup, no outputs & variance reduction
+    mcconfig cfg = config_;
+    cfg.Run.max_no_ions = config_.Transport.weight_window_pilot;
+    cfg.Run.max_cpu_time = 0;
+    cfg.Transport.weight_window_pilot = 0;
+    cfg.Transport.weight_window.clear();
+    cfg.Output.storage_interval = 0;
+    cfg.Output.store_exit_events = false;
+    cfg.Output.store_pka_events = false;
+    cfg.Output.store_damage_events = false;
+    cfg.Output.store_cluster_events = false;
+    cfg.Output.direct_event_output = false;
+    cfg.UserTally.clear();
+    cfg.Simulation.cascade_library_size = 0;
+    cfg.Run.target_rel_sem = 0;
+
+    auto P = create(cfg);
+    if (!P)
+        return -1;
+    pilot_ = P.get();
+    P->exec();
+    pilot_ = nullptr;
+    if (s_->abort_flag() || P->ion_count() < cfg.Run.max_no_ions)
+        return -1;
+
+    std::vector<float> wl =
+            P->getSim()->generateWeightWindow(config_.Transport.weight_window_quantity);
+    if (wl.empty())
+        return -1;
+
+    // the window is stored with the configuration,
+    // a saved or checkpointed run continues with it
+    config_.Transport.weight_window = wl;
+    s_->setWeightWindow(wl);
     return 0;
 }
 
@@ -340,6 +769,7 @@ int mcconfig::validate(bool AcceptIncomplete) const
     CHECK_INVALID_ENUM(Simulation, electronic_stopping)
     CHECK_INVALID_ENUM(Simulation, electronic_straggling)
     CHECK_INVALID_ENUM(Simulation, nrt_calculation)
+    CHECK_INVALID_ENUM(Simulation, recoil_order)
     CHECK_INVALID_ENUM(Transport, flight_path_type)
 
     if (Transport.flight_path_type == flight_path_calc::Constant
@@ -347,17 +777,189 @@ int mcconfig::validate(bool AcceptIncomplete) const
         throw std::invalid_argument("Transport.flight_path_type is \"Constant\" but "
                                     "Transport.flight_path_const is negative.");
 
+    {
+        const auto &zx = Transport.importance_planes;
+        const auto &zI = Transport.importance_values;
+        if (!std::is_sorted(zx.begin(), zx.end())
+            || std::adjacent_find(zx.begin(), zx.end()) != zx.end())
+            throw std::invalid_argument("Transport.importance_planes must be strictly increasing.");
+        if (zx.empty() ? zI.size() > 1 : zI.size() != zx.size() + 1)
+            throw std::invalid_argument("Transport.importance_values must have one value per "
+                                        "importance zone (# of importance_planes + 1).");
+        if (Transport.importance_regions.size() > Target.regions.size())
+            throw std::invalid_argument("Transport.importance_regions has more values than "
+                                        "Target.regions.");
+        auto nonpositive = [](float I) { return !(I > 0.f); };
+        if (std::any_of(zI.begin(), zI.end(), nonpositive)
+            || std::any_of(Transport.importance_regions.begin(),
+                           Transport.importance_regions.end(), nonpositive))
+            throw std::invalid_argument("Transport importance values must be positive.");
+        if (Transport.max_split < 1)
+            throw std::invalid_argument("Transport.max_split must be at least 1.");
+    }
+
+    if (Transport.forced_pka_energy < 0.f)
+        throw std::invalid_argument("Transport.forced_pka_energy is negative.");
+
+    CHECK_INVALID_ENUM(Transport, weight_window_quantity)
+    {
+        const auto &ww = Transport.weight_window;
+        if (!(Transport.weight_window_ratio > 1.f))
+            throw std::invalid_argument("Transport.weight_window_ratio must be > 1.");
+        if (std::any_of(ww.begin(), ww.end(), [](float w) { return !(w >= 0.f); }))
+            throw std::invalid_argument("Transport.weight_window has negative values.");
+        const ivector3 &nc = Target.cell_count;
+        if (!ww.empty() && ww.size() != size_t(nc.x()) * nc.y() * nc.z())
+            throw std::invalid_argument("Transport.weight_window must have one value per "
+                                        "target cell.");
+        if ((!ww.empty() || Transport.weight_window_pilot)
+            && (!Transport.importance_values.empty() || !Transport.importance_regions.empty()))
+            throw std::invalid_argument("Transport weight window and importance map cannot "
+                                        "be used together.");
+    }
+
+    if (Simulation.cluster_analysis && Simulation.cluster_radius <= 0.f)
+        throw std::invalid_argument("Simulation.cluster_analysis is on but "
+                                    "Simulation.cluster_radius is not positive.");
+
+    if (Simulation.cascade_library_size && Simulation.cascade_library_bins < 1)
+        throw std::invalid_argument("Simulation.cascade_library_bins must be >= 1.");
+
+    if (Run.cascade_threads < 0)
+        throw std::invalid_argument("Run.cascade_threads is negative.");
+    if (Run.cascade_threads && Simulation.simulation_type != mccore::FullCascade)
+        throw std::invalid_argument("Run.cascade_threads requires a FullCascade simulation.");
+    if (Run.cascade_threads && Run.pipeline_capacity < 1)
+        throw std::invalid_argument("Run.pipeline_capacity must be >= 1.");
+    if (Run.cascade_threads && Output.storage_interval > 0)
+        throw std::invalid_argument("Output.storage_interval > 0 cannot be used with "
+                                    "Run.cascade_threads, checkpoints do not store the "
+                                    "PKAs waiting in the pipeline.");
+    if (Run.target_rel_sem < 0.f)
+        throw std::invalid_argument("Run.target_rel_sem is negative.");
+    if (Run.target_rel_sem > 0.f) {
+        bool found = false;
+        for (int i = 1; i < tally::std_tallies; i++)
+            found = found || Run.precision_tally == tally::arrayName(i);
+        for (const auto &ut : UserTally)
+            found = found || Run.precision_tally == ut.id;
+        if (!found)
+            throw std::invalid_argument("Run.precision_tally=\"" + Run.precision_tally
+                                        + "\" is not a tally or user tally id.");
+        if (Run.precision_bin < -1)
+            throw std::invalid_argument("Run.precision_bin must be >= -1.");
+    }
+
     // Ion source
     CHECK_INVALID_ENUM(IonBeam.energy_distribution, type)
     CHECK_INVALID_ENUM(IonBeam.spatial_distribution, type)
     CHECK_INVALID_ENUM(IonBeam.spatial_distribution, geometry)
     CHECK_INVALID_ENUM(IonBeam.angular_distribution, type)
+    if (IonBeam.spatial_distribution.type == ion_beam::Tabulated
+        || IonBeam.angular_distribution.type == ion_beam::Tabulated)
+        throw std::invalid_argument("Tabulated distribution is only valid for "
+                                    "IonBeam.energy_distribution.");
+    if (!IonBeam.phase_space.file.empty()) {
+        const auto &ps = IonBeam.phase_space;
+        if (Simulation.simulation_type == mccore::CascadesOnly)
+            throw std::invalid_argument("IonBeam.phase_space requires a simulation with "
+                                        "beam ion transport.");
+        if (ps.recycle < 1)
+            throw std::invalid_argument("IonBeam.phase_space.recycle must be >= 1.");
+        if (ps.buffer_size < 1)
+            throw std::invalid_argument("IonBeam.phase_space.buffer_size must be >= 1.");
+        if (!std::filesystem::exists(ps.file))
+            throw std::invalid_argument("IonBeam.phase_space.file=\"" + ps.file
+                                        + "\" does not exist.");
+    }
+    if (IonBeam.energy_distribution.type == ion_beam::Tabulated) {
+        auto ed = IonBeam.energy_distribution;
+        if (!ed.file.empty()
+            && ion_beam::energy_distribution_t::read_spectrum(ed.file, ed.energy_bins,
+                                                              ed.weights))
+            throw std::invalid_argument("Cannot read spectrum file "
+                                        "IonBeam.energy_distribution.file=\""
+                                        + ed.file + "\".");
+        const auto &E = ed.energy_bins;
+        if (E.size() < 2)
+            throw std::invalid_argument("IonBeam.energy_distribution.energy_bins must have "
+                                        "at least 2 values.");
+        if (!(E[0] > 0.f) || std::adjacent_find(E.begin(), E.end(), std::greater_equal<float>())
+                    != E.end())
+            throw std::invalid_argument("IonBeam.energy_distribution.energy_bins must be "
+                                        "positive & strictly increasing.");
+        if (ed.weights.size() != (E.size() - 1) * ed.nspecies())
+            throw std::invalid_argument("IonBeam.energy_distribution.weights must have one "
+                                        "value per energy bin & species.");
+        if (std::any_of(ed.weights.begin(), ed.weights.end(),
+                        [](float w) { return !(w >= 0.f); })
+            || !(std::accumulate(ed.weights.begin(), ed.weights.end(), 0.f) > 0.f))
+            throw std::invalid_argument("IonBeam.energy_distribution.weights must be "
+                                        "non-negative with a positive sum.");
+        if (!ed.species.empty()) {
+            if (Simulation.simulation_type != mccore::CascadesOnly)
+                throw std::invalid_argument("IonBeam.energy_distribution.species requires "
+                                            "a CascadesOnly simulation.");
+            int natoms = 0;
+            for (const auto &m : Target.materials)
+                natoms += m.composition.size();
+            for (int id : ed.species)
+                if (id < 1 || id > natoms)
+                    throw std::invalid_argument("IonBeam.energy_distribution.species has an "
+                                                "invalid target atom id.");
+        }
+    }
 
     // Output
     const std::string &fname = Output.outfilename;
     if (fname.empty() && !AcceptIncomplete)
         throw std::invalid_argument("Output.outfilename is empty.");
 
+    if (Output.event_position_resolution < 0.f)
+        throw std::invalid_argument("Output.event_position_resolution is negative.");
+
+    if (Output.event_deflate_level < 0 || Output.event_deflate_level > 9)
+        throw std::invalid_argument("Output.event_deflate_level must be in [0, 9].");
+
+    if (Output.event_chunk_kb < 1 || Output.event_chunk_kb > 65536)
+        throw std::invalid_argument("Output.event_chunk_kb must be in [1, 65536].");
+
+    if (Output.storage_interval < 0)
+        throw std::invalid_argument("Output.storage_interval is negative.");
+
+    if (Output.compression_threads < 0)
+        throw std::invalid_argument("Output.compression_threads is negative.");
+
+    auto check_filter = [this](const event_filter::parameters &p, const std::string &name) {
+        std::string pfx = "Output." + name + ".";
+        if (!(p.energy.empty() || (p.energy.size() == 2 && p.energy[0] <= p.energy[1])))
+            throw std::invalid_argument(pfx + "energy must be empty or [Emin, Emax].");
+        if (!(p.recoil_generation.empty()
+              || (p.recoil_generation.size() == 2
+                  && p.recoil_generation[0] <= p.recoil_generation[1])))
+            throw std::invalid_argument(pfx + "recoil_generation must be empty or [min, max].");
+        if (p.boxes.size() % 6)
+            throw std::invalid_argument(pfx + "boxes must have 6 values per box.");
+        for (size_t i = 0; i < p.boxes.size(); i += 6)
+            for (int k = 0; k < 3; ++k)
+                if (p.boxes[i + k] > p.boxes[i + k + 3])
+                    throw std::invalid_argument(pfx + "boxes min > max.");
+        if (p.max_rows < 0)
+            throw std::invalid_argument(pfx + "max_rows is negative.");
+        if (p.max_rows && Output.direct_event_output)
+            throw std::invalid_argument(pfx + "max_rows is not supported with "
+                                              "Output.direct_event_output.");
+    };
+    check_filter(Output.exit_filter, "exit_filter");
+    check_filter(Output.pka_filter, "pka_filter");
+    check_filter(Output.damage_filter, "damage_filter");
+    if (!Output.damage_filter.energy.empty())
+        throw std::invalid_argument("Output.damage_filter.energy is not supported.");
+
+    if (Output.store_cluster_events && !Simulation.cluster_analysis)
+        throw std::invalid_argument("Output.store_cluster_events requires "
+                                    "Simulation.cluster_analysis.");
+
     if (!fname.empty() && std::any_of(fname.begin(), fname.end(), [](unsigned char c) {
             return !(std::isalnum(c) || c == '_');
         })) {
@@ -149,7 +149,8 @@ NLOHMANN_JSON_SERIALIZE_ENUM(ion_beam::distribution_t,
                              { { ion_beam::InvalidDistribution, nullptr },
                                { ion_beam::SingleValue, "SingleValue" },
                                { ion_beam::Uniform, "Uniform" },
-                               { ion_beam::Gaussian, "Gaussian" } })
+                               { ion_beam::Gaussian, "Gaussian" },
+                               { ion_beam::Tabulated, "Tabulated" } })
 
 NLOHMANN_JSON_SERIALIZE_ENUM(ion_beam::geometry_t,
                              { { ion_beam::InvalidGeometry, nullptr },
@@ -190,6 +191,17 @@ NLOHMANN_JSON_SERIALIZE_ENUM(mccore::nrt_calculation_t,
                                { mccore::NRT_element, "NRT_element" },
                                { mccore::NRT_average, "NRT_average" } })
 
+NLOHMANN_JSON_SERIALIZE_ENUM(ion_queue::recoil_order_t,
+                             { { ion_queue::InvalidRecoilOrder, nullptr },
+                               { ion_queue::BreadthFirst, "BreadthFirst" },
+                               { ion_queue::DepthFirst, "DepthFirst" },
+                               { ion_queue::EnergyOrdered, "EnergyOrdered" } })
+
+NLOHMANN_JSON_SERIALIZE_ENUM(mccore::weight_window_quantity_t,
+                             { { mccore::InvalidWWQuantity, nullptr },
+                               { mccore::WWIonFlux, "IonFlux" },
+                               { mccore::WWDamage, "Damage" } })
+
 NLOHMANN_JSON_SERIALIZE_ENUM(flight_path_calc::flight_path_type_t,
                              { { flight_path_calc::InvalidPath, nullptr },
                                { flight_path_calc::Constant, "Constant" },
@@ -221,32 +233,50 @@ MY_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(atom::parameters, element, X, Ed, El,
 //     density,
 //     composition)
 
-MY_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(ion_beam::energy_distribution_t, type, center, fwhm)
+MY_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(ion_beam::energy_distribution_t, type, center, fwhm,
+                                          energy_bins, weights, species, file, stratified)
 
 MY_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(ion_beam::spatial_distribution_t, geometry, type, center,
                                           fwhm)
 
 MY_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(ion_beam::angular_distribution_t, type, center, fwhm)
 
+MY_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(ion_beam::phase_space_t, file, species, offset, recycle,
+                                          rotate, buffer_size)
+
 MY_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(ion_beam::parameters, ion, energy_distribution,
-                                          spatial_distribution, angular_distribution)
+                                          spatial_distribution, angular_distribution, phase_space)
 
 MY_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(mccore::parameters, simulation_type, screening_type,
                                           electronic_stopping, electronic_straggling,
                                           nrt_calculation, intra_cascade_recombination,
+                                          recoil_order, cluster_analysis, cluster_radius,
                                           time_ordered_cascades, correlated_recombination,
-                                          move_recoil, recoil_sub_ed)
+                                          move_recoil, recoil_sub_ed, cascade_library_size,
+                                          cascade_library_bins, cascade_library_file)
 
 MY_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(mccore::transport_options, flight_path_type,
                                           flight_path_const, min_energy, min_recoil_energy,
-                                          min_scattering_angle, max_rel_eloss, mfp_range)
+                                          min_scattering_angle, max_rel_eloss, mfp_range,
+                                          importance_planes, importance_values,
+                                          importance_regions, max_split, weight_window,
+                                          weight_window_ratio, weight_window_pilot,
+                                          weight_window_quantity, forced_pka_energy)
 
 MY_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(mcconfig::run_options, max_no_ions, max_cpu_time, threads,
-                                          seed)
+                                          seed, cascade_threads, pipeline_capacity,
+                                          target_rel_sem, precision_tally, precision_bin,
+                                          precision_min_ions)
+
+MY_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(event_filter::parameters, energy, species,
+                                          recoil_generation, boxes, max_rows)
 
 MY_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(mcconfig::output_options, title, outfilename,
                                           storage_interval, store_exit_events, store_pka_events,
-                                          store_damage_events, store_dedx)
+                                          store_damage_events, store_cluster_events,
+                                          direct_event_output, event_position_resolution,
+                                          event_deflate_level, event_shuffle, event_chunk_kb,
+                                          compression_threads, exit_filter, pka_filter, damage_filter, store_dedx)
 
 MY_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(coord_sys, origin, zaxis, xzvector)
 
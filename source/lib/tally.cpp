@@ -171,71 +171,85 @@ void tally::operator()(Event ev, const ion &i, const void *pv)
     int iid = i.myAtom()->id();
     size_t k;
     const pka_buffer *p;
+    // all scores are multiplied by the statistical weight
+    // the ionization counter is per cascade & unweighted
+    const double w = i.weight();
 
     switch (ev) {
 
     case Event::BoundaryCrossing:
         k = iid * ncells_ + i.prev_cellid();
-        A[isCollision](k) += i.ncoll();
-        A[isFlightPath](k) += i.path();
-        A[eLattice](k) += i.phonon();
-        A[eIoniz](k) += i.ioniz();
+        A[isCollision](k) += w * i.ncoll();
+        A[isFlightPath](k) += w * i.path();
+        A[eLattice](k) += w * i.phonon();
+        A[eIoniz](k) += w * i.ioniz();
         ionizationCounter_ += i.ioniz();
         break;
 
     case Event::Replacement:
         k = iid * ncells_ + i.cellid();
-        A[cR](k)++; // this atom, current cell
-        A[isCollision](k) += i.ncoll();
-        A[isFlightPath](k) += i.path();
-        A[eIoniz](k) += i.ioniz();
-        A[eLattice](k) += i.erg() + i.phonon();
+        A[cR](k) += w; // this atom, current cell
+        A[isCollision](k) += w * i.ncoll();
+        A[isFlightPath](k) += w * i.path();
+        A[eIoniz](k) += w * i.ioniz();
+        A[eLattice](k) += w * (i.erg() + i.phonon());
         ionizationCounter_ += i.ioniz();
         break;
 
     case Event::IonStop:
         k = iid * ncells_ + i.cellid();
-        A[cI](k)++; // add implantation at current pos
+        A[cI](k) += w; // add implantation at current pos
         if (i.recoil_id()) // if this is a recoil (not a beam ion)
-            A[eStored](k) += i.myAtom()->El() / 2; // Add half FP energy here to stored energy
-        A[isCollision](k) += i.ncoll();
-        A[isFlightPath](k) += i.path();
-        A[eIoniz](k) += i.ioniz();
-        A[eLattice](k) += i.erg() + i.phonon();
+            A[eStored](k) += w * i.myAtom()->El() / 2; // Add half FP energy here to stored energy
+        A[isCollision](k) += w * i.ncoll();
+        A[isFlightPath](k) += w * i.path();
+        A[eIoniz](k) += w * i.ioniz();
+        A[eLattice](k) += w * (i.erg() + i.phonon());
         ionizationCounter_ += i.ioniz();
         break;
 
-    case Event::Vacancy:
-        k = iid * ncells_ + i.cellid();
-        A[cV](k)++; // add a vacancy at current pos
-        A[eStored](k) += i.myAtom()->El() / 2; // Add half FP energy here to stored energy
-        break;
-
     case Event::IonExit:
         k = iid * ncells_ + i.prev_cellid();
-        A[cL](k)++;
+        A[cL](k) += w;
         // if it was a recoil
         // half FP energy is released as lattice thermal energy
         if (i.recoil_id())
-            A[eLattice](k) += i.myAtom()->El() / 2;
-        A[isCollision](k) += i.ncoll();
-        A[isFlightPath](k) += i.path();
-        A[eIoniz](k) += i.ioniz();
-        A[eLattice](k) += i.phonon();
-        A[eLost](k) += i.erg();
+            A[eLattice](k) += w * i.myAtom()->El() / 2;
+        A[isCollision](k) += w * i.ncoll();
+        A[isFlightPath](k) += w * i.path();
+        A[eIoniz](k) += w * i.ioniz();
+        A[eLattice](k) += w * i.phonon();
+        A[eLost](k) += w * i.erg();
         ionizationCounter_ += i.ioniz();
         break;
 
     case Event::CascadeComplete:
         k = iid * ncells_ + i.cellid();
-        A[cPKA](k)++;
+        A[cPKA](k) += w;
         // pv = pointer to pka_event struct
         p = reinterpret_cast<const pka_buffer *>(pv);
-        A[ePKA](k) += p->recoilE();
-        A[dpTdam_LSS](k) += p->Tdam_LSS();
-        A[dpVnrt_LSS](k) += p->NRT_LSS();
-        A[dpTdam](k) += p->Tdam();
-        A[dpVnrt](k) += p->NRT();
+        A[ePKA](k) += w * p->recoilE();
+        A[dpTdam_LSS](k) += w * p->Tdam_LSS();
+        A[dpVnrt_LSS](k) += w * p->NRT_LSS();
+        A[dpTdam](k) += w * p->Tdam();
+        A[dpVnrt](k) += w * p->NRT();
+        break;
+
+    default:
+        break;
+    }
+}
+
+void tally::operator()(Event ev, const defect &d, const defect_info &c)
+{
+    size_t k;
+
+    switch (ev) {
+
+    case Event::Vacancy:
+        k = d.myAtom()->id() * ncells_ + c.cellid;
+        A[cV](k) += c.weight; // add a vacancy at current pos
+        A[eStored](k) += c.weight * d.myAtom()->El() / 2; // Add half FP energy here to stored energy
         break;
 
     default:
@@ -94,18 +94,29 @@ std::vector<std::string> user_tally::bin_descriptions() const
 
 bool user_tally::get_bin(const ion &i, const void *pv)
 {
-    int n = bin_codes.size();
-    if (n == 0)
+    return get_bin(i.pos(), i.dir(), i.erg(), i.myAtom()->id(), i.recoil_id(), pv);
+}
+
+// a defect is binned with the direction & energy of the recoil that created it
+bool user_tally::get_bin(const defect &d, const defect_info &c)
+{
+    return get_bin(d.pos, c.dir, c.erg, d.myAtom()->id(), c.recoil_id, nullptr);
+}
+
+bool user_tally::get_bin(const vector3 &x, const vector3 &n, double erg, int atom_id,
+                         int recoil_id, const void *pv)
+{
+    int nbins = bin_codes.size();
+    if (nbins == 0)
         return false;
 
     // get ion position at user tally ref. frame
-    vector3 pos = par_.coordinate_system.transformPoint(i.pos());
-    vector3 dir = par_.coordinate_system.transformVector(i.dir());
+    vector3 pos = par_.coordinate_system.transformPoint(x);
+    vector3 dir = par_.coordinate_system.transformVector(n);
 
-    for (int j = 0; j < n; ++j) {
+    for (int j = 0; j < nbins; ++j) {
 
         float v; // value for tally scoring
-        // int atom_id = i.myAtom()->id();
 
         switch (bin_codes[j]) {
         case cX:
@@ -141,7 +152,7 @@ bool user_tally::get_bin(const ion &i, const void *pv)
         case cE:
             v = (event() == Event::CascadeComplete)
                     ? reinterpret_cast<const pka_buffer *>(pv)->recoilE()
-                    : i.erg();
+                    : erg;
             break;
         case cTdam:
             v = (event() == Event::CascadeComplete)
@@ -154,10 +165,10 @@ bool user_tally::get_bin(const ion &i, const void *pv)
                     : 0;
             break;
         case cAtom_id:
-            v = static_cast<float>(i.myAtom()->id());
+            v = static_cast<float>(atom_id);
             break;
         case cRecoil_id:
-            v = static_cast<float>(i.recoil_id());
+            v = static_cast<float>(recoil_id);
             break;
         default:
             break;
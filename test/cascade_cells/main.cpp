@@ -0,0 +1,150 @@
+#include "cascade.h"
+#include "target.h"
+
+#include <iostream>
+#include <random>
+#include <vector>
+
+/** \file
+ *
+ * Randomized equivalence test of defect_cell_list against a linear
+ * scan of all defects, the recombination partner search used before the
+ * cell list was introduced.
+ *
+ * Defects of 2 species with different Rc are created on a coarse lattice,
+ * so that exact distance ties are frequent, in boxes with various
+ * combinations of periodic axes, including boxes of less than 3 cells.
+ * Each defect is matched against the anti-defects of the same species,
+ * recombining with the closest one within Rc, ties going to the earliest stored.
+ * The recombined partners and the surviving defects in insertion order must be
+ * the same for both methods.
+ */
+
+using namespace std;
+
+// linear list, the reference implementation
+struct linear_list
+{
+    vector<defect_cell_list::entry> v;
+
+    void insert(const defect &d, size_t seq) { v.push_back({ d, seq }); }
+
+    // same as the old find_rc_partner, with ties broken by insertion order
+    int find_partner(const defect &d1, const grid3D &g) const
+    {
+        float rc = d1.myAtom()->Rc();
+        int best = -1;
+        float dbest = 0.f;
+        for (int i = 0; i < (int)v.size(); ++i) {
+            if (d1.myAtom() != v[i].d.myAtom())
+                continue;
+            float d = g.distance(d1.pos, v[i].d.pos);
+            if (d < rc && (best < 0 || d < dbest)) {
+                best = i;
+                dbest = d;
+            }
+        }
+        return best;
+    }
+
+    void erase(int i) { v.erase(v.begin() + i); }
+};
+
+// run one random cascade of n defects, return the # of mismatches
+int test_cascade(const grid3D &g, const vector<const atom *> &atoms, int n, mt19937 &gen)
+{
+    float h = 0.f;
+    for (const atom *a : atoms)
+        h = max(h, a->Rc());
+
+    defect_cell_list cl[2]; // 0: vacancies, 1: interstitials
+    linear_list ll[2];
+    for (auto &c : cl)
+        c.init(g, h);
+
+    // lattice step 1/8 nm: positions & distances are exact, ties are common
+    const float step = 0.125f;
+    const grid1D *ax[3] = { &g.x(), &g.y(), &g.z() };
+    uniform_int_distribution<int> coin(0, 1);
+
+    int errors = 0;
+    size_t seq = 0;
+    for (int k = 0; k < n; ++k) {
+        defect d;
+        for (int i = 0; i < 3; ++i) {
+            int m = int(ax[i]->w() / step);
+            d.pos[i] = ax[i]->front() + step * uniform_int_distribution<int>(0, m - 1)(gen);
+        }
+        int t = coin(gen);
+        d.type = t ? ion::interstitial : ion::vacancy;
+        d.atom_ = atoms[coin(gen) % atoms.size()];
+        d.uid = k;
+        d.info = 0;
+        d.t = 0;
+
+        // search among the anti-defects
+        const defect_cell_list::entry *e = cl[1 - t].find_partner(d, g);
+        int j = ll[1 - t].find_partner(d, g);
+        if ((e == nullptr) != (j < 0) || (e && e->seq != ll[1 - t].v[j].seq)) {
+            errors++;
+            cout << "partner mismatch for defect " << k << ": cell list "
+                 << (e ? int(e->seq) : -1) << ", linear scan "
+                 << (j < 0 ? -1 : int(ll[1 - t].v[j].seq)) << endl;
+            return errors;
+        }
+        if (e) {
+            cl[1 - t].erase(e);
+            ll[1 - t].erase(j);
+        } else {
+            cl[t].insert(d, seq);
+            ll[t].insert(d, seq);
+            seq++;
+        }
+    }
+
+    // surviving defects in insertion order
+    for (int t = 0; t < 2; ++t) {
+        vector<defect_cell_list::entry> v;
+        cl[t].take_all(v);
+        bool same = v.size() == ll[t].v.size();
+        for (size_t i = 0; same && i < v.size(); ++i)
+            same = v[i].seq == ll[t].v[i].seq && v[i].d.uid == ll[t].v[i].d.uid;
+        if (!same) {
+            errors++;
+            cout << "surviving " << (t ? "interstitials" : "vacancies") << " differ" << endl;
+        }
+    }
+    return errors;
+}
+
+int main()
+{
+    atom::parameters p1, p2;
+    p1.Rc = 0.5f;
+    p2.Rc = 0.875f;
+    atom a1(p1), a2(p2);
+    vector<const atom *> atoms{ &a1, &a2 };
+
+    mt19937 gen(12345);
+
+    // box widths: 1 or 2 cells (periodic neighbor range covers all cells) and many cells
+    const float widths[] = { 1.f, 1.5f, 4.f, 10.f };
+
+    int ntests = 0, errors = 0;
+    for (int pmask = 0; pmask < 8; ++pmask) {
+        for (float w : widths) {
+            grid3D g;
+            g.setX(-w / 2, w, 4, pmask & 1);
+            g.setY(0.f, w, 4, pmask & 2);
+            g.setZ(0.f, 2 * w, 4, pmask & 4);
+            for (int n : { 50, 400, 2000 }) {
+                errors += test_cascade(g, atoms, n, gen);
+                ntests++;
+            }
+        }
+    }
+
+    cout << "defect_cell_list vs linear scan: " << ntests << " cascades, " << errors
+         << " errors" << endl;
+    return errors ? 1 : 0;
+}
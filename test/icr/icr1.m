@@ -4,10 +4,9 @@ clear
 pkg load hdf5oct
 
 function [nv,nr]=makehist(Ed,bins,D)
-  Td = D(5,:)';
-  V = D(6,:)';
-  Rep = D(7,:)';
-  R = D(9,:)';
+  Td = D.Tdam(:);
+  V = D.V1(:);
+  R = D.ICR1(:);
 
   td = Td;
   v=V;
@@ -34,9 +33,9 @@ end
 
 E = logspace(1,6,51);
 
-D = h5load('outEd10eV.h5','/events/pka/event_data');
+D = h5read('outEd10eV.h5','/events/pka/event_data');
 [V10,R10]=makehist(10,E,D);
-D = h5load('outEd40eV.h5','/events/pka/event_data');
+D = h5read('outEd40eV.h5','/events/pka/event_data');
 [V40,R40]=makehist(40,E,D);
 
 nrt = E/100;
@@ -4,8 +4,8 @@ clear
 pkg load hdf5oct
 
 function [nv,nr,nrc]=makehist(Ed,bins,D)
-  Td = D(5,:);
-  X = D([6 9 10],:); % [V ICR Corr-ICR]
+  Td = D.Tdam(:)';
+  X = [D.V1(:) D.ICR1(:) D.("Corr. ICR1")(:)]'; % [V ICR Corr-ICR]
 
   j = find(Td < Ed);
   Td(j)=[];
@@ -31,9 +31,9 @@ end
 E = logspace(1,6,51);
 
 Ed=40;
-D = h5load('outEd40eV.h5','/events/pka/event_data');
+D = h5read('outEd40eV.h5','/events/pka/event_data');
 [V, R, Rc]=makehist(Ed,E,D);
-D = h5load('outEd40eVNoCorr.h5','/events/pka/event_data');
+D = h5read('outEd40eVNoCorr.h5','/events/pka/event_data');
 [V2, R2, Rc2]=makehist(Ed,E,D);
 
 
@@ -8,10 +8,9 @@ pkg load hdf5oct
 Nh = 1000;
 
 function [nv,nr]=makehist(Ed,bins,D)
-  Td = D(5,:)';
-  V = D(6,:)';
-  Rep = D(7,:)';
-  R = D(9,:)';
+  Td = D.Tdam(:);
+  V = D.V1(:);
+  R = D.ICR1(:);
 
   td = Td;
   v=V;
@@ -38,11 +37,11 @@ end
 
 E = logspace(1,6,51);
 
-D = h5load('outEd40eV.h5','/events/pka/event_data');
+D = h5read('outEd40eV.h5','/events/pka/event_data');
 [V40,R40]=makehist(40,E,D);
-D = h5load('outEd40eVMvR.h5','/events/pka/event_data');
+D = h5read('outEd40eVMvR.h5','/events/pka/event_data');
 [V40mv,R40mv]=makehist(40,E,D);
-D = h5load('outEd40eVMvRsubEd.h5','/events/pka/event_data');
+D = h5read('outEd40eVMvRsubEd.h5','/events/pka/event_data');
 [V40mvs,R40mvs]=makehist(40,E,D);
 
 nrt = E/100;
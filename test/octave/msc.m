@@ -10,8 +10,8 @@ lbls = {'OpenTRIM', 'MW2005-Geant4', 'MW2005-Quasi Analytic', 'MCNP'};
 
 fname = '../msc/opentrim/HinC.h5';
 A = h5read(fname,'/events/exit/event_data');
-j = find(A(5,:)>=440 & A(2,:)==0);
-mu = 0.5*(1-A(8,j));
+j = find(A.x>=440 & A.iid==0);
+mu = 0.5*(1-A.nx(j));
 Th = mean(sqrt(4*mu));
 h = histc(mu,mux)/size(mu,2);
 H = h(1:end-1)./dOmega;
@@ -45,8 +45,8 @@ print2png(gcf,[12 9],'msc_HinC')
 
 fname = '../msc/opentrim/HeinC.h5';
 A = h5read(fname,'/events/exit/event_data');
-j = find(A(5,:)>=440 & A(2,:)==0);
-mu = 0.5*(1-A(8,j));
+j = find(A.x>=440 & A.iid==0);
+mu = 0.5*(1-A.nx(j));
 Th = mean(sqrt(4*mu));
 h = histc(mu,mux)/size(mu,2);
 H = h(1:end-1)./dOmega;
@@ -0,0 +1,39 @@
+#! /usr/bin/bash
+#
+# Time-ordered cascade timing for 100 keV - 1 MeV Fe PKAs in Fe
+#
+# For each PKA energy a copy of b8.json, casc_<E>keV.json, is created with
+#   Simulation.time_ordered_cascades = true
+#   IonBeam.energy_distribution.center = E
+#   a 2 um target, to contain the cascades, with the PKA source at its center
+# and the wall time of each run is printed
+#
+# To compare two builds, run the script with each of them, e.g.
+#   OPENTRIM=/path/to/old/opentrim ./cascade_timing.sh
+#
+# Usage: ./cascade_timing.sh [# of PKAs per energy, default 200]
+
+N=${1:-200}
+OPENTRIM=${OPENTRIM:-opentrim}
+
+echo -e "E [keV]\tPKAs\twall time [s]"
+for E in 100 300 1000; do
+    python3 - b8.json casc_${E}keV.json $E $N <<'PY'
+import json, sys
+c = json.load(open(sys.argv[1]))
+E, N = float(sys.argv[3]), int(sys.argv[4])
+c["Run"]["max_no_ions"] = N
+c["Simulation"]["time_ordered_cascades"] = True
+c["IonBeam"]["energy_distribution"]["center"] = E * 1000
+L = 2000
+c["Target"]["size"] = [L, L, L]
+c["IonBeam"]["spatial_distribution"]["center"] = [L / 2, L / 2, L / 2]
+c["Output"]["outfilename"] = "casc_%dkeV" % E
+c["Output"]["title"] = "%d keV Fe in Fe time-ordered cascades" % E
+json.dump(c, open(sys.argv[2], "w"), indent=4)
+PY
+    t0=$(date +%s.%N)
+    $OPENTRIM -f casc_${E}keV.json > /dev/null
+    t1=$(date +%s.%N)
+    echo -e "$E\t$N\t$(echo "$t1 - $t0" | bc)"
+done
@@ -0,0 +1,43 @@
+#! /usr/bin/bash
+#
+# Check forced PKA production against the analog simulation
+#
+# Runs bN.json (default b1) with Transport.forced_pka_energy = Ef
+# (bN_fp.h5) and compares to the analog run bN.h5 (see runall.sh).
+# The PKA tallies and the vacancy tally must agree within
+# statistical error, i.e. per cell |x_fp - x| < 3*sqrt(sem_fp^2 + sem^2)
+# for at least 99% of cells with non-zero score.
+#
+# Needs python3 with h5py & numpy.
+#
+# Usage: ./forced_pka.sh [Ef in eV, default 1000] [N, default 1]
+
+Ef=${1:-1000}
+n=${2:-1}
+
+python3 - b$n.json b${n}_fp.json $Ef <<'PY'
+import json, sys
+c = json.load(open(sys.argv[1]))
+c.setdefault("Transport", {})["forced_pka_energy"] = float(sys.argv[3])
+c["Output"]["outfilename"] += "_fp"
+c["Output"]["title"] += " (forced PKAs > %s eV)" % sys.argv[3]
+json.dump(c, open(sys.argv[2], "w"), indent=4)
+PY
+opentrim -f b${n}_fp.json || exit 1
+
+python3 - b$n.h5 b${n}_fp.h5 <<'PY'
+import sys
+import h5py
+import numpy as np
+a, b = h5py.File(sys.argv[1], "r"), h5py.File(sys.argv[2], "r")
+ok = True
+for t in ["pka_damage/Pka", "pka_damage/Pka_energy", "damage_events/Vacancies"]:
+    x, y = a["tally/" + t][()], b["tally/" + t][()]
+    s = np.hypot(a["tally/" + t + "_sem"][()], b["tally/" + t + "_sem"][()])
+    m = (x != 0) | (y != 0)
+    z = np.abs(x - y)[m] / np.maximum(s[m], 1e-30)
+    f = np.mean(z < 3)
+    print("%-24s cells %6d  within 3 sem %.4f  max dev %.2f sem" % (t, m.sum(), f, z.max()))
+    ok = ok and f >= 0.99
+sys.exit(0 if ok else 1)
+PY
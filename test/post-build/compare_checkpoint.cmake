@@ -0,0 +1,23 @@
+# The checkpoint must be from the middle of the run
+execute_process(
+    COMMAND "${H5DIFF}" "${CKPT}" "${FILE1}" /run_info/total_ion_count
+    RESULT_VARIABLE result
+    OUTPUT_QUIET
+    ERROR_QUIET
+)
+if(NOT result EQUAL 1)
+    message(FATAL_ERROR "${CKPT} is not a checkpoint of an unfinished run")
+endif()
+
+# tallies & events must be identical, no tolerance
+foreach(target IN ITEMS /tally /events)
+    execute_process(
+        COMMAND "${H5DIFF}" -v "${FILE1}" "${FILE2}" "${target}"
+        RESULT_VARIABLE result
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE error
+    )
+    if(result)
+        message(FATAL_ERROR "h5diff mismatch in ${target}:\n${output}${error}")
+    endif()
+endforeach()